@@ -49,7 +49,7 @@ void bitfield_init(bitfield_t * me, const unsigned int nbits)
 
 bitfield_t* bitfield_new(const unsigned int nbits)
 {
-    bitfield_t* me = malloc(sizeof(bitfield_t*));
+    bitfield_t* me = malloc(sizeof(bitfield_t));
     bitfield_init(me, nbits);
     return me;
 }
@@ -63,8 +63,8 @@ void bitfield_clone(bitfield_t * me, bitfield_t * clone)
 
 void bitfield_free(bitfield_t* me)
 {
-    free(me);
     free(me->bits);
+    free(me);
 }
 
 void bitfield_mark(bitfield_t * me, const unsigned int bit)
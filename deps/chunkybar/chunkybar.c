@@ -7,14 +7,17 @@
 
 #include "chunkybar.h"
 
-typedef struct var_chunk_s var_chunk_t;
-
-struct var_chunk_s
+/* Forked from willemt/chunkybar, which keeps chunks in a linked list.
+ * tests/test_chunkybar.c checks this version against a bitmap.
+ *
+ * Chunks are kept in an array sorted by offset. Touching chunks are merged,
+ * so the array never holds overlapping or adjacent chunks and lookups can
+ * binary search it. */
+typedef struct
 {
     unsigned int offset;
     unsigned int len;
-    var_chunk_t *next;
-};
+} var_chunk_t;
 
 static unsigned int __capmax(
     unsigned int val,
@@ -31,15 +34,84 @@ static unsigned int __capmax(
     }
 }
 
+/**
+ * @return index of the first chunk that ends at or after offset */
+static unsigned int __first_ending_from(
+    const chunkybar_t * me,
+    const unsigned int offset
+)
+{
+    const var_chunk_t *c = me->chunks;
+    unsigned int lo = 0, hi = me->nchunks;
+
+    while (lo < hi)
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (c[mid].offset + c[mid].len < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * @return index of the first chunk that starts after offset */
+static unsigned int __first_starting_after(
+    const chunkybar_t * me,
+    const unsigned int offset
+)
+{
+    const var_chunk_t *c = me->chunks;
+    unsigned int lo = 0, hi = me->nchunks;
+
+    while (lo < hi)
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (c[mid].offset <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * Replace chunks [from, to) with n chunks, leaving them for the caller to
+ * fill in */
+static void __splice(
+    chunkybar_t * me,
+    const unsigned int from,
+    const unsigned int to,
+    const unsigned int n
+)
+{
+    var_chunk_t *c;
+    unsigned int nchunks = me->nchunks - (to - from) + n;
+
+    if (me->size < nchunks)
+    {
+        me->size = nchunks < 8 ? 8 : nchunks * 2;
+        me->chunks = realloc(me->chunks, sizeof(var_chunk_t) * me->size);
+        assert(me->chunks);
+    }
+
+    c = me->chunks;
+    memmove(&c[from + n], &c[to], sizeof(var_chunk_t) * (me->nchunks - to));
+    me->nchunks = nchunks;
+}
+
 void *chunky_new(const unsigned int max)
 {
     chunkybar_t *me;
 
     me = calloc(1, sizeof(chunkybar_t));
-    me->max = max;
-    me->first_chunk = NULL;
-
     assert(me);
+    me->max = max;
     return me;
 }
 
@@ -48,15 +120,8 @@ void chunky_free(
 )
 {
     chunkybar_t *me = ra;
-    var_chunk_t *b, *prev;
-
-    for (b = me->first_chunk; b; )
-    {
-        prev = b;
-        b=b->next;
-        free(prev);
-    }
 
+    free(me->chunks);
     free(me);
 }
 
@@ -72,12 +137,7 @@ void chunky_mark_all_incomplete(chunkybar_t * me)
 
 int chunky_get_num_chunks(const chunkybar_t * me)
 {
-    const var_chunk_t *b;
-    int num;
-
-    for (num=0, b = me->first_chunk; b; num++, b = b->next);
-
-    return num;
+    return me->nchunks;
 }
 
 void chunky_mark_complete(
@@ -86,100 +146,32 @@ void chunky_mark_complete(
     const unsigned int len
 )
 {
-    var_chunk_t *this = NULL, *prev;
-
-    /* initialise first chunk */
-    if (!me->first_chunk)
-    {
-        var_chunk_t *b;
+    var_chunk_t *c;
+    unsigned int lo, hi, start, end;
 
-        b = malloc(sizeof(var_chunk_t));
-        b->len = len;
-        b->offset = offset;
-        b->next = NULL;
-
-        /* set the node in one moment */
-        me->first_chunk = b;
+    if (0 == len)
         return;
-    }
 
-    /* get 1st chunk that has a higher offset than us */
+    /* chunks [lo, hi) touch the new chunk and are combined with it */
+    lo = __first_ending_from(me, offset);
+    hi = __first_starting_after(me, offset + len);
 
-    prev = me->first_chunk;
+    start = offset;
+    end = offset + len;
 
-    /* we are at the beginning of the chunks */
-    if (offset < prev->offset)
+    if (lo < hi)
     {
-        var_chunk_t *b;
-
-        b = malloc(sizeof(var_chunk_t));
-        b->len = len;
-        b->offset = offset;
-        b->next = this = prev;
-        prev = b;
-
-        /* set the node in one moment */
-        me->first_chunk = b;
+        c = me->chunks;
+        if (c[lo].offset < start)
+            start = c[lo].offset;
+        if (end < c[hi - 1].offset + c[hi - 1].len)
+            end = c[hi - 1].offset + c[hi - 1].len;
     }
-    else
-    {
-        /*  find a place where our offset is equal or greater */
-        while (prev->next && (prev->next->offset <= offset))
-        {
-            prev = prev->next;
-        }
-
-        this = prev->next;
 
-        /* The left chunk eats/touches this new one...
-         * |00000LLN00000|;
-         * |00000LLNL0000|
-         * Combine the old with new */
-        if (offset <= prev->offset + prev->len)
-        {
-            /* completely ate this one!
-             * |00000LLNL0000| */
-            if (offset + len <= prev->offset + prev->len)
-            {
-
-            }
-            else
-            {
-                /* increase coverage */
-                prev->len = (offset + len) - prev->offset;
-                /* might eat another... */
-            }
-        }
-        else
-        {
-            var_chunk_t *b;
-
-            b = malloc(sizeof(var_chunk_t));
-            b->offset = offset;
-            b->len = len;
-            b->next = this;
-            prev->next = b;
-            prev = b;
-        }
-    }
-
-    /* prev will feast! */
-    if (this && this->offset <= prev->offset + prev->len)
-    {
-        do
-        {
-            /* not eaten */
-            if (!(this->offset + this->len <= prev->offset + prev->len))
-            {
-                prev->len = (this->offset + this->len) - prev->offset;
-            }
-
-            prev->next = this->next;
-            free(this);
-            this = prev->next;
-        }
-        while (this && this->offset <= prev->offset + prev->len);
-    }
+    __splice(me, lo, hi, 1);
+    c = me->chunks;
+    c[lo].offset = start;
+    c[lo].len = end - start;
 }
 
 void chunky_mark_incomplete(
@@ -188,85 +180,46 @@ void chunky_mark_incomplete(
     const unsigned int len
 )
 {
-    var_chunk_t *this = NULL, *prev;
+    var_chunk_t *c = me->chunks, rem[2];
+    unsigned int lo, hi, n = 0, end = offset + len;
 
-    if (!me->first_chunk)
+    if (0 == len || 0 == me->nchunks)
         return;
 
-    /* get 1st chunk that has a higher offset than us */
+    /* chunks [lo, hi) overlap the removed chunk */
+    lo = __first_ending_from(me, offset + 1);
+    hi = __first_starting_after(me, end - 1);
 
-    prev = NULL;
-    this = me->first_chunk;
+    if (hi <= lo)
+        return;
 
-    while (this)
+    /* swallow right
+     * |00000LLX00000| */
+    if (c[lo].offset < offset)
     {
-        /*  whole chunk gets eaten */
-        if (offset <= this->offset &&
-                this->offset + this->len <= offset + len)
-        {
-            if (prev)
-            {
-                prev->next = this->next;
-                free(this);
-                this = prev;
-            }
-            else
-            {
-                me->first_chunk = this->next;
-                free(this);
-                this = me->first_chunk;
-                if (!this) break;
-            }
-        }
-        /*
-         * In the middle
-         * |00000LXL00000|
-         */
-        else if (this->offset < offset &&
-                offset + len < this->offset + this->len)
-        {
-            var_chunk_t *b;
-
-            b = malloc(sizeof(var_chunk_t));
-            b->offset = offset + len;
-            b->len = this->len - len - (offset - this->offset);
-            b->next = this->next;
-
-            this->len = offset - this->offset;
-            this->next = b;
-        }
-        /*
-         * swallow left
-         * |00000XLL00000|
-         */
-        else if (this->offset < offset + len &&
-                offset + len < this->offset + this->len)
-        {
-            this->len -= offset+len - this->offset;
-            this->offset = offset+len;
-        }
-        /*
-         * swallow right
-         * |00000LLX00000|
-         */
-        else if (this->offset < offset &&
-                offset < this->offset + this->len &&
-                this->offset + this->len <= offset + len)
-        {
-            this->len = offset - this->offset;
-        }
+        rem[n].offset = c[lo].offset;
+        rem[n].len = offset - c[lo].offset;
+        n++;
+    }
 
-        prev = this;
-        this = this->next;
+    /* swallow left
+     * |00000XLL00000| */
+    if (end < c[hi - 1].offset + c[hi - 1].len)
+    {
+        rem[n].offset = end;
+        rem[n].len = c[hi - 1].offset + c[hi - 1].len - end;
+        n++;
     }
+
+    __splice(me, lo, hi, n);
+    memcpy((var_chunk_t*)me->chunks + lo, rem, sizeof(var_chunk_t) * n);
 }
 
 int chunky_is_complete(const chunkybar_t * me)
 {
-    const var_chunk_t *b;
+    const var_chunk_t *c = me->chunks;
 
-    b = me->first_chunk;
-    return b && !b->next && b->len == me->max;
+    return 1 == me->nchunks && c[0].len == me->max;
 }
 
 void chunky_get_incomplete(
@@ -276,47 +229,44 @@ void chunky_get_incomplete(
     const unsigned int max
 )
 {
-    const var_chunk_t *b;
+    const var_chunk_t *c = me->chunks;
 
     *offset = *len = 0;
-    b = me->first_chunk;
 
-    if (!b)
+    if (0 == me->nchunks)
     {
         *offset = 0;
         *len = max;
     }
     else
     {
-        if (b->offset != 0)
+        if (c[0].offset != 0)
         {
             *offset = 0;
 
-            if (b->next)
+            if (1 < me->nchunks)
             {
-                *len = b->next->offset - b->offset;
+                *len = c[1].offset - c[0].offset;
             }
             else
             {
-                *len = b->offset;
+                *len = c[0].offset;
             }
         }
-        else if (!b->next)
+        else if (1 == me->nchunks)
         {
-            *offset = b->len;
+            *offset = c[0].len;
             *len = max;
         }
         else
         {
-            *offset = 0 + b->len;
-            *len = b->next->offset - b->len;
+            *offset = 0 + c[0].len;
+            *len = c[1].offset - c[0].len;
         }
     }
 
     *len = __capmax(*len, max);
 
-//    printf("%d %d %d %d\n", me->max, *len, max, *offset + *len);
-
     /*  make sure we aren't going over the boundary */
     if (me->max < *offset + *len)
     {
@@ -328,12 +278,12 @@ unsigned int chunky_get_nbytes_completed(
     const chunkybar_t * me
 )
 {
-    const var_chunk_t *b;
-    unsigned int nbytes;
+    const var_chunk_t *c = me->chunks;
+    unsigned int i, nbytes;
 
-    for (b = me->first_chunk, nbytes=0; b; b = b->next)
+    for (i = 0, nbytes = 0; i < me->nchunks; i++)
     {
-        nbytes += b->len;
+        nbytes += c[i].len;
     }
 
     return nbytes;
@@ -345,36 +295,49 @@ int chunky_have(
     const unsigned int len
 )
 {
-    const var_chunk_t *b;
+    const var_chunk_t *c = me->chunks;
+    unsigned int i;
 
-    for (b = me->first_chunk; b; b = b->next)
-    {
-        if (offset < b->offset)
-        {
+    /* the only chunk that could contain us is the last one starting
+     * at or before our offset */
+    i = __first_starting_after(me, offset);
+    if (0 == i)
+        return 0;
 
-        }
-        else if (b->offset <= offset)
-        {
-            if (offset + len <= b->offset + b->len)
-            {
-                return 1;
-            }
-        }
-        else
-        {
-            return 0;
-        }
-    }
+    return offset + len <= c[i - 1].offset + c[i - 1].len;
+}
+
+void chunky_iterator(const chunkybar_t * me, chunky_iterator_t* iter)
+{
+    iter->prog = me;
+    iter->idx = 0;
+}
+
+int chunky_iterator_next(
+    chunky_iterator_t* iter,
+    unsigned int *offset,
+    unsigned int *len
+)
+{
+    const var_chunk_t *c;
+
+    if (iter->prog->nchunks <= iter->idx)
+        return 0;
 
-    return 0;
+    c = iter->prog->chunks;
+    *offset = c[iter->idx].offset;
+    *len = c[iter->idx].len;
+    iter->idx++;
+    return 1;
 }
 
 void chunky_print_contents(const chunkybar_t * me)
 {
-    const var_chunk_t *b;
+    const var_chunk_t *c = me->chunks;
+    unsigned int i;
 
-    for (b = me->first_chunk; b; b = b->next)
+    for (i = 0; i < me->nchunks; i++)
     {
-        printf("%d to %d\n", b->offset, b->offset + b->len);
+        printf("%d to %d\n", c[i].offset, c[i].offset + c[i].len);
     }
 }
@@ -2,7 +2,10 @@
 #define CHUNKYBAR_H
 
 typedef struct {
-    void *first_chunk;
+    /* complete chunks sorted by offset */
+    void *chunks;
+    unsigned int nchunks;
+    unsigned int size;
     unsigned int max;
 } chunkybar_t;
 
@@ -65,6 +68,24 @@ int chunky_have(
         const unsigned int offset,
         const unsigned int len);
 
+typedef struct {
+    const chunkybar_t* prog;
+    unsigned int idx;
+} chunky_iterator_t;
+
+/**
+ * Iterate over complete chunks in order of offset */
+void chunky_iterator(const chunkybar_t * prog, chunky_iterator_t* iter);
+
+/**
+ * @param offset Set to the offset of the next complete chunk
+ * @param len Set to the length of the next complete chunk
+ * @return 1 if there was another chunk; 0 otherwise */
+int chunky_iterator_next(
+        chunky_iterator_t* iter,
+        unsigned int *offset,
+        unsigned int *len);
+
 void chunky_print_contents(
         const chunkybar_t * prog);
 
@@ -0,0 +1,231 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. 
+ *
+ * @file
+ * @brief Allowed fast sets (BEP 6)
+ *        Pieces a peer can request even while we are choking it
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* for uint32_t */
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pwp_local.h"
+#include "linked_list_hashmap.h"
+#include "pwp_allowed_fast.h"
+
+/* drop cached sets when we have seen this many subnets */
+#define MAX_CACHED_SUBNETS 1024
+
+typedef struct {
+    uint32_t subnet;
+    unsigned int npieces;
+    unsigned int pieces[];
+} subnet_set_t;
+
+typedef struct {
+    char infohash[INFO_HASH_LEN];
+    unsigned int npieces;
+    unsigned int k;
+
+    /* subnet_set_t keyed by /24 subnet */
+    hashmap_t *sets;
+} allowed_fast_t;
+
+#define rol(v,b) (((v) << (b)) | ((v) >> (32 - (b))))
+
+/**
+ * SHA-1 of a message which is less than 56 bytes long */
+static void __sha1(const unsigned char* msg, unsigned int len,
+        unsigned char* digest)
+{
+    uint32_t h[5] = {
+        0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    unsigned char block[64];
+    int i;
+
+    assert(len < 56);
+
+    /* pad into a single block */
+    memset(block, 0, sizeof(block));
+    memcpy(block, msg, len);
+    block[len] = 0x80;
+    block[62] = (len * 8) >> 8;
+    block[63] = (len * 8) & 0xff;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+            (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+    for (i = 16; i < 80; i++)
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+
+    for (i = 0; i < 80; i++)
+    {
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        t = rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = t;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+
+    for (i = 0; i < 5; i++)
+    {
+        digest[i * 4] = h[i] >> 24;
+        digest[i * 4 + 1] = h[i] >> 16;
+        digest[i * 4 + 2] = h[i] >> 8;
+        digest[i * 4 + 3] = h[i];
+    }
+}
+
+int pwp_allowed_fast_generate(
+        uint32_t ip,
+        const char* infohash,
+        unsigned int npieces,
+        unsigned int k,
+        unsigned int* pieces)
+{
+    unsigned char x[4 + INFO_HASH_LEN];
+    unsigned int n = 0, i, j;
+
+    /* we can't have more distinct pieces than the torrent has */
+    if (npieces < k)
+        k = npieces;
+
+    /* x = (0xFFFFFF00 & ip) + infohash */
+    ip &= 0xFFFFFF00;
+    x[0] = ip >> 24;
+    x[1] = ip >> 16;
+    x[2] = ip >> 8;
+    x[3] = 0;
+    memcpy(x + 4, infohash, INFO_HASH_LEN);
+
+    /* each round feeds the previous digest back into SHA-1 */
+    unsigned char* src = x;
+    unsigned int src_len = sizeof(x);
+
+    while (n < k)
+    {
+        __sha1(src, src_len, x);
+        src = x;
+        src_len = 20;
+
+        for (i = 0; i < 5 && n < k; i++)
+        {
+            uint32_t y = (uint32_t)x[i * 4] << 24 | (uint32_t)x[i * 4 + 1] << 16 |
+                (uint32_t)x[i * 4 + 2] << 8 | (uint32_t)x[i * 4 + 3];
+            unsigned int idx = y % npieces;
+
+            for (j = 0; j < n && pieces[j] != idx; j++);
+            if (j == n)
+                pieces[n++] = idx;
+        }
+    }
+
+    return n;
+}
+
+static unsigned long __subnet_hash(const void *obj)
+{
+    return *(const uint32_t*)obj;
+}
+
+static long __subnet_cmp(const void *obj, const void *other)
+{
+    return *(const uint32_t*)obj != *(const uint32_t*)other;
+}
+
+void* pwp_allowed_fast_new(
+        const char* infohash,
+        unsigned int npieces,
+        unsigned int k)
+{
+    allowed_fast_t* me;
+
+    me = calloc(1, sizeof(allowed_fast_t));
+    memcpy(me->infohash, infohash, INFO_HASH_LEN);
+    me->npieces = npieces;
+    me->k = k;
+    me->sets = hashmap_new(__subnet_hash, __subnet_cmp, 11);
+    return me;
+}
+
+static void __clear(allowed_fast_t* me)
+{
+    hashmap_iterator_t iter;
+    char* k;
+
+    /* Keys live within the sets. Iterating keys doesn't look at them, so
+     * each set can be freed as we go and the map emptied afterwards */
+    hashmap_iterator(me->sets, &iter);
+    while ((k = hashmap_iterator_next(me->sets, &iter)))
+        free(k - offsetof(subnet_set_t, subnet));
+    hashmap_clear(me->sets);
+}
+
+void pwp_allowed_fast_release(void* af)
+{
+    allowed_fast_t* me = af;
+
+    __clear(me);
+    hashmap_freeall(me->sets);
+    free(me);
+}
+
+const unsigned int* pwp_allowed_fast_get(void* af, uint32_t ip,
+        unsigned int* npieces)
+{
+    allowed_fast_t* me = af;
+    subnet_set_t* s;
+    uint32_t subnet = ip & 0xFFFFFF00;
+
+    if (!(s = hashmap_get(me->sets, &subnet)))
+    {
+        if (MAX_CACHED_SUBNETS <= hashmap_count(me->sets))
+            __clear(me);
+
+        s = malloc(sizeof(subnet_set_t) + sizeof(unsigned int) * me->k);
+        s->subnet = subnet;
+        s->npieces = pwp_allowed_fast_generate(ip, me->infohash,
+                me->npieces, me->k, s->pieces);
+        hashmap_put(me->sets, &s->subnet, s);
+    }
+
+    *npieces = s->npieces;
+    return s->pieces;
+}
@@ -0,0 +1,45 @@
+#ifndef PWP_ALLOWED_FAST_H
+#define PWP_ALLOWED_FAST_H
+
+/* BEP 6 recommends 10 allowed fast pieces per peer */
+#define PWP_ALLOWED_FAST_DEFAULT_K 10
+
+/**
+ * Generate the allowed fast set for a peer (BEP 6 canonical algorithm)
+ * @param ip The peer's IPv4 address, in host byte order
+ * @param infohash 20 byte info hash
+ * @param npieces Number of pieces within the torrent
+ * @param k Number of pieces to generate
+ * @param pieces Array of at least k elements to write piece indices to
+ * @return number of pieces written; less than k if the torrent is small */
+int pwp_allowed_fast_generate(
+        uint32_t ip,
+        const char* infohash,
+        unsigned int npieces,
+        unsigned int k,
+        unsigned int* pieces);
+
+/**
+ * Create a per-torrent cache of allowed fast sets.
+ * Peers within the same /24 share a set, so it's only computed once
+ * @return new cache */
+void* pwp_allowed_fast_new(
+        const char* infohash,
+        unsigned int npieces,
+        unsigned int k);
+
+/**
+ * Release memory used by the cache */
+void pwp_allowed_fast_release(void* af);
+
+/**
+ * @param ip The peer's IPv4 address, in host byte order
+ * @param npieces Is set to the number of pieces within the set
+ * @return the allowed fast set for this peer; owned by the cache.
+ *  Only valid until the next call to pwp_allowed_fast_get or
+ *  pwp_allowed_fast_release, as the cache is emptied when it fills up.
+ *  Copy the set if it needs to be kept */
+const unsigned int* pwp_allowed_fast_get(void* af, uint32_t ip,
+        unsigned int* npieces);
+
+#endif /* PWP_ALLOWED_FAST_H */
@@ -0,0 +1,154 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. 
+ *
+ * @file
+ * @brief Zero-copy bencode tokenizer for extension protocol payloads
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pwp_bencode.h"
+
+void pwp_bencode_init(pwp_bencode_t* me, const char* buf, unsigned int len)
+{
+    me->buf = buf;
+    me->len = len;
+    me->pos = 0;
+    me->depth = 0;
+}
+
+/**
+ * Read digits up until the terminator
+ * @return 1 on success; -1 if malformed */
+static int __read_int(pwp_bencode_t* me, const char end, long long* val)
+{
+    int neg = 0, ndigits = 0;
+
+    *val = 0;
+
+    if (me->pos < me->len && me->buf[me->pos] == '-')
+    {
+        neg = 1;
+        me->pos++;
+    }
+
+    for (; me->pos < me->len && me->buf[me->pos] != end; me->pos++)
+    {
+        char c = me->buf[me->pos];
+
+        /* 18 digits can't overflow */
+        if (c < '0' || '9' < c || 18 < ++ndigits)
+            return -1;
+        *val = *val * 10 + (c - '0');
+    }
+
+    if (me->len <= me->pos || 0 == ndigits)
+        return -1;
+
+    /* skip terminator */
+    me->pos++;
+
+    if (neg)
+        *val = -*val;
+    return 1;
+}
+
+int pwp_bencode_next(pwp_bencode_t* me, pwp_bencode_tok_t* tok)
+{
+    if (me->len <= me->pos)
+        return 0 == me->depth ? 0 : -1;
+
+    switch (me->buf[me->pos])
+    {
+    case 'i':
+        me->pos++;
+        tok->type = PWP_BENCODE_INT;
+        return __read_int(me, 'e', &tok->ival);
+    case 'l':
+        me->pos++;
+        me->depth++;
+        tok->type = PWP_BENCODE_LIST;
+        return 1;
+    case 'd':
+        me->pos++;
+        me->depth++;
+        tok->type = PWP_BENCODE_DICT;
+        return 1;
+    case 'e':
+        if (0 == me->depth)
+            return -1;
+        me->pos++;
+        me->depth--;
+        tok->type = PWP_BENCODE_END;
+        return 1;
+    default:
+        {
+        long long len;
+
+        if (-1 == __read_int(me, ':', &len) ||
+            len < 0 || me->len - me->pos < len)
+            return -1;
+
+        tok->type = PWP_BENCODE_STR;
+        tok->str = me->buf + me->pos;
+        tok->len = len;
+        me->pos += len;
+        return 1;
+        }
+    }
+}
+
+int pwp_bencode_skip(pwp_bencode_t* me, const pwp_bencode_tok_t* tok)
+{
+    pwp_bencode_tok_t t;
+    int depth;
+
+    if (tok->type != PWP_BENCODE_LIST && tok->type != PWP_BENCODE_DICT)
+        return 1;
+
+    /* the depth we will be at once the container has been read */
+    depth = me->depth - 1;
+
+    while (depth < me->depth)
+        if (1 != pwp_bencode_next(me, &t))
+            return -1;
+
+    return 1;
+}
+
+int pwp_bencode_dict_find(pwp_bencode_t* me, const char* key,
+        pwp_bencode_tok_t* val)
+{
+    pwp_bencode_tok_t k;
+
+    while (1)
+    {
+        if (1 != pwp_bencode_next(me, &k))
+            return -1;
+
+        if (k.type == PWP_BENCODE_END)
+            return 0;
+
+        if (k.type != PWP_BENCODE_STR || 1 != pwp_bencode_next(me, val) ||
+            val->type == PWP_BENCODE_END)
+            return -1;
+
+        if (pwp_bencode_str_is(&k, key))
+            return 1;
+
+        if (-1 == pwp_bencode_skip(me, val))
+            return -1;
+    }
+}
+
+int pwp_bencode_str_is(const pwp_bencode_tok_t* tok, const char* str)
+{
+    return tok->type == PWP_BENCODE_STR &&
+        strlen(str) == tok->len &&
+        0 == memcmp(tok->str, str, tok->len);
+}
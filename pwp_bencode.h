@@ -0,0 +1,64 @@
+#ifndef PWP_BENCODE_H
+#define PWP_BENCODE_H
+
+typedef enum
+{
+    PWP_BENCODE_INT,
+    PWP_BENCODE_STR,
+    PWP_BENCODE_LIST,
+    PWP_BENCODE_DICT,
+    /* end of a list or dictionary */
+    PWP_BENCODE_END,
+} pwp_bencode_type_e;
+
+typedef struct {
+    pwp_bencode_type_e type;
+
+    /* string contents; points into the buffer being tokenized */
+    const char* str;
+    unsigned int len;
+
+    long long ival;
+} pwp_bencode_tok_t;
+
+typedef struct {
+    const char* buf;
+    unsigned int len;
+    unsigned int pos;
+
+    /* how many lists/dictionaries we are within */
+    int depth;
+} pwp_bencode_t;
+
+/**
+ * Tokenize this buffer. Nothing is copied; tokens point into buf */
+void pwp_bencode_init(pwp_bencode_t* me, const char* buf, unsigned int len);
+
+/**
+ * Read the next token
+ * @return 1 if a token was read; 0 at the end of the buffer; -1 if the
+ *  bencoding is malformed */
+int pwp_bencode_next(pwp_bencode_t* me, pwp_bencode_tok_t* tok);
+
+/**
+ * Skip the rest of the list or dictionary that tok started.
+ * Does nothing if tok isn't a list or dictionary.
+ * @return 1 on success; -1 if the bencoding is malformed */
+int pwp_bencode_skip(pwp_bencode_t* me, const pwp_bencode_tok_t* tok);
+
+/**
+ * Find key within the dictionary we are reading.
+ * Keys before the one found are skipped, as dictionaries are sorted only
+ * keys after the last key read can be found. If the key isn't found the
+ * rest of the dictionary is consumed.
+ * @param val The value of the key. If it's a list or dictionary the
+ *  tokenizer is left at its first token
+ * @return 1 if found; 0 if not found; -1 if the bencoding is malformed */
+int pwp_bencode_dict_find(pwp_bencode_t* me, const char* key,
+        pwp_bencode_tok_t* val);
+
+/**
+ * @return 1 if the string token is equal to this string; otherwise 0 */
+int pwp_bencode_str_is(const pwp_bencode_tok_t* tok, const char* str);
+
+#endif /* PWP_BENCODE_H */
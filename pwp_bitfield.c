@@ -20,9 +20,60 @@
 #include "bitfield.h"
 #include "pwp_connection.h"
 #include "pwp_local.h"
-#include "bitstream.h"
+#include "pwp_wire.h"
 #include "chunkybar.h"
 
+#undef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+
+unsigned int pwp_bitfield_msg_size(int npieces)
+{
+    return sizeof(uint32_t) + sizeof(char) + (npieces / 8) +
+        ((npieces % 8 == 0) ? 0 : 1);
+}
+
+/**
+ * Set bits from up to, but not including, to */
+static void __set_bits(unsigned char* bits, unsigned int from, unsigned int to)
+{
+    for (; from < to && from % 8; from++)
+        bits[from / 8] |= 0x80 >> (from % 8);
+
+    /* whole bytes in one go */
+    if (from + 8 <= to)
+    {
+        memset(bits + from / 8, 0xFF, (to - from) / 8);
+        from += (to - from) / 8 * 8;
+    }
+
+    for (; from < to; from++)
+        bits[from / 8] |= 0x80 >> (from % 8);
+}
+
+void pwp_write_bitfield(char** ptr, int npieces, void* pieces_completed)
+{
+    unsigned int nbytes, offset, len;
+    chunky_iterator_t iter;
+
+    nbytes = pwp_bitfield_msg_size(npieces) - sizeof(uint32_t) - 1;
+    *ptr = pwp_wire_put_hdr(*ptr, nbytes + 1, PWP_MSGTYPE_BITFIELD);
+
+    /* spare bits must be cleared */
+    memset(*ptr, 0, nbytes);
+
+    /* set bits a completed range at a time */
+    chunky_iterator(pieces_completed, &iter);
+    while (chunky_iterator_next(&iter, &offset, &len))
+    {
+        if ((unsigned int)npieces <= offset)
+            break;
+        __set_bits((unsigned char*)*ptr, offset,
+                min(offset + len, (unsigned int)npieces));
+    }
+
+    *ptr += nbytes;
+}
+
 int pwp_send_bitfield(
         int npieces,
         void* pieces_completed,
@@ -31,30 +82,95 @@ int pwp_send_bitfield(
         void* peer_udata
         )
 {
-    // TODO: replace 1000
-    char data[1000], *ptr;
+    char stack[1000], *data, *ptr;
     uint32_t size;
+    int ret;
+
+    size = pwp_bitfield_msg_size(npieces);
+
+    /* only large torrents need to go to the heap */
+    if (size <= sizeof(stack))
+        data = stack;
+    else if (!(data = malloc(size)))
+    {
+        perror("out of memory");
+        exit(0);
+    }
 
     ptr = data;
-    size = sizeof(uint32_t) + sizeof(char) + (npieces / 8) +
-        ((npieces % 8 == 0) ? 0 : 1);
-    bitstream_write_uint32(&ptr, fe(size - sizeof(uint32_t)));
-    bitstream_write_byte(&ptr, PWP_MSGTYPE_BITFIELD);
+    pwp_write_bitfield(&ptr, npieces, pieces_completed);
+    ret = send_cb(cb_ctx, peer_udata, data, size);
+
+    if (data != stack)
+        free(data);
 
-    /*  for all pieces set bit = 1 if we have the completed piece */
-    int i;
-    unsigned char bits;
-    for (bits = 0, i = 0; i < npieces; i++)
+    return ret;
+}
+
+typedef struct {
+    int npieces;
+
+    /* whole bitfield message, including length prefix */
+    char* msg;
+    unsigned int size;
+} pwp_bitfield_cache_t;
+
+void* pwp_bitfield_cache_new(int npieces, void* pieces_completed)
+{
+    pwp_bitfield_cache_t* me;
+    char* ptr;
+
+    if (!(me = malloc(sizeof(pwp_bitfield_cache_t))))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+
+    me->npieces = npieces;
+    me->size = pwp_bitfield_msg_size(npieces);
+    if (!(me->msg = malloc(me->size)))
     {
-        bits |= chunky_have(pieces_completed, i, 1) << (7 - (i % 8));
-        /* ...up to eight bits, write to byte */
-        if (((i + 1) % 8 == 0) || npieces - 1 == i)
-        {
-            bitstream_write_byte(&ptr, (char)bits);
-            bits = 0;
-        }
+        perror("out of memory");
+        exit(0);
     }
 
-    return send_cb(cb_ctx, peer_udata, data, size);
+    ptr = me->msg;
+    pwp_write_bitfield(&ptr, npieces, pieces_completed);
+    return me;
+}
+
+void pwp_bitfield_cache_release(void* bc)
+{
+    pwp_bitfield_cache_t* me = bc;
+
+    free(me->msg);
+    free(me);
+}
+
+void pwp_bitfield_cache_mark(void* bc, unsigned int piece)
+{
+    pwp_bitfield_cache_t* me = bc;
+
+    assert(piece < (unsigned int)me->npieces);
+    me->msg[PWP_WIRE_HDR_LEN + piece / 8] |= 0x80 >> (piece % 8);
+}
+
+const char* pwp_bitfield_cache_get(void* bc, unsigned int* len)
+{
+    pwp_bitfield_cache_t* me = bc;
+
+    *len = me->size;
+    return me->msg;
 }
 
+int pwp_send_bitfield_cached(
+        void* bc,
+        func_send_f send_cb,
+        void* cb_ctx,
+        void* peer_udata
+        )
+{
+    pwp_bitfield_cache_t* me = bc;
+
+    return send_cb(cb_ctx, peer_udata, me->msg, me->size);
+}
@@ -0,0 +1,174 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. 
+ *
+ * @file
+ * @brief Ring buffer queue of blocks stored by value.
+ *        Offering and polling don't allocate once the queue has grown
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include "bitfield.h"
+#include "pwp_connection.h"
+#include "pwp_blkqueue.h"
+
+#undef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+
+typedef struct {
+    bt_block_t* blks;
+    /* always a power of two */
+    unsigned int size;
+    unsigned int head;
+    unsigned int count;
+} blkqueue_t;
+
+void* pwp_blkqueue_new(unsigned int size)
+{
+    blkqueue_t* me;
+
+    if (!(me = calloc(1, sizeof(blkqueue_t))))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+
+    me->size = 8;
+    while (me->size < size)
+        me->size <<= 1;
+
+    if (!(me->blks = malloc(sizeof(bt_block_t) * me->size)))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+
+    return me;
+}
+
+void pwp_blkqueue_free(void* q)
+{
+    blkqueue_t* me = q;
+
+    free(me->blks);
+    free(me);
+}
+
+unsigned int pwp_blkqueue_count(const void* q)
+{
+    const blkqueue_t* me = q;
+    return me->count;
+}
+
+static bt_block_t* __at(const blkqueue_t* me, unsigned int idx)
+{
+    return &me->blks[(me->head + idx) & (me->size - 1)];
+}
+
+static void __grow(blkqueue_t* me)
+{
+    bt_block_t* blks;
+    unsigned int first;
+
+    if (!(blks = malloc(sizeof(bt_block_t) * me->size * 2)))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+
+    /* unwrap so the front of the queue is at the start */
+    first = min(me->count, me->size - me->head);
+    memcpy(blks, &me->blks[me->head], sizeof(bt_block_t) * first);
+    memcpy(blks + first, me->blks, sizeof(bt_block_t) * (me->count - first));
+
+    free(me->blks);
+    me->blks = blks;
+    me->head = 0;
+    me->size *= 2;
+}
+
+void pwp_blkqueue_offer(void* q, const bt_block_t* b)
+{
+    blkqueue_t* me = q;
+
+    if (me->count == me->size)
+        __grow(me);
+
+    *__at(me, me->count) = *b;
+    me->count++;
+}
+
+int pwp_blkqueue_poll(void* q, bt_block_t* out)
+{
+    blkqueue_t* me = q;
+
+    if (0 == me->count)
+        return 0;
+
+    *out = me->blks[me->head];
+    me->head = (me->head + 1) & (me->size - 1);
+    me->count--;
+    return 1;
+}
+
+bt_block_t* pwp_blkqueue_get(void* q, unsigned int idx)
+{
+    blkqueue_t* me = q;
+
+    assert(idx < me->count);
+    return __at(me, idx);
+}
+
+int pwp_blkqueue_find(const void* q, const bt_block_t* b)
+{
+    const blkqueue_t* me = q;
+    unsigned int i;
+
+    for (i = 0; i < me->count; i++)
+    {
+        const bt_block_t* e = __at(me, i);
+
+        if (e->piece_idx == b->piece_idx &&
+            e->offset == b->offset &&
+            e->len == b->len)
+            return i;
+    }
+
+    return -1;
+}
+
+void pwp_blkqueue_remove(void* q, unsigned int idx, bt_block_t* out)
+{
+    blkqueue_t* me = q;
+    unsigned int i;
+
+    assert(idx < me->count);
+
+    if (out)
+        *out = *__at(me, idx);
+
+    /* close the gap from whichever end is nearer */
+    if (idx < me->count / 2)
+    {
+        for (i = idx; 0 < i; i--)
+            *__at(me, i) = *__at(me, i - 1);
+        me->head = (me->head + 1) & (me->size - 1);
+    }
+    else
+    {
+        for (i = idx; i + 1 < me->count; i++)
+            *__at(me, i) = *__at(me, i + 1);
+    }
+
+    me->count--;
+}
@@ -0,0 +1,43 @@
+#ifndef PWP_BLKQUEUE_H
+#define PWP_BLKQUEUE_H
+
+/**
+ * Create a FIFO queue of blocks. Blocks are stored by value within a ring
+ * buffer that grows as needed
+ * @param size Number of blocks we expect to hold
+ * @return new queue */
+void* pwp_blkqueue_new(unsigned int size);
+
+/**
+ * Release memory used by queue */
+void pwp_blkqueue_free(void* q);
+
+/**
+ * @return number of blocks in queue */
+unsigned int pwp_blkqueue_count(const void* q);
+
+/**
+ * Add a copy of the block to the back of the queue */
+void pwp_blkqueue_offer(void* q, const bt_block_t* b);
+
+/**
+ * Take the block from the front of the queue
+ * @param out Set to the block
+ * @return 1 if there was a block; 0 if the queue is empty */
+int pwp_blkqueue_poll(void* q, bt_block_t* out);
+
+/**
+ * @param idx Position from the front of the queue
+ * @return the block; only valid until the queue is changed */
+bt_block_t* pwp_blkqueue_get(void* q, unsigned int idx);
+
+/**
+ * @return position of a block equal to b; -1 if there isn't one */
+int pwp_blkqueue_find(const void* q, const bt_block_t* b);
+
+/**
+ * Remove the block at this position, keeping the order of the rest
+ * @param out Set to the removed block, if not NULL */
+void pwp_blkqueue_remove(void* q, unsigned int idx, bt_block_t* out);
+
+#endif /* PWP_BLKQUEUE_H */
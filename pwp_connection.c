@@ -24,57 +24,51 @@
 #include "bitfield.h"
 #include "pwp_connection.h"
 #include "pwp_local.h"
-#include "linked_list_hashmap.h"
+#include "pwp_wire.h"
+#include "pwp_trace.h"
+#include "pwp_reqmap.h"
+#include "pwp_blkqueue.h"
 #include "linked_list_queue.h"
 #include "chunkybar.h"
-#include "bitstream.h"
 
 /* for upload/download rate identification */
 #include "meanqueue.h"
 
+#include "pwp_extensions.h"
+#include "pwp_bencode.h"
 #include "pwp_connection_private.h"
 
 #define TRUE 1
 #define FALSE 0
 
-#define pwp_msgtype_to_string(m)\
-    PWP_MSGTYPE_CHOKE == (m) ? "CHOKE" :\
-    PWP_MSGTYPE_UNCHOKE == (m) ? "UNCHOKE" :\
-    PWP_MSGTYPE_INTERESTED == (m) ? "INTERESTED" :\
-    PWP_MSGTYPE_UNINTERESTED == (m) ? "UNINTERESTED" :\
-    PWP_MSGTYPE_HAVE == (m) ? "HAVE" :\
-    PWP_MSGTYPE_BITFIELD == (m) ? "BITFIELD" :\
-    PWP_MSGTYPE_REQUEST == (m) ? "REQUEST" :\
-    PWP_MSGTYPE_PIECE == (m) ? "PIECE" :\
-    PWP_MSGTYPE_CANCEL == (m) ? "CANCEL" : "none"\
+/* suggest piece messages we send per period */
+#define MAX_SUGGESTS_PER_PERIOD 4
 
-static unsigned long __req_hash(const void *obj)
-{
-    const bt_block_t *req = obj;
-    return req->piece_idx + req->len + req->offset;
-}
-
-static long __req_cmp(const void *obj, const void *other)
+/**
+ * Record a message in the trace ring. Text is only produced for the log
+ * callback, which is the slow path */
+static void __trace(pwp_conn_private_t * me, const unsigned char dir,
+        const unsigned char type, const uint32_t piece_idx,
+        const uint32_t offset, const uint32_t len)
 {
-    const bt_block_t *req1 = obj, *req2 = other;
-    if (req1->piece_idx == req2->piece_idx &&
-        req1->len == req2->len &&
-        req1->offset == req2->offset)
-        return 0;
-    return 1;
-}
+    pwp_trace_rec_t rec;
+    char buffer[128];
+    int n;
 
-static void __log(pwp_conn_private_t * me, const char *format, ...)
-{
-    char buffer[1000];
-    va_list args;
+    if (me->trace)
+        pwp_trace_add(me->trace, dir, type, piece_idx, offset, len,
+                me->state.tick);
 
     if (NULL == me->cb.log)
         return;
 
-    sprintf(buffer,"%lx ",(unsigned long)me);
-    va_start(args, format);
-    (void)vsnprintf(buffer+strlen(buffer), 1000, format, args);
+    rec.dir = dir;
+    rec.type = type;
+    rec.piece_idx = piece_idx;
+    rec.offset = offset;
+    rec.len = len;
+    n = sprintf(buffer, "%lx ", (unsigned long)me);
+    (void)pwp_trace_format(&rec, buffer + n, sizeof(buffer) - n);
 #if 0 /* debugging */
     printf("%s\n", buffer);
 #endif
@@ -136,103 +130,150 @@ void *pwp_conn_new(void* mem)
     if (mem)
     {
         me = mem;
+        memset(me, 0, sizeof(pwp_conn_private_t));
     }
     else if (!(me = calloc(1, sizeof(pwp_conn_private_t))))
     {
         perror("out of memory");
         exit(0);
     }
+    else
+    {
+        me->own_mem = 1;
+    }
 
     me->bytes_drate = meanqueue_new(10);
     me->bytes_urate = meanqueue_new(10);
-    me->recv_reqs = hashmap_new(__req_hash, __req_cmp, 100);
-    me->peer_reqs = llqueue_new();
-    me->reqs = llqueue_new();
+    me->recv_reqs = pwp_reqmap_new(100);
+    me->peer_reqs = pwp_blkqueue_new(16);
+    me->reqs = pwp_blkqueue_new(16);
     me->req_lock = NULL;
     me->state.flags = PC_IM_CHOKING | PC_PEER_CHOKING;
     me->pieces_peerhas = chunky_new(0);
+    me->pieces_granted_fast = chunky_new(0);
+    me->pieces_allowed_fast = chunky_new(0);
     return me;
 }
 
-static void __expunge_their_pending_reqs(pwp_conn_private_t* me)
+static int __fast(pwp_conn_private_t* me)
 {
-    while (0 < llqueue_count(me->peer_reqs))
-    {
-        free(llqueue_poll(me->peer_reqs));
-    }
+    return 0 != (me->state.caps & PWP_CAP_FAST);
 }
 
-static void __expunge_my_pending_reqs(pwp_conn_private_t* me)
+static void __expunge_their_pending_reqs(pwp_conn_private_t* me)
 {
-    request_t *r;
-    hashmap_iterator_t iter;
+    bt_block_t b;
 
-    void* rem;
-    rem = llqueue_new();
+    while (pwp_blkqueue_poll(me->peer_reqs, &b))
+        ;
+}
 
-    for (hashmap_iterator(me->recv_reqs, &iter);
-         (r = hashmap_iterator_next_value(me->recv_reqs, &iter));)
-    {
-        llqueue_offer(rem, r);
-#if 0
-        r = hashmap_remove(me->recv_reqs, &r->blk);
-        if (me->cb.peer_giveback_block)
-            me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, &r->blk);
-        free(r);
-#endif
-    }
+/**
+ * With the fast extension a peer is always told about requests we drop.
+ * Requests for allowed fast pieces are kept */
+static void __reject_their_pending_reqs(pwp_conn_private_t* me)
+{
+    unsigned int n;
+    bt_block_t b;
 
-#if 1
-   while (llqueue_count(rem) > 0)
+    /* rotate through the queue once; kept requests stay in order */
+    for (n = pwp_blkqueue_count(me->peer_reqs); 0 < n; n--)
     {
-        r = llqueue_poll(rem);
-        r = hashmap_remove(me->recv_reqs, &r->blk);
-
-        assert(r);
+        pwp_blkqueue_poll(me->peer_reqs, &b);
 
-        if (me->cb.peer_giveback_block)
-            me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, &r->blk);
-        free(r);
+        if (chunky_have(me->pieces_granted_fast, b.piece_idx, 1))
+            pwp_blkqueue_offer(me->peer_reqs, &b);
+        else
+            pwp_conn_send_reject((pwp_conn_t*)me, &b);
     }
+}
 
-    llqueue_free(rem);
-#endif
+/**
+ * Give blocks back to the caller; in one go if there is more than one */
+static void __giveback_blocks(pwp_conn_private_t* me,
+        bt_block_t* blks,
+        unsigned int n)
+{
+    unsigned int i;
+
+    if (1 < n && me->cb.peer_giveback_blocks)
+        me->cb.peer_giveback_blocks(me->cb_ctx, me->peer_udata, blks, n);
+    else if (me->cb.peer_giveback_block)
+        for (i=0; i<n; i++)
+            me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, &blks[i]);
+    else if (0 < n && me->cb.peer_giveback_blocks)
+        me->cb.peer_giveback_blocks(me->cb_ctx, me->peer_udata, blks, n);
 }
 
-static void __expunge_my_old_pending_reqs(pwp_conn_private_t* me)
+/**
+ * Tell the caller the peer has these pieces; in one go if there is more
+ * than one */
+static void __peer_have_pieces(pwp_conn_private_t* me,
+        const uint32_t* pieces,
+        unsigned int n)
+{
+    unsigned int i;
+
+    if (1 < n && me->cb.peer_have_pieces)
+        me->cb.peer_have_pieces(me->cb_ctx, me->peer_udata, pieces, n);
+    else if (me->cb.peer_have_piece)
+        for (i=0; i<n; i++)
+            me->cb.peer_have_piece(me->cb_ctx, me->peer_udata, pieces[i]);
+    else if (0 < n && me->cb.peer_have_pieces)
+        me->cb.peer_have_pieces(me->cb_ctx, me->peer_udata, pieces, n);
+}
+
+/**
+ * Drop our pending requests and give their blocks back
+ * @param all If 0, only drop requests that have timed out */
+static void __expunge_reqs(pwp_conn_private_t* me, const int all)
 {
     request_t *r;
-    hashmap_iterator_t iter;
-    void* rem;
+    pwp_reqmap_iterator_t iter;
+    bt_block_t* blks;
+    unsigned int i, n = 0;
 
-    rem = llqueue_new();
+    if (0 == pwp_reqmap_count(me->recv_reqs))
+        return;
 
-    for (hashmap_iterator(me->recv_reqs, &iter);
-         (r = hashmap_iterator_next_value(me->recv_reqs, &iter));)
+    /* reuse the buffer so that the timeout sweep doesn't allocate */
+    if (me->expunged_size < pwp_reqmap_count(me->recv_reqs))
     {
-        if (r && 10 < me->state.tick - r->tick)
+        free(me->expunged);
+        me->expunged_size = pwp_reqmap_count(me->recv_reqs);
+        if (!(me->expunged = malloc(sizeof(bt_block_t) * me->expunged_size)))
         {
-#if 0
-            hashmap_remove(me->recv_reqs, &r->blk);
-            me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, &r->blk);
-            free(r);
-#endif
-            llqueue_offer(rem, r);
+            perror("out of memory");
+            exit(0);
         }
     }
+    blks = me->expunged;
 
-#if 1
-    while (llqueue_count(rem) > 0)
-    {
-        r = llqueue_poll(rem);
-        r = hashmap_remove(me->recv_reqs, &r->blk);
+    for (pwp_reqmap_iterator(me->recv_reqs, &iter);
+         (r = pwp_reqmap_iterator_next_value(me->recv_reqs, &iter));)
+        if (all || 10 < me->state.tick - r->tick)
+            blks[n++] = r->blk;
 
-        assert(me->cb.peer_giveback_block);
-        me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, &r->blk);
+    /* remove after iterating; deleting shifts entries back under the
+     * iterator */
+    for (i=0; i<n; i++)
+    {
+        r = pwp_reqmap_remove(me->recv_reqs, &blks[i]);
+        assert(r);
         free(r);
     }
-    llqueue_free(rem);
-#endif
+
+    __giveback_blocks(me, blks, n);
+}
+
+static void __expunge_my_pending_reqs(pwp_conn_private_t* me)
+{
+    __expunge_reqs(me, 1);
+}
+
+static void __expunge_my_old_pending_reqs(pwp_conn_private_t* me)
+{
+    __expunge_reqs(me, 0);
 }
 
 void pwp_conn_release(pwp_conn_t* me_)
@@ -241,9 +282,19 @@ void pwp_conn_release(pwp_conn_t* me_)
 
     __expunge_their_pending_reqs(me);
     __expunge_my_pending_reqs(me);
-    hashmap_free(me->recv_reqs);
-    llqueue_free(me->peer_reqs);
-    free(me_);
+    pwp_reqmap_free(me->recv_reqs);
+    pwp_blkqueue_free(me->peer_reqs);
+    pwp_blkqueue_free(me->reqs);
+    chunky_free(me->pieces_peerhas);
+    chunky_free(me->pieces_granted_fast);
+    chunky_free(me->pieces_allowed_fast);
+    meanqueue_free(me->bytes_drate);
+    meanqueue_free(me->bytes_urate);
+    free(me->expunged);
+
+    /* memory provided to pwp_conn_new is the caller's to free */
+    if (me->own_mem)
+        free(me_);
 }
 
 void pwp_conn_set_piece_info(pwp_conn_t* me_, int num_pieces, int piece_len)
@@ -254,6 +305,12 @@ void pwp_conn_set_piece_info(pwp_conn_t* me_, int num_pieces, int piece_len)
     me->piece_len = piece_len;
 }
 
+int pwp_conn_get_num_pieces(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    return me->num_pieces;
+}
+
 void pwp_conn_set_cbs(pwp_conn_t* me_, pwp_conn_cbs_t* funcs, void* cb_ctx)
 {
     pwp_conn_private_t *me = (void*)me_;
@@ -306,8 +363,11 @@ void pwp_conn_choke_peer(pwp_conn_t* me_)
     pwp_conn_private_t *me = (void*)me_;
 
     me->state.flags |= PC_IM_CHOKING;
-    __expunge_their_pending_reqs(me);
     pwp_conn_send_statechange(me_, PWP_MSGTYPE_CHOKE);
+    if (__fast(me))
+        __reject_their_pending_reqs(me);
+    else
+        __expunge_their_pending_reqs(me);
 }
 
 void pwp_conn_unchoke_peer(pwp_conn_t* me_)
@@ -333,14 +393,13 @@ int pwp_conn_get_upload_rate(const pwp_conn_t* me_ __attribute__((__unused__)))
 int pwp_conn_send_statechange(pwp_conn_t* me_, const unsigned char msg_type)
 {
     pwp_conn_private_t *me = (void*)me_;
-    char data[5], *ptr = data;
+    pwp_wire_state_t m;
 
-    bitstream_write_uint32(&ptr, fe(1));
-    bitstream_write_byte(&ptr, msg_type);
+    pwp_wire_state(&m, msg_type);
 
-    __log(me, "send,%s", pwp_msgtype_to_string(msg_type));
+    __trace(me, PWP_TRACE_SEND, msg_type, 0, 0, 0);
 
-    if (!__send_to_peer(me, data, 5))
+    if (!__send_to_peer(me, m.b, sizeof(m.b)))
     {
         return 0;
     }
@@ -359,18 +418,16 @@ void pwp_conn_send_piece(pwp_conn_t* me_, bt_block_t * req)
     assert(NULL != me->cb.write_block_to_stream);
 
     /* prepare buf */
-    size = 4 + 1 + 4 + 4 + req->len;
+    size = PWP_WIRE_PIECE_HDR_LEN + req->len;
     if (!(data = malloc(size)))
     {
         perror("out of memory");
         exit(0);
     }
 
-    ptr = data;
-    bitstream_write_uint32(&ptr, fe(size - 4));
-    bitstream_write_byte(&ptr, PWP_MSGTYPE_PIECE);
-    bitstream_write_uint32(&ptr, fe(req->piece_idx));
-    bitstream_write_uint32(&ptr, fe(req->offset));
+    pwp_wire_piece_hdr((pwp_wire_piece_hdr_t*)data, PWP_MSGTYPE_PIECE,
+            req->piece_idx, req->offset, req->len);
+    ptr = data + PWP_WIRE_PIECE_HDR_LEN;
     me->cb.write_block_to_stream(me->cb_ctx, req, &ptr);
     __send_to_peer(me, data, size);
 
@@ -389,8 +446,8 @@ void pwp_conn_send_piece(pwp_conn_t* me_, bt_block_t * req)
     }
 #endif
 
-    __log(me, "send,piece,piece_idx=%d offset=%d len=%d",
-          req->piece_idx, req->offset, req->len);
+    __trace(me, PWP_TRACE_SEND, PWP_MSGTYPE_PIECE,
+            req->piece_idx, req->offset, req->len);
 
     free(data);
 }
@@ -398,46 +455,170 @@ void pwp_conn_send_piece(pwp_conn_t* me_, bt_block_t * req)
 int pwp_conn_send_have(pwp_conn_t* me_, const int piece_idx)
 {
     pwp_conn_private_t *me = (void*)me_;
-    char data[12], *ptr = data;
+    pwp_wire_piece_idx_t m;
 
-    bitstream_write_uint32(&ptr, fe(5));
-    bitstream_write_byte(&ptr, PWP_MSGTYPE_HAVE);
-    bitstream_write_uint32(&ptr, fe(piece_idx));
-    __send_to_peer(me, data, 5+4);
-    __log(me, "send,have,piece_idx=%d", piece_idx);
+    pwp_wire_piece_idx(&m, PWP_MSGTYPE_HAVE, piece_idx);
+    __send_to_peer(me, m.b, sizeof(m.b));
+    __trace(me, PWP_TRACE_SEND, PWP_MSGTYPE_HAVE, piece_idx, 0, 1);
     return 1;
 }
 
 void pwp_conn_send_request(pwp_conn_t* me_, const bt_block_t * request)
 {
     pwp_conn_private_t *me = (void*)me_;
-    char data[32], *ptr;
+    pwp_wire_block_t m;
 
-    ptr = data;
-    bitstream_write_uint32(&ptr, fe(13));
-    bitstream_write_byte(&ptr, PWP_MSGTYPE_REQUEST);
-    bitstream_write_uint32(&ptr, fe(request->piece_idx));
-    bitstream_write_uint32(&ptr, fe(request->offset));
-    bitstream_write_uint32(&ptr, fe(request->len));
-    __send_to_peer(me, data, 13+4);
-    __log(me, "send,request,piece_idx=%d offset=%d len=%d",
-          request->piece_idx, request->offset, request->len);
+    pwp_wire_block(&m, PWP_MSGTYPE_REQUEST,
+            request->piece_idx, request->offset, request->len);
+    __send_to_peer(me, m.b, sizeof(m.b));
+    __trace(me, PWP_TRACE_SEND, PWP_MSGTYPE_REQUEST,
+            request->piece_idx, request->offset, request->len);
 }
 
 void pwp_conn_send_cancel(pwp_conn_t* me_, bt_block_t * cancel)
 {
     pwp_conn_private_t *me = (void*)me_;
-    char data[32], *ptr;
+    pwp_wire_block_t m;
+
+    pwp_wire_block(&m, PWP_MSGTYPE_CANCEL,
+            cancel->piece_idx, cancel->offset, cancel->len);
+    __send_to_peer(me, m.b, sizeof(m.b));
+    __trace(me, PWP_TRACE_SEND, PWP_MSGTYPE_CANCEL,
+            cancel->piece_idx, cancel->offset, cancel->len);
+}
+
+void pwp_conn_send_reject(pwp_conn_t* me_, const bt_block_t * reject)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    pwp_wire_block_t m;
+
+    pwp_wire_block(&m, PWP_MSGTYPE_REJECT,
+            reject->piece_idx, reject->offset, reject->len);
+    __send_to_peer(me, m.b, sizeof(m.b));
+    __trace(me, PWP_TRACE_SEND, PWP_MSGTYPE_REJECT,
+            reject->piece_idx, reject->offset, reject->len);
+}
+
+void pwp_conn_send_allowed_fast(pwp_conn_t* me_, const int piece_idx)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    pwp_wire_piece_idx_t m;
+
+    pwp_wire_piece_idx(&m, PWP_MSGTYPE_ALLOWED_FAST, piece_idx);
+    __send_to_peer(me, m.b, sizeof(m.b));
+    __trace(me, PWP_TRACE_SEND, PWP_MSGTYPE_ALLOWED_FAST, piece_idx, 0, 0);
+}
+
+void pwp_conn_grant_allowed_fast(pwp_conn_t* me_,
+        const unsigned int* pieces, const unsigned int npieces)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    unsigned int i;
+
+    if (!__fast(me))
+        return;
+
+    for (i = 0; i < npieces; i++)
+    {
+        if (chunky_have(me->pieces_granted_fast, pieces[i], 1))
+            continue;
+        chunky_mark_complete(me->pieces_granted_fast, pieces[i], 1);
+        pwp_conn_send_allowed_fast(me_, pieces[i]);
+    }
+}
+
+int pwp_conn_suggest_piece(pwp_conn_t* me_, const int piece_idx)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    pwp_wire_piece_idx_t m;
 
-    ptr = data;
-    bitstream_write_uint32(&ptr, fe(13));
-    bitstream_write_byte(&ptr, PWP_MSGTYPE_CANCEL);
-    bitstream_write_uint32(&ptr, fe(cancel->piece_idx));
-    bitstream_write_uint32(&ptr, fe(cancel->offset));
-    bitstream_write_uint32(&ptr, fe(cancel->len));
-    __send_to_peer(me, data, 17);
-    __log(me, "send,cancel,piece_idx=%d offset=%d len=%d",
-          cancel->piece_idx, cancel->offset, cancel->len);
+    if (!__fast(me) ||
+        MAX_SUGGESTS_PER_PERIOD <= me->suggests_this_period ||
+        pwp_conn_peer_has_piece(me_, piece_idx))
+        return 0;
+
+    pwp_wire_piece_idx(&m, PWP_MSGTYPE_SUGGEST, piece_idx);
+    if (!__send_to_peer(me, m.b, sizeof(m.b)))
+        return 0;
+    __trace(me, PWP_TRACE_SEND, PWP_MSGTYPE_SUGGEST, piece_idx, 0, 0);
+    me->suggests_this_period++;
+    return 1;
+}
+
+void pwp_conn_set_extensions(pwp_conn_t* me_, void* extensions)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    me->extensions = extensions;
+}
+
+void pwp_conn_set_trace(pwp_conn_t* me_, void* trace)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    me->trace = trace;
+}
+
+/**
+ * Send an extended message with one call to send */
+static int __send_extended(pwp_conn_private_t* me, const unsigned char id,
+        const char* payload, const unsigned int len)
+{
+    char stack[1000], *data, *ptr;
+    unsigned int size = 4 + 1 + 1 + len;
+    int ret;
+
+    if (size <= sizeof(stack))
+        data = stack;
+    else if (!(data = malloc(size)))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+    ptr = pwp_wire_put_hdr(data, size - 4, PWP_MSGTYPE_EXTENDED);
+    *ptr++ = id;
+    memcpy(ptr, payload, len);
+    ret = __send_to_peer(me, data, size);
+    if (data != stack)
+        free(data);
+    __trace(me, PWP_TRACE_SEND, PWP_MSGTYPE_EXTENDED, id, 0, len);
+    return ret;
+}
+
+void pwp_conn_send_extended_handshake(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    const char* hs;
+    unsigned int len;
+
+    if (!me->extensions || !(me->state.caps & PWP_CAP_EXTENSION))
+        return;
+
+    hs = pwp_extensions_get_handshake(me->extensions, &len);
+    __send_extended(me, 0, hs, len);
+}
+
+int pwp_conn_peer_supports_extension(pwp_conn_t* me_, const int ext_id)
+{
+    pwp_conn_private_t *me = (void*)me_;
+
+    if (ext_id < 1 || PWP_MAX_EXTENSIONS < ext_id)
+        return 0;
+    return 0 != me->ext_peer_ids[ext_id];
+}
+
+int pwp_conn_send_extended(pwp_conn_t* me_, const int ext_id,
+        const char* payload, const unsigned int len)
+{
+    pwp_conn_private_t *me = (void*)me_;
+
+    if (!pwp_conn_peer_supports_extension(me_, ext_id))
+        return 0;
+    return __send_extended(me, me->ext_peer_ids[ext_id], payload, len);
+}
+
+int pwp_conn_peer_allowed_fast(pwp_conn_t* me_, const int piece_idx)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    return chunky_have(me->pieces_allowed_fast, piece_idx, 1);
 }
 
 void pwp_conn_set_state(pwp_conn_t* me_, const int state)
@@ -452,9 +633,44 @@ int pwp_conn_get_state(pwp_conn_t* me_)
     return me->state.flags;
 }
 
+void pwp_conn_set_capabilities(pwp_conn_t* me_, const unsigned int caps)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    me->state.caps = caps;
+}
+
+unsigned int pwp_conn_get_capabilities(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    return me->state.caps;
+}
+
+void pwp_conn_set_upload_only(pwp_conn_t* me_, const int upload_only)
+{
+    pwp_conn_private_t *me = (void*)me_;
+
+    if (upload_only)
+        me->state.flags |= PC_UPLOAD_ONLY;
+    else
+        me->state.flags &= ~PC_UPLOAD_ONLY;
+}
+
+int pwp_conn_is_redundant(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+
+    if (!pwp_conn_flag_is_set(me_, PC_UPLOAD_ONLY))
+        return 0;
+
+    return pwp_conn_flag_is_set(me_, PC_PEER_UPLOAD_ONLY) ||
+        (0 < me->num_pieces &&
+         chunky_have(me->pieces_peerhas, 0, me->num_pieces));
+}
+
 int pwp_conn_mark_peer_has_piece(pwp_conn_t* me_, const int piece_idx)
 {
     pwp_conn_private_t *me = (void*)me_;
+    const uint32_t idx = piece_idx;
 
     if (me->num_pieces <= piece_idx || piece_idx < 0)
     {
@@ -464,8 +680,7 @@ int pwp_conn_mark_peer_has_piece(pwp_conn_t* me_, const int piece_idx)
 
     /* remember that they have this piece */
     chunky_mark_complete(me->pieces_peerhas, piece_idx, 1);
-    if (me->cb.peer_have_piece)
-        me->cb.peer_have_piece(me->cb_ctx, me->peer_udata, piece_idx);
+    __peer_have_pieces(me, &idx, 1);
 
     return 1;
 }
@@ -483,13 +698,13 @@ static void __req_fit(bt_block_t * request, const unsigned int piece_len)
 int pwp_conn_get_npending_requests(const pwp_conn_t* me_)
 {
     const pwp_conn_private_t * me = (void*)me_;
-    return hashmap_count(me->recv_reqs);
+    return pwp_reqmap_count(me->recv_reqs);
 }
 
 int pwp_conn_get_npending_peer_requests(const pwp_conn_t* me_)
 {
     const pwp_conn_private_t * me = (void*)me_;
-    return llqueue_count(me->peer_reqs);
+    return pwp_blkqueue_count(me->peer_reqs);
 }
 
 void pwp_conn_request_block_from_peer(pwp_conn_t* me_, bt_block_t * blk)
@@ -510,7 +725,7 @@ void pwp_conn_request_block_from_peer(pwp_conn_t* me_, bt_block_t * blk)
     req = malloc(sizeof(request_t));
     req->tick = me->state.tick;
     memcpy(&req->blk, blk, sizeof(bt_block_t));
-    hashmap_put(me->recv_reqs, &req->blk, req);
+    pwp_reqmap_put(me->recv_reqs, &req->blk, req);
 
 #if 0 /*  debugging */
     printf("request block: %d %d %d",
@@ -536,22 +751,19 @@ void pwp_conn_connect_failed(pwp_conn_t* me_)
 static void* __offer_block(void* me_, void* b)
 {
     pwp_conn_private_t *me = (void*)me_;
-    bt_block_t *b_new;
 
-    /* TODO: replace with mempool/arena */
-    b_new = malloc(sizeof(bt_block_t));
-    memcpy(b_new,b,sizeof(bt_block_t));
-    llqueue_offer(me->reqs, b_new);
+    pwp_blkqueue_offer(me->reqs, b);
     return NULL;
 }
 
-static void* __poll_block(
-        void* me_,
-        void* unused __attribute__((__unused__)))
+/**
+ * @param out Block to poll into
+ * @return out; NULL if there are no blocks */
+static void* __poll_block(void* me_, void* out)
 {
     pwp_conn_private_t *me = (void*)me_;
 
-    return llqueue_poll(me->reqs);
+    return pwp_blkqueue_poll(me->reqs, out) ? out : NULL;
 }
 
 void pwp_conn_offer_block(pwp_conn_t* me_, bt_block_t *b)
@@ -564,12 +776,19 @@ void pwp_conn_offer_block(pwp_conn_t* me_, bt_block_t *b)
 
 static void __process_requests(pwp_conn_private_t* me)
 {
-    void *b;
+    bt_block_t blk, *b;
 
     /* TODO: probably want to split the request into smaller requests */
-    b = me->cb.call_exclusively(me, me->cb_ctx, &me->req_lock, NULL, __poll_block);
-    pwp_conn_request_block_from_peer((pwp_conn_t*)me, b);
-    free(b);
+    b = me->cb.call_exclusively(me, me->cb_ctx, &me->req_lock, &blk, __poll_block);
+    if (!b)
+        return;
+
+    /* while choked we can only request allowed fast pieces */
+    if (pwp_conn_im_choked((pwp_conn_t*)me) &&
+        !chunky_have(me->pieces_allowed_fast, b->piece_idx, 1))
+        __giveback_blocks(me, b, 1);
+    else
+        pwp_conn_request_block_from_peer((pwp_conn_t*)me, b);
 }
 
 void pwp_conn_periodic(pwp_conn_t* me_)
@@ -577,6 +796,7 @@ void pwp_conn_periodic(pwp_conn_t* me_)
     pwp_conn_private_t *me = (void*)me_;
 
     me->state.tick++;
+    me->suggests_this_period = 0;
 
     __expunge_my_old_pending_reqs(me);
 
@@ -586,12 +806,10 @@ void pwp_conn_periodic(pwp_conn_t* me_)
     }
 
     /* Send one pending request to the peer */
-    if (0 < llqueue_count(me->peer_reqs))
-    {
-        bt_block_t* b = llqueue_poll(me->peer_reqs);
-        pwp_conn_send_piece(me_, b);
-        free(b);
-    }
+    bt_block_t b;
+
+    if (pwp_blkqueue_poll(me->peer_reqs, &b))
+        pwp_conn_send_piece(me_, &b);
 
     /* unchoke interested peer */
     if (pwp_conn_peer_is_interested(me_))
@@ -602,9 +820,18 @@ void pwp_conn_periodic(pwp_conn_t* me_)
         }
     }
 
-    if (pwp_conn_im_interested(me_))
+    if (pwp_conn_flag_is_set(me_, PC_UPLOAD_ONLY))
+    {
+        /* we have nothing to download */
+        if (pwp_conn_im_interested(me_) &&
+            pwp_conn_send_statechange(me_, PWP_MSGTYPE_UNINTERESTED))
+            me->state.flags &= ~PC_IM_INTERESTED;
+    }
+    else if (pwp_conn_im_interested(me_))
     {
-        if (pwp_conn_im_choked(me_))
+        /* allowed fast pieces can be requested while we're choked */
+        if (pwp_conn_im_choked(me_) &&
+            0 == chunky_get_num_chunks(me->pieces_allowed_fast))
         {
             goto cleanup;
         }
@@ -622,7 +849,7 @@ void pwp_conn_periodic(pwp_conn_t* me_)
             }
         }
 
-        if (0 < llqueue_count(me->reqs))
+        if (0 < pwp_blkqueue_count(me->reqs))
             __process_requests(me);
     }
     else
@@ -633,7 +860,7 @@ void pwp_conn_periodic(pwp_conn_t* me_)
 #if 0 /* debugging */
     printf("pending requests: %lx %d %d\n",
             me, pwp_conn_get_npending_requests(me),
-            llqueue_count(me->peer_reqs));
+            pwp_blkqueue_count(me->peer_reqs));
 #endif
 
     /*  measure transfer rate */
@@ -661,16 +888,20 @@ void pwp_conn_choke(pwp_conn_t* me_)
 {
     pwp_conn_private_t* me = (void*)me_;
 
-    __log(me, "read,choke");
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_CHOKE, 0, 0, 0);
     me->state.flags |= PC_PEER_CHOKING;
-    __expunge_my_pending_reqs(me);
+
+    /* with the fast extension a choke doesn't reject our requests; the peer
+     * sends a reject for each request it drops */
+    if (!__fast(me))
+        __expunge_my_pending_reqs(me);
 }
 
 void pwp_conn_unchoke(pwp_conn_t* me_)
 {
     pwp_conn_private_t* me = (void*)me_;
 
-    __log(me, "read,unchoke");
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_UNCHOKE, 0, 0, 0);
     me->state.flags &= ~PC_PEER_CHOKING;
 }
 
@@ -678,7 +909,7 @@ void pwp_conn_interested(pwp_conn_t* me_)
 {
     pwp_conn_private_t* me = (void*)me_;
 
-    __log(me, "read,interested");
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_INTERESTED, 0, 0, 0);
     me->state.flags |= PC_PEER_INTERESTED;
 }
 
@@ -686,7 +917,7 @@ void pwp_conn_uninterested(pwp_conn_t* me_)
 {
     pwp_conn_private_t* me = (void*)me_;
 
-    __log(me, "read,uninterested");
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_UNINTERESTED, 0, 0, 0);
     me->state.flags &= ~PC_PEER_INTERESTED;
 }
 
@@ -694,7 +925,7 @@ void pwp_conn_have(pwp_conn_t* me_, msg_have_t* have)
 {
     pwp_conn_private_t* me = (void*)me_;
 
-    __log(me, "read,have,piece_idx=%d", have->piece_idx);
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_HAVE, have->piece_idx, 0, 1);
 
     if (1 == pwp_conn_mark_peer_has_piece(me_, have->piece_idx))
     {
@@ -702,13 +933,48 @@ void pwp_conn_have(pwp_conn_t* me_, msg_have_t* have)
     }
 
     /* tell the peer we are intested if we don't have this piece */
-    if (!chunky_have(me->pieces_completed, have->piece_idx, 1))
+    if (!pwp_conn_flag_is_set(me_, PC_UPLOAD_ONLY) &&
+        !chunky_have(me->pieces_completed, have->piece_idx, 1))
     {
         // TODO: do we need to be interested if we are already?
         pwp_conn_set_im_interested(me_);
     }
 }
 
+void pwp_conn_have_batch(pwp_conn_t* me_,
+        const uint32_t* pieces,
+        unsigned int npieces)
+{
+    pwp_conn_private_t* me = (void*)me_;
+    unsigned int i, e;
+    int need = 0;
+
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_HAVE,
+            npieces ? pieces[0] : 0, 0, npieces);
+
+    for (i=0; i<npieces; i++)
+        if ((unsigned int)me->num_pieces <= pieces[i])
+        {
+            __disconnect(me, "piece idx fits outside of boundary");
+            return;
+        }
+
+    /* consecutive pieces are marked as one range */
+    for (i=0; i<npieces; i=e)
+    {
+        for (e=i+1; e<npieces && pieces[e] == pieces[e-1] + 1; e++);
+        chunky_mark_complete(me->pieces_peerhas, pieces[i], e - i);
+        if (!need && !chunky_have(me->pieces_completed, pieces[i], e - i))
+            need = 1;
+    }
+
+    __peer_have_pieces(me, pieces, npieces);
+
+    /* tell the peer we are intested if we don't have one of these pieces */
+    if (need && !pwp_conn_flag_is_set(me_, PC_UPLOAD_ONLY))
+        pwp_conn_set_im_interested(me_);
+}
+
 void pwp_conn_bitfield(pwp_conn_t* me_, msg_bitfield_t* bitfield)
 {
     pwp_conn_private_t* me = (void*)me_;
@@ -732,37 +998,288 @@ void pwp_conn_bitfield(pwp_conn_t* me_, msg_bitfield_t* bitfield)
 
     me->state.flags |= PC_BITFIELD_RECEIVED;
 
-    int ii;
+    uint32_t* pieces;
+    int ii, n = 0;
 
-    for (ii = 0; ii < me->num_pieces; ii++)
+    if (!(pieces = malloc(sizeof(uint32_t) * (me->num_pieces + 1))))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+
+    /* a short bitfield leaves the remaining pieces unmarked */
+    for (ii = 0; ii < me->num_pieces &&
+         ii < (int)bitfield_get_length(bitfield->bf); ii++)
     {
         if (bitfield_is_marked(bitfield->bf, ii))
-            pwp_conn_mark_peer_has_piece(me_, ii);
+        {
+            chunky_mark_complete(me->pieces_peerhas, ii, 1);
+            pieces[n++] = ii;
+        }
     }
 
-    //char *str;
-    //str = bitfield_str(&me->state.have_bitfield);
-    //__log(me, "read,bitfield,%s", str);
-    //free(str);
+    __peer_have_pieces(me, pieces, n);
+    free(pieces);
+
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_BITFIELD, 0, 0,
+            bitfield_get_length(bitfield->bf));
 }
 
-int pwp_conn_request(pwp_conn_t* me_, bt_block_t *r)
+void pwp_conn_have_all(pwp_conn_t* me_)
 {
     pwp_conn_private_t* me = (void*)me_;
+    int ii;
 
-    __log(me, "read,request,piece_idx=%d offset=%d len=%d",
-          r->piece_idx, r->offset, r->len);
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_HAVE_ALL, 0, 0, 0);
 
-    /* check that the client doesn't request when they are choked */
-    if (pwp_conn_im_choking(me_))
+    if (!__fast(me))
     {
-        __disconnect(me, "peer requested when they were choked");
+        __disconnect(me, "peer sent have all without fast extension");
+        return;
+    }
+
+    if (pwp_conn_flag_is_set(me_, PC_BITFIELD_RECEIVED))
+    {
+        __disconnect(me, "peer sent have all after bitfield");
+        return;
+    }
+
+    me->state.flags |= PC_BITFIELD_RECEIVED;
+
+    /* a single chunk covers every piece */
+    chunky_mark_complete(me->pieces_peerhas, 0, me->num_pieces);
+
+    if (me->cb.peer_have_all)
+        me->cb.peer_have_all(me->cb_ctx, me->peer_udata);
+    else if (me->cb.peer_have_piece)
+        for (ii = 0; ii < me->num_pieces; ii++)
+            me->cb.peer_have_piece(me->cb_ctx, me->peer_udata, ii);
+
+    if (!pwp_conn_flag_is_set(me_, PC_UPLOAD_ONLY) &&
+        !chunky_have(me->pieces_completed, 0, me->num_pieces))
+        pwp_conn_set_im_interested(me_);
+}
+
+void pwp_conn_have_none(pwp_conn_t* me_)
+{
+    pwp_conn_private_t* me = (void*)me_;
+
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_HAVE_NONE, 0, 0, 0);
+
+    if (!__fast(me))
+    {
+        __disconnect(me, "peer sent have none without fast extension");
+        return;
+    }
+
+    if (pwp_conn_flag_is_set(me_, PC_BITFIELD_RECEIVED))
+    {
+        __disconnect(me, "peer sent have none after bitfield");
+        return;
+    }
+
+    me->state.flags |= PC_BITFIELD_RECEIVED;
+}
+
+void pwp_conn_suggest(pwp_conn_t* me_, msg_have_t* suggest)
+{
+    pwp_conn_private_t* me = (void*)me_;
+
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_SUGGEST,
+            suggest->piece_idx, 0, 0);
+
+    if (!__fast(me))
+    {
+        __disconnect(me, "peer sent suggest without fast extension");
+        return;
+    }
+
+    /* suggestions are advisory; ignore the ones we can't use */
+    if (me->num_pieces <= (int)suggest->piece_idx ||
+        chunky_have(me->pieces_completed, suggest->piece_idx, 1))
+        return;
+
+    if (me->cb.peer_suggest_piece)
+        me->cb.peer_suggest_piece(me->cb_ctx, me->peer_udata,
+                suggest->piece_idx);
+}
+
+void pwp_conn_allowed_fast(pwp_conn_t* me_, msg_have_t* allowed)
+{
+    pwp_conn_private_t* me = (void*)me_;
+
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_ALLOWED_FAST,
+            allowed->piece_idx, 0, 0);
+
+    if (!__fast(me))
+    {
+        __disconnect(me, "peer sent allowed fast without fast extension");
+        return;
+    }
+
+    /* out of range pieces are ignored (BEP 6) */
+    if (me->num_pieces <= (int)allowed->piece_idx)
+        return;
+
+    chunky_mark_complete(me->pieces_allowed_fast, allowed->piece_idx, 1);
+}
+
+/**
+ * Learn the peer's ids for our extensions
+ * @return 1 on success; 0 if the dictionary is malformed */
+static int __extended_handshake_m(pwp_conn_private_t* me, pwp_bencode_t* b)
+{
+    pwp_bencode_tok_t k, v;
+    int id;
+
+    while (1)
+    {
+        if (1 != pwp_bencode_next(b, &k))
+            return 0;
+
+        if (k.type == PWP_BENCODE_END)
+            return 1;
+
+        if (k.type != PWP_BENCODE_STR ||
+            1 != pwp_bencode_next(b, &v) || -1 == pwp_bencode_skip(b, &v))
+            return 0;
+
+        if (!me->extensions ||
+            v.type != PWP_BENCODE_INT || v.ival < 0 || 255 < v.ival)
+            continue;
+
+        /* a zero id means the peer has disabled the extension */
+        if ((id = pwp_extensions_get_id(me->extensions, k.str, k.len)))
+            me->ext_peer_ids[id] = v.ival;
+    }
+}
+
+/**
+ * Learn the peer's ids for our extensions from their extended handshake
+ * @return 1 on success; 0 if the handshake is malformed */
+static int __extended_handshake(pwp_conn_private_t* me, msg_extended_t* ext)
+{
+    pwp_bencode_t b;
+    pwp_bencode_tok_t k, v;
+
+    pwp_bencode_init(&b, ext->data, ext->len);
+
+    if (1 != pwp_bencode_next(&b, &v) || v.type != PWP_BENCODE_DICT)
         return 0;
+
+    while (1)
+    {
+        if (1 != pwp_bencode_next(&b, &k))
+            return 0;
+
+        if (k.type == PWP_BENCODE_END)
+            return 1;
+
+        if (k.type != PWP_BENCODE_STR || 1 != pwp_bencode_next(&b, &v))
+            return 0;
+
+        if (pwp_bencode_str_is(&k, "m") && v.type == PWP_BENCODE_DICT)
+        {
+            if (!__extended_handshake_m(me, &b))
+                return 0;
+        }
+        else if (pwp_bencode_str_is(&k, "upload_only") &&
+                v.type == PWP_BENCODE_INT)
+        {
+            if (v.ival)
+                me->state.flags |= PC_PEER_UPLOAD_ONLY;
+            else
+                me->state.flags &= ~PC_PEER_UPLOAD_ONLY;
+        }
+        else if (-1 == pwp_bencode_skip(&b, &v))
+            return 0;
     }
+}
+
+int pwp_conn_extended(pwp_conn_t* me_, msg_extended_t* ext)
+{
+    pwp_conn_private_t* me = (void*)me_;
 
-    /* We're choking - we aren't obligated to respond to this request */
-    if (pwp_conn_im_choking(me_))
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_EXTENDED,
+            ext->id, 0, ext->len);
+
+    if (!(me->state.caps & PWP_CAP_EXTENSION))
     {
+        __disconnect(me, "peer sent extended msg without extension protocol");
+        return 0;
+    }
+
+    if (0 == ext->id)
+    {
+        if (!__extended_handshake(me, ext))
+        {
+            __disconnect(me, "peer sent invalid extended handshake");
+            return 0;
+        }
+        return 1;
+    }
+
+    /* we haven't registered any extensions */
+    if (!me->extensions)
+        return 1;
+
+    if (0 == pwp_extensions_dispatch(me->extensions, me_, ext->id,
+                ext->data, ext->len))
+    {
+        __disconnect(me, "extension %d failed", ext->id);
+        return 0;
+    }
+
+    return 1;
+}
+
+int pwp_conn_reject(pwp_conn_t* me_, bt_block_t *r)
+{
+    pwp_conn_private_t* me = (void*)me_;
+    request_t *req;
+
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_REJECT,
+            r->piece_idx, r->offset, r->len);
+
+    if (!__fast(me))
+    {
+        __disconnect(me, "peer sent reject without fast extension");
+        return 0;
+    }
+
+    if (!(req = pwp_reqmap_remove(me->recv_reqs, r)))
+    {
+        __disconnect(me, "peer rejected a request we didn't make");
+        return 0;
+    }
+
+    /* give the block back now instead of waiting for a timeout */
+    __giveback_blocks(me, &req->blk, 1);
+    free(req);
+    return 1;
+}
+
+int pwp_conn_request(pwp_conn_t* me_, bt_block_t *r)
+{
+    pwp_conn_private_t* me = (void*)me_;
+
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_REQUEST,
+            r->piece_idx, r->offset, r->len);
+
+    /* with the fast extension we reject instead of disconnecting;
+     * unless it's a piece the peer is allowed to fetch while choked */
+    if (pwp_conn_im_choking(me_) && __fast(me))
+    {
+        if (!chunky_have(me->pieces_granted_fast, r->piece_idx, 1))
+        {
+            pwp_conn_send_reject(me_, r);
+            return 0;
+        }
+    }
+    /* check that the client doesn't request when they are choked */
+    else if (pwp_conn_im_choking(me_))
+    {
+        __disconnect(me, "peer requested when they were choked");
         return 0;
     }
 
@@ -810,12 +1327,8 @@ int pwp_conn_request(pwp_conn_t* me_, bt_block_t *r)
 
     /* Append block to our pending request queue. */
     /* Don't append the block twice. */
-    if (!llqueue_get_item_via_cmpfunction(me->peer_reqs,r,(void*)__req_cmp))
-    {
-        bt_block_t* b = malloc(sizeof(bt_block_t));
-        memcpy(b,r, sizeof(bt_block_t));
-        llqueue_offer(me->peer_reqs,b);
-    }
+    if (-1 == pwp_blkqueue_find(me->peer_reqs, r))
+        pwp_blkqueue_offer(me->peer_reqs, r);
 
     return 1;
 }
@@ -823,21 +1336,27 @@ int pwp_conn_request(pwp_conn_t* me_, bt_block_t *r)
 void pwp_conn_cancel(pwp_conn_t* me_, bt_block_t *cancel)
 {
     pwp_conn_private_t* me = (void*)me_;
-    bt_block_t *removed;
+    bt_block_t removed;
+    int idx;
+
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_CANCEL,
+            cancel->piece_idx, cancel->offset, cancel->len);
+
+    if (-1 == (idx = pwp_blkqueue_find(me->peer_reqs, cancel)))
+        return;
 
-    __log(me, "read,cancel,piece_idx=%d offset=%d length=%d",
-          cancel->piece_idx, cancel->offset, cancel->len);
+    pwp_blkqueue_remove(me->peer_reqs, idx, &removed);
 
-    removed = llqueue_remove_item_via_cmpfunction(
-            me->peer_reqs, cancel, (void*)__req_cmp);
-    free(removed);
+    /* with the fast extension every request is answered; even cancelled ones */
+    if (__fast(me))
+        pwp_conn_send_reject(me_, &removed);
 //  queue_remove(peer->request_queue);
 }
 
 int pwp_conn_block_request_is_pending(void* pc, bt_block_t *b)
 {
     pwp_conn_private_t* me = pc;
-    return NULL != hashmap_get(me->recv_reqs, b);
+    return NULL != pwp_reqmap_get(me->recv_reqs, b);
 }
 
 /**
@@ -849,7 +1368,7 @@ static void __conn_remove_pending_request(pwp_conn_private_t* me, const bt_block
     void *add;
 
     /* remove pending request */
-    if ((r = hashmap_remove(me->recv_reqs, &pb)))
+    if ((r = pwp_reqmap_remove(me->recv_reqs, pb)))
     {
         free(r);
         return;
@@ -866,9 +1385,9 @@ static void __conn_remove_pending_request(pwp_conn_private_t* me, const bt_block
         return 0;
 #endif
 
-    hashmap_iterator_t iter;
-    for (hashmap_iterator(me->recv_reqs, &iter);
-         (r = hashmap_iterator_next_value(me->recv_reqs, &iter));)
+    pwp_reqmap_iterator_t iter;
+    for (pwp_reqmap_iterator(me->recv_reqs, &iter);
+         (r = pwp_reqmap_iterator_next_value(me->recv_reqs, &iter));)
     {
         llqueue_offer(add,r);
     }
@@ -887,7 +1406,7 @@ static void __conn_remove_pending_request(pwp_conn_private_t* me, const bt_block
         if (pb->offset <= rb->offset &&
             rb->offset + rb->len <= pb->offset + pb->len)
         {
-            r = hashmap_remove(me->recv_reqs, &r->blk);
+            r = pwp_reqmap_remove(me->recv_reqs, &r->blk);
             assert(r);
             free(r);
         }
@@ -907,39 +1426,39 @@ static void __conn_remove_pending_request(pwp_conn_private_t* me, const bt_block
             n->blk.len = rb->len - pb->len - (pb->offset - rb->offset);
             assert((int)n->blk.len != 0);
             assert((int)n->blk.len > 0);
-            hashmap_put(me->recv_reqs, &n->blk, n);
+            pwp_reqmap_put(me->recv_reqs, &n->blk, n);
             assert(n->blk.len > 0);
 
-            hashmap_remove(me->recv_reqs, &r->blk);
+            pwp_reqmap_remove(me->recv_reqs, &r->blk);
 
             rb->len = pb->offset - rb->offset;
             assert((int)rb->len > 0);
-            hashmap_put(me->recv_reqs, &r->blk, r);
+            pwp_reqmap_put(me->recv_reqs, &r->blk, r);
             assert(rb->len > 0);
         }
         /*  piece splits it on the left side */
         else if (rb->offset < pb->offset + pb->len &&
             pb->offset + pb->len < rb->offset + rb->len)
         {
-            hashmap_remove(me->recv_reqs, &r->blk);
+            pwp_reqmap_remove(me->recv_reqs, &r->blk);
 
-            /*  resize and return to hashmap */
+            /*  resize and return to map */
             rb->len -= (pb->offset + pb->len) - rb->offset;
             rb->offset = pb->offset + pb->len;
             assert((int)rb->len > 0);
-            hashmap_put(me->recv_reqs, &r->blk, r);
+            pwp_reqmap_put(me->recv_reqs, &r->blk, r);
         }
         /*  piece splits it on the right side */
         else if (rb->offset < pb->offset &&
             pb->offset < rb->offset + rb->len &&
             rb->offset + rb->len <= pb->offset + pb->len)
         {
-            hashmap_remove(me->recv_reqs, &r->blk);
+            pwp_reqmap_remove(me->recv_reqs, &r->blk);
 
-            /*  resize and return to hashmap */
+            /*  resize and return to map */
             rb->len = pb->offset - rb->offset;
             assert((int)rb->len > 0);
-            hashmap_put(me->recv_reqs, &r->blk, r);
+            pwp_reqmap_put(me->recv_reqs, &r->blk, r);
         }
     }
 
@@ -952,10 +1471,8 @@ int pwp_conn_piece(pwp_conn_t* me_, msg_piece_t *p)
 
     assert(me->cb.pushblock);
 
-    __log(me, "read,piece,piece_idx=%d offset=%d length=%d",
-          p->blk.piece_idx,
-          p->blk.offset,
-          p->blk.len);
+    __trace(me, PWP_TRACE_READ, PWP_MSGTYPE_PIECE,
+            p->blk.piece_idx, p->blk.offset, p->blk.len);
 
     __conn_remove_pending_request(me, &p->blk);
     me->cb.pushblock(me->cb_ctx, me->peer_udata, &p->blk, p->data);
@@ -76,6 +76,15 @@ typedef void (
     bt_block_t * blk
 );
 
+typedef void (
+    *func_peergiveblocksback_f
+)   (
+    void *udata,
+    void *peer,
+    bt_block_t * blks,
+    unsigned int nblks
+);
+
 typedef void (
     *func_peerpiece_f
 )   (
@@ -84,6 +93,22 @@ typedef void (
     int piece
 );
 
+typedef void (
+    *func_peerpieces_f
+)   (
+    void *udata,
+    void *peer,
+    const uint32_t* pieces,
+    unsigned int npieces
+);
+
+typedef void (
+    *func_peer_f
+)   (
+    void *udata,
+    void *peer
+);
+
 typedef int (
     *func_lock_f
 )   (
@@ -115,6 +140,18 @@ typedef int (
 #define PC_PEER_CHOKING ((unsigned int)1<<8)
 #define PC_PEER_INTERESTED ((unsigned int)1<<9)
 #define PC_FAILED_CONNECTION ((unsigned int)1<<10)
+/*  we only upload; ie. we are a seed */
+#define PC_UPLOAD_ONLY ((unsigned int)1<<11)
+/*  peer told us they only upload, via the extended handshake */
+#define PC_PEER_UPLOAD_ONLY ((unsigned int)1<<12)
+
+/* Capabilities negotiated via the handshake's reserved bytes */
+/*  BEP 5: DHT */
+#define PWP_CAP_DHT ((unsigned int)1<<0)
+/*  BEP 6: Fast Extension */
+#define PWP_CAP_FAST ((unsigned int)1<<1)
+/*  BEP 10: Extension Protocol */
+#define PWP_CAP_EXTENSION ((unsigned int)1<<2)
 
 typedef enum
 {
@@ -127,6 +164,14 @@ typedef enum
     PWP_MSGTYPE_REQUEST = 6,
     PWP_MSGTYPE_PIECE = 7,
     PWP_MSGTYPE_CANCEL = 8,
+    /* BEP 6: Fast Extension */
+    PWP_MSGTYPE_SUGGEST = 13,
+    PWP_MSGTYPE_HAVE_ALL = 14,
+    PWP_MSGTYPE_HAVE_NONE = 15,
+    PWP_MSGTYPE_REJECT = 16,
+    PWP_MSGTYPE_ALLOWED_FAST = 17,
+    /* BEP 10: Extension Protocol */
+    PWP_MSGTYPE_EXTENDED = 20,
 } pwp_msg_type_e;
 
 /**
@@ -134,6 +179,9 @@ typedef enum
  * @param if non-null, use this as memory for the connection */
 void *pwp_conn_new(void* mem);
 
+/**
+ * Release memory used by the connection.
+ * Memory provided to pwp_conn_new is not freed */
 void pwp_conn_release(pwp_conn_t* pco);
 
 /**
@@ -165,7 +213,7 @@ int pwp_conn_get_download_rate(const pwp_conn_t* pco);
 int pwp_conn_get_upload_rate(const pwp_conn_t* pco);
 
 /**
- * unchoke, choke, interested, uninterested,
+ * unchoke, choke, interested, uninterested, have all, have none
  * @return non-zero if unsucessful */
 int pwp_conn_send_statechange(pwp_conn_t* pco, const unsigned char msg_type);
 
@@ -188,14 +236,93 @@ void pwp_conn_send_request(pwp_conn_t* pco, const bt_block_t * request);
  * Tell peer we are cancelling the request for this block */
 void pwp_conn_send_cancel(pwp_conn_t* pco, bt_block_t * cancel);
 
+/**
+ * Tell peer we won't be sending them this block */
+void pwp_conn_send_reject(pwp_conn_t* pco, const bt_block_t * reject);
+
+/**
+ * Tell peer they can request this piece while we choke them */
+void pwp_conn_send_allowed_fast(pwp_conn_t* pco, const int piece_idx);
+
+/**
+ * Let the peer request these pieces while we choke them.
+ * An allowed fast message is sent for each piece
+ * @param pieces Allowed fast set, see pwp_allowed_fast_get
+ * @param npieces Number of pieces within the set */
+void pwp_conn_grant_allowed_fast(pwp_conn_t* pco,
+        const unsigned int* pieces, const unsigned int npieces);
+
+/**
+ * Suggest the peer downloads this piece; ie. because it's cached in memory.
+ * Suggestions are rate limited per period and only sent if the peer lacks
+ * the piece
+ * @return 1 if the suggestion was sent; otherwise 0 */
+int pwp_conn_suggest_piece(pwp_conn_t* pco, const int piece_idx);
+
+/**
+ * Use these extensions for extended messages
+ * @param extensions Registry of extensions, see pwp_extensions_new */
+void pwp_conn_set_extensions(pwp_conn_t* pco, void* extensions);
+
+/**
+ * Record messages sent and received into this ring.
+ * The ring must only be used by this connection, see pwp_trace_new
+ * @param trace Ring of trace events; NULL stops tracing */
+void pwp_conn_set_trace(pwp_conn_t* pco, void* trace);
+
+/**
+ * Send our extended handshake, built from the registry of extensions */
+void pwp_conn_send_extended_handshake(pwp_conn_t* pco);
+
+/**
+ * Send an extended message
+ * @param ext_id The id the registry gave the extension
+ * @return 1 if sent; 0 if the peer doesn't support the extension */
+int pwp_conn_send_extended(pwp_conn_t* pco, const int ext_id,
+        const char* payload, const unsigned int len);
+
+/**
+ * @param ext_id The id the registry gave the extension
+ * @return 1 if the peer supports the extension */
+int pwp_conn_peer_supports_extension(pwp_conn_t* pco, const int ext_id);
+
+/**
+ * @return 1 if we can request this piece while the peer chokes us */
+int pwp_conn_peer_allowed_fast(pwp_conn_t* pco, const int piece_idx);
+
 void pwp_conn_set_im_interested(pwp_conn_t* me_);
 
 void pwp_conn_set_piece_info(pwp_conn_t* pco, int num_pieces, int piece_len);
 
+/**
+ * @return number of pieces set by pwp_conn_set_piece_info; 0 if not set */
+int pwp_conn_get_num_pieces(pwp_conn_t* pco);
+
 void pwp_conn_set_state(pwp_conn_t* pco, const int state);
 
 int pwp_conn_get_state(pwp_conn_t* pco);
 
+/**
+ * Set the capabilities both we and the peer support
+ * @param caps Bitwise OR of PWP_CAP_* values */
+void pwp_conn_set_capabilities(pwp_conn_t* pco, const unsigned int caps);
+
+/**
+ * @return capabilities both we and the peer support */
+unsigned int pwp_conn_get_capabilities(pwp_conn_t* pco);
+
+/**
+ * Only upload to this peer; ie. because we are a seed.
+ * Interest and block requests are suppressed.
+ * Advertise this to peers by setting "upload_only" via
+ * pwp_extensions_set_int */
+void pwp_conn_set_upload_only(pwp_conn_t* pco, const int upload_only);
+
+/**
+ * @return 1 if neither side can download from the other; ie. we and the peer
+ *  are both seeds. The connection can be dropped */
+int pwp_conn_is_redundant(pwp_conn_t* pco);
+
 /**
  * Peer told us they have this piece.
  * @return 0 on error, 1 otherwise */
@@ -243,9 +370,27 @@ typedef struct {
     /* Let caller know that a peer has announced that they have a piece */
     func_peerpiece_f peer_have_piece;
 
+    /* Let caller know that a peer has announced several pieces at once,
+     * eg. from a bitfield or a run of haves.
+     * If not set, peer_have_piece is called for each piece */
+    func_peerpieces_f peer_have_pieces;
+
+    /* Let caller know that a peer has every piece, ie. it sent HAVE_ALL.
+     * If not set, peer_have_piece is called for each piece */
+    func_peer_f peer_have_all;
+
     /* Let caller know that it couldn't download this piece from this peer */
     func_peergiveblockback_f peer_giveback_block;
 
+    /* Let caller know that it couldn't download several blocks, eg. when
+     * the peer chokes us. If not set, peer_giveback_block is called for
+     * each block */
+    func_peergiveblocksback_f peer_giveback_blocks;
+
+    /* Let caller know that the peer suggests we download this piece.
+     * Pickers can use this to break ties */
+    func_peerpiece_f peer_suggest_piece;
+
 #if 0
     /**
      * Create lock */
@@ -288,6 +433,13 @@ typedef struct {
    bitfield_t *bf;
 } msg_bitfield_t;
 
+typedef struct {
+    /* extended message id; 0 is the extended handshake */
+    unsigned char id;
+    const char* data;
+    unsigned int len;
+} msg_extended_t;
+
 void pwp_conn_choke_peer(pwp_conn_t* pco);
 
 void pwp_conn_unchoke_peer(pwp_conn_t* pco);
@@ -304,10 +456,45 @@ void pwp_conn_uninterested(pwp_conn_t* pco);
 
 void pwp_conn_have(pwp_conn_t* pco, msg_have_t* have);
 
+/**
+ * Receive a run of have messages as one update
+ * @param pieces Piece indices from the have messages, in order
+ * @param npieces Number of pieces */
+void pwp_conn_have_batch(pwp_conn_t* pco,
+        const uint32_t* pieces,
+        unsigned int npieces);
+
 /**
  * Receive a bitfield */
 void pwp_conn_bitfield(pwp_conn_t* pco, msg_bitfield_t* bitfield);
 
+/**
+ * Receive a have all message. Replaces the bitfield */
+void pwp_conn_have_all(pwp_conn_t* pco);
+
+/**
+ * Receive a have none message. Replaces the bitfield */
+void pwp_conn_have_none(pwp_conn_t* pco);
+
+/**
+ * Receive a suggest piece message */
+void pwp_conn_suggest(pwp_conn_t* pco, msg_have_t* suggest);
+
+/**
+ * Receive an allowed fast message */
+void pwp_conn_allowed_fast(pwp_conn_t* pco, msg_have_t* allowed);
+
+/**
+ * Receive an extended message
+ * @return 0 on error, 1 otherwise */
+int pwp_conn_extended(pwp_conn_t* pco, msg_extended_t* ext);
+
+/**
+ * Receive a reject message.
+ * The block is given back straight away
+ * @return 0 on error, 1 otherwise */
+int pwp_conn_reject(pwp_conn_t* pco, bt_block_t *reject);
+
 /**
  * Respond to a peer's request for a block
  * @return 0 on error, 1 otherwise */
@@ -359,4 +546,49 @@ int pwp_send_bitfield(
         void* cb_ctx,
         void* peer_udata);
 
+/**
+ * @param npieces Number of pieces
+ * @return size in bytes of a bitfield message, including length prefix */
+unsigned int pwp_bitfield_msg_size(int npieces);
+
+/**
+ * Write a bitfield message telling the peer what we have.
+ * Increments ptr by pwp_bitfield_msg_size(npieces)
+ * @param npieces Number of pieces
+ * @param pieces_completed Sparse counter containing pieces we've completed */
+void pwp_write_bitfield(char** ptr, int npieces, void* pieces_completed);
+
+/**
+ * Create an encoded bitfield message that is shared by every connection of
+ * a torrent. The library doesn't know when pieces complete, so the caller
+ * must call pwp_bitfield_cache_mark after every piece it verifies
+ * @param npieces Number of pieces
+ * @param pieces_completed Sparse counter containing pieces we've completed
+ * @return new bitfield cache */
+void* pwp_bitfield_cache_new(int npieces, void* pieces_completed);
+
+/**
+ * Release memory used by bitfield cache */
+void pwp_bitfield_cache_release(void* bc);
+
+/**
+ * Record that we've completed this piece.
+ * Call this once the piece is verified, alongside marking pieces_completed
+ * and sending HAVEs */
+void pwp_bitfield_cache_mark(void* bc, unsigned int piece);
+
+/**
+ * @param len Set to the size of the message, including length prefix
+ * @return the encoded bitfield message */
+const char* pwp_bitfield_cache_get(void* bc, unsigned int* len);
+
+/**
+ * Send the cached bitfield to the peer without encoding it again
+ * @return 1 if successful, 0 otherwise */
+int pwp_send_bitfield_cached(
+        void* bc,
+        func_send_f send_cb,
+        void* cb_ctx,
+        void* peer_udata);
+
 #endif /* PWP_CONNECTION_H */
@@ -17,6 +17,9 @@ typedef struct
     /* current tick */
     int tick;
 
+    /* PWP_CAP_* capabilities negotiated within the handshake */
+    unsigned int caps;
+
 } peer_connection_state_t;
 
 typedef struct
@@ -34,19 +37,26 @@ typedef struct
     unsigned int bytes_downloaded_this_period,
                  bytes_uploaded_this_period;
 
+    /* suggest piece messages sent; limited per period */
+    unsigned int suggests_this_period;
+
     /* Download/upload rate measurement */
     void *bytes_drate,
         *bytes_urate;
 
     /* Pending requests that we are waiting to get
      * We could receive pieces that are a subset of the original request */
-    hashmap_t *recv_reqs;
+    void *recv_reqs;
 
     /* Pending requests we are fufilling for the peer */
-    linked_list_queue_t *peer_reqs;
+    void *peer_reqs;
     
+    /* reused to collect blocks of requests that have timed out */
+    bt_block_t* expunged;
+    unsigned int expunged_size;
+
     /* list of requests to make */
-    linked_list_queue_t *reqs;
+    void *reqs;
     void *req_lock;
 
     // TODO: need to remove this
@@ -69,6 +79,24 @@ typedef struct
     /* pieces that the piece has */
     chunkybar_t *pieces_peerhas;
 
+    /* pieces the peer can request while we choke them */
+    chunkybar_t *pieces_granted_fast;
+
+    /* pieces we can request while the peer chokes us */
+    chunkybar_t *pieces_allowed_fast;
+
+    /* registry of extensions we support */
+    void* extensions;
+
+    /* ring of binary trace events; NULL if not tracing */
+    void* trace;
+
+    /* the peer's ids for our extensions; 0 if unsupported by peer */
+    unsigned char ext_peer_ids[PWP_MAX_EXTENSIONS + 1];
+
+    /* 1 if we allocated this connection; 0 if memory was provided */
+    int own_mem;
+
 } pwp_conn_private_t;
 
 #endif /* PWP_CONNECTION_PRIVATE_H */
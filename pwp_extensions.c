@@ -0,0 +1,217 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. 
+ *
+ * @file
+ * @brief Registry of extension protocol (BEP 10) extensions for a torrent
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "pwp_extensions.h"
+
+typedef struct {
+    char* name;
+    func_extension_f func;
+    void* udata;
+} extension_t;
+
+typedef struct {
+    char* key;
+    long long val;
+} handshake_int_t;
+
+typedef struct {
+    /* an extension's id is its index plus one */
+    extension_t exts[PWP_MAX_EXTENSIONS];
+    int nexts;
+
+    /* integers at the top level of the handshake's dictionary */
+    handshake_int_t ints[PWP_MAX_EXTENSIONS];
+    int nints;
+
+    /* cached bencoded handshake dictionary; NULL if stale */
+    char* hs;
+    unsigned int hs_len;
+} extensions_t;
+
+void* pwp_extensions_new()
+{
+    return calloc(1, sizeof(extensions_t));
+}
+
+void pwp_extensions_release(void* reg)
+{
+    extensions_t* me = reg;
+    int i;
+
+    for (i = 0; i < me->nexts; i++)
+        free(me->exts[i].name);
+    for (i = 0; i < me->nints; i++)
+        free(me->ints[i].key);
+    free(me->hs);
+    free(me);
+}
+
+static void __invalidate(extensions_t* me)
+{
+    free(me->hs);
+    me->hs = NULL;
+}
+
+int pwp_extensions_add(void* reg,
+        const char* name,
+        func_extension_f func,
+        void* udata)
+{
+    extensions_t* me = reg;
+    extension_t* e;
+
+    if (PWP_MAX_EXTENSIONS <= me->nexts ||
+        0 != pwp_extensions_get_id(reg, name, strlen(name)))
+        return 0;
+
+    e = &me->exts[me->nexts++];
+    e->name = strdup(name);
+    e->func = func;
+    e->udata = udata;
+    __invalidate(me);
+    return me->nexts;
+}
+
+void pwp_extensions_set_int(void* reg, const char* key, long long val)
+{
+    extensions_t* me = reg;
+    int i;
+
+    for (i = 0; i < me->nints; i++)
+        if (0 == strcmp(me->ints[i].key, key))
+            break;
+
+    if (i == me->nints)
+    {
+        if (PWP_MAX_EXTENSIONS <= me->nints)
+            return;
+        me->ints[me->nints++].key = strdup(key);
+    }
+
+    me->ints[i].val = val;
+    __invalidate(me);
+}
+
+int pwp_extensions_get_id(void* reg, const char* name, unsigned int len)
+{
+    extensions_t* me = reg;
+    int i;
+
+    for (i = 0; i < me->nexts; i++)
+        if (strlen(me->exts[i].name) == len &&
+            0 == memcmp(me->exts[i].name, name, len))
+            return i + 1;
+    return 0;
+}
+
+static int __cmp_ext(const void* a, const void* b)
+{
+    return strcmp((*(const extension_t**)a)->name,
+            (*(const extension_t**)b)->name);
+}
+
+static int __cmp_int(const void* a, const void* b)
+{
+    return strcmp((*(const handshake_int_t**)a)->key,
+            (*(const handshake_int_t**)b)->key);
+}
+
+/**
+ * Bencode dictionaries need sorted keys */
+static void __build_handshake(extensions_t* me)
+{
+    extension_t* exts[PWP_MAX_EXTENSIONS];
+    handshake_int_t* ints[PWP_MAX_EXTENSIONS];
+    unsigned int size = 16, len = 0;
+    int i, m_done = 0;
+
+    for (i = 0; i < me->nexts; i++)
+    {
+        exts[i] = &me->exts[i];
+        size += strlen(exts[i]->name) + 32;
+    }
+    for (i = 0; i < me->nints; i++)
+    {
+        ints[i] = &me->ints[i];
+        size += strlen(ints[i]->key) + 32;
+    }
+    qsort(exts, me->nexts, sizeof(exts[0]), __cmp_ext);
+    qsort(ints, me->nints, sizeof(ints[0]), __cmp_int);
+
+    if (!(me->hs = malloc(size)))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+
+#define append(...) \
+    len += snprintf(me->hs + len, size - len, __VA_ARGS__)
+
+    append("d");
+    for (i = 0; i <= me->nints; i++)
+    {
+        /* "m" goes in its sorted position */
+        if (!m_done && (i == me->nints || 0 < strcmp(ints[i]->key, "m")))
+        {
+            int j;
+
+            append("1:md");
+            for (j = 0; j < me->nexts; j++)
+                append("%d:%si%de", (int)strlen(exts[j]->name), exts[j]->name,
+                        (int)(exts[j] - me->exts) + 1);
+            append("e");
+            m_done = 1;
+        }
+
+        if (i < me->nints)
+            append("%d:%si%llde", (int)strlen(ints[i]->key), ints[i]->key,
+                    ints[i]->val);
+    }
+    append("e");
+#undef append
+
+    assert(len < size);
+    me->hs_len = len;
+}
+
+const char* pwp_extensions_get_handshake(void* reg, unsigned int* len)
+{
+    extensions_t* me = reg;
+
+    if (!me->hs)
+        __build_handshake(me);
+    *len = me->hs_len;
+    return me->hs;
+}
+
+int pwp_extensions_dispatch(void* reg,
+        void* pc,
+        int id,
+        const char* payload,
+        unsigned int len)
+{
+    extensions_t* me = reg;
+    extension_t* e;
+
+    /* we didn't advertise this id; ignore it */
+    if (id < 1 || me->nexts < id)
+        return 1;
+
+    e = &me->exts[id - 1];
+    if (!e->func)
+        return 1;
+    return e->func(e->udata, pc, payload, len);
+}
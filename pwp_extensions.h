@@ -0,0 +1,63 @@
+#ifndef PWP_EXTENSIONS_H
+#define PWP_EXTENSIONS_H
+
+/* maximum number of extensions within a registry */
+#define PWP_MAX_EXTENSIONS 16
+
+/**
+ * Receive an extended message
+ * @param pc The connection the message was received on
+ * @param payload The message, after the extended message id
+ * @return 1 on success; 0 if the peer needs to be disconnected */
+typedef int (*func_extension_f)(
+        void *udata,
+        void *pc,
+        const char *payload,
+        unsigned int len);
+
+/**
+ * Create a registry of extensions (BEP 10).
+ * A registry is shared by every connection of a torrent
+ * @return new registry */
+void* pwp_extensions_new();
+
+/**
+ * Release memory used by registry */
+void pwp_extensions_release(void* reg);
+
+/**
+ * Add an extension
+ * @param name Name of the extension; ie. "ut_metadata"
+ * @param func Called when the extension's message is received
+ * @return the id we use for this extension; 0 on error */
+int pwp_extensions_add(void* reg,
+        const char* name,
+        func_extension_f func,
+        void* udata);
+
+/**
+ * Set an integer within the handshake's dictionary; ie. "upload_only" */
+void pwp_extensions_set_int(void* reg, const char* key, long long val);
+
+/**
+ * @param len Length of name
+ * @return the id we use for this extension; 0 if it isn't registered */
+int pwp_extensions_get_id(void* reg, const char* name, unsigned int len);
+
+/**
+ * Get the extended handshake's bencoded dictionary.
+ * The dictionary is cached until the registry is changed
+ * @param len Set to the length of the dictionary
+ * @return the dictionary; owned by the registry */
+const char* pwp_extensions_get_handshake(void* reg, unsigned int* len);
+
+/**
+ * Receive an extended message for the extension with this id
+ * @return 1 on success; 0 if the peer needs to be disconnected */
+int pwp_extensions_dispatch(void* reg,
+        void* pc,
+        int id,
+        const char* payload,
+        unsigned int len);
+
+#endif /* PWP_EXTENSIONS_H */
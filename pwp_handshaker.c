@@ -15,29 +15,85 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #include "bitfield.h"
 #include "pwp_connection.h"
 #include "pwp_handshaker.h"
 #include "pwp_local.h"
-#include "bitstream.h"
+#include "pwp_wire.h"
+#include "linked_list_hashmap.h"
+#include "pwp_handshaker_private.h"
 
 typedef struct {
-    pwp_handshake_t hs;
-    unsigned int bytes_read;
+    char infohash[INFO_HASH_LEN];
+    void* torrent;
+} registry_entry_t;
+
+/* where each capability lives within the reserved bytes */
+static const struct {
+    unsigned int cap;
+    unsigned int byte;
+    unsigned char mask;
+} __caps[] = {
+    { PWP_CAP_DHT, 7, 0x01 },
+    { PWP_CAP_FAST, 7, 0x04 },
+    { PWP_CAP_EXTENSION, 5, 0x10 },
+};
+
+#undef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+
+/* the handshake struct must match the wire layout byte for byte */
+typedef char __handshake_size_check[
+    sizeof(pwp_handshake_t) == PWP_HANDSHAKE_LEN ? 1 : -1];
+
+void pwp_handshake_init(pwp_handshake_t* hs, const char* infohash, const char* my_pi)
+{
+    hs->pn_len = strlen(PROTOCOL_NAME);
+    memcpy(hs->pn, PROTOCOL_NAME, sizeof(hs->pn));
+    memset(hs->reserved, 0, sizeof(hs->reserved));
+    memcpy(hs->infohash, infohash, sizeof(hs->infohash));
+    memcpy(hs->peerid, my_pi, sizeof(hs->peerid));
+}
 
-    char* cur;
-    char* curr_value;
+void pwp_handshake_set_capabilities(pwp_handshake_t* hs, unsigned int caps)
+{
+    unsigned int i;
 
-    /* expected infohash */
-    char* expected_ih;
+    for (i = 0; i < sizeof(__caps) / sizeof(__caps[0]); i++)
+    {
+        if (caps & __caps[i].cap)
+            hs->reserved[__caps[i].byte] |= __caps[i].mask;
+        else
+            hs->reserved[__caps[i].byte] &= ~__caps[i].mask;
+    }
+}
 
-    /* my peer id */
-    char* my_pi;
+unsigned int pwp_handshake_get_capabilities(const pwp_handshake_t* hs)
+{
+    unsigned int i, caps = 0;
 
-    /* 1 is handshake is done; 0 otherwise */
-//    int status;
-} pwp_handshaker_t;
+    for (i = 0; i < sizeof(__caps) / sizeof(__caps[0]); i++)
+        if (hs->reserved[__caps[i].byte] & __caps[i].mask)
+            caps |= __caps[i].cap;
+    return caps;
+}
+
+void pwp_handshaker_set_capabilities(void* me_, unsigned int caps)
+{
+    pwp_handshaker_t* me = me_;
+    me->caps = caps;
+}
+
+unsigned int pwp_handshaker_get_capabilities(void* me_)
+{
+    pwp_handshaker_t* me = me_;
+
+    if (me->bytes_read < offsetof(pwp_handshake_t, infohash))
+        return 0;
+    return me->caps & pwp_handshake_get_capabilities(&me->hs);
+}
 
 int pwp_send_handshake(
         void* callee,
@@ -46,52 +102,206 @@ int pwp_send_handshake(
         char* expected_ih,
         char* my_pi)
 {
-    char buf[1024], *protocol_name = PROTOCOL_NAME, *ptr;
-    int size, ii;
+    pwp_handshake_t hs;
 
     assert(NULL != expected_ih);
     assert(NULL != my_pi);
 
-//    sprintf(buf, "%c%s" PWP_PC_HANDSHAKE_RESERVERD "%s%s",
-//            strlen(protocol_name), protocol_name, expected_ih, peerid);
+    pwp_handshake_init(&hs, expected_ih, my_pi);
+
+    if (0 == send(callee, udata, &hs, PWP_HANDSHAKE_LEN))
+    {
+//        __log(me, "send,handshake,fail");
+        return 0;
+    }
+
+    return 1;
+}
+
+int pwp_send_handshake_and_bitfield(
+        void* callee,
+        void* udata,
+        int (*send)(void *callee, const void *udata, const void *send_data, const int len),
+        const pwp_handshake_t* hs,
+        int npieces,
+        void* pieces_completed)
+{
+    char stack[1024], *buf, *ptr;
+    unsigned int size;
+    int ret;
+
+    size = PWP_HANDSHAKE_LEN + pwp_bitfield_msg_size(npieces);
+
+    /* only large torrents need to go to the heap */
+    if (size <= sizeof(stack))
+        buf = stack;
+    else if (!(buf = malloc(size)))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+
+    memcpy(buf, hs, PWP_HANDSHAKE_LEN);
+    ptr = buf + PWP_HANDSHAKE_LEN;
+    pwp_write_bitfield(&ptr, npieces, pieces_completed);
 
-    ptr = buf;
+    ret = send(callee, udata, buf, size);
 
-    /* protocol name length */
-    bitstream_write_byte((char**)&ptr, strlen(protocol_name));
+    if (buf != stack)
+        free(buf);
 
-    /* protocol name */
-    bitstream_write_string((char**)&ptr, protocol_name, strlen(protocol_name));
+    return 0 == ret ? 0 : 1;
+}
 
-    /* reserved characters */
-    for (ii=0;ii<8;ii++)
-        bitstream_write_byte((char**)&ptr, 0);
+int pwp_send_handshake_and_have_all_or_none(
+        void* callee,
+        void* udata,
+        int (*send)(void *callee, const void *udata, const void *send_data, const int len),
+        const pwp_handshake_t* hs,
+        const unsigned char msg_type)
+{
+    char buf[PWP_HANDSHAKE_LEN + PWP_WIRE_STATE_LEN];
 
-    /* infohash */
-    bitstream_write_string((char**)&ptr, expected_ih, 20);
+    assert(PWP_MSGTYPE_HAVE_ALL == msg_type ||
+           PWP_MSGTYPE_HAVE_NONE == msg_type);
 
-    /* peerid */
-    bitstream_write_string((char**)&ptr, my_pi, 20);
+    memcpy(buf, hs, PWP_HANDSHAKE_LEN);
+    pwp_wire_state((pwp_wire_state_t*)(buf + PWP_HANDSHAKE_LEN), msg_type);
 
-    /* calculate total handshake size */
-    size = 1 + strlen(protocol_name) + 8 + 20 + 20;
+    return 0 == send(callee, udata, buf, sizeof(buf)) ? 0 : 1;
+}
 
-    if (0 == send(callee, udata, buf, size))
+int pwp_send_handshake_and_cached_bitfield(
+        void* callee,
+        void* udata,
+        int (*send)(void *callee, const void *udata, const void *send_data, const int len),
+        const pwp_handshake_t* hs,
+        void* bc)
+{
+    char stack[1024], *buf;
+    const char* bf;
+    unsigned int size, bf_len;
+    int ret;
+
+    bf = pwp_bitfield_cache_get(bc, &bf_len);
+    size = PWP_HANDSHAKE_LEN + bf_len;
+
+    /* only large torrents need to go to the heap */
+    if (size <= sizeof(stack))
+        buf = stack;
+    else if (!(buf = malloc(size)))
     {
-//        __log(me, "send,handshake,fail");
-        return 0;
+        perror("out of memory");
+        exit(0);
     }
 
-    return 1;
+    memcpy(buf, hs, PWP_HANDSHAKE_LEN);
+    memcpy(buf + PWP_HANDSHAKE_LEN, bf, bf_len);
+
+    ret = send(callee, udata, buf, size);
+
+    if (buf != stack)
+        free(buf);
+
+    return 0 == ret ? 0 : 1;
 }
 
-void* pwp_handshaker_new(char* expected_info_hash, char* mypeerid)
+static unsigned long __infohash_hash(const void *obj)
+{
+    unsigned long h;
+
+    /* infohashes are SHA1 digests, so any of their bytes are well mixed */
+    memcpy(&h, obj, sizeof(h));
+    return h;
+}
+
+static long __infohash_cmp(const void *obj, const void *other)
+{
+    return memcmp(obj, other, INFO_HASH_LEN);
+}
+
+void* pwp_handshaker_registry_new()
+{
+    return hashmap_new(__infohash_hash, __infohash_cmp, 128);
+}
+
+void pwp_handshaker_registry_free(void* reg)
+{
+    hashmap_t* h = reg;
+    hashmap_iterator_t iter;
+    char* k;
+
+    /* Keys live within the entries. Iterating keys doesn't look at them, so
+     * each entry can be freed as we go and the map freed afterwards */
+    hashmap_iterator(h, &iter);
+    while ((k = hashmap_iterator_next(h, &iter)))
+        free(k - offsetof(registry_entry_t, infohash));
+    hashmap_freeall(h);
+}
+
+void pwp_handshaker_registry_add(void* reg, const char* infohash, void* torrent)
+{
+    registry_entry_t* e;
+
+    /* replace the torrent if it was already registered */
+    pwp_handshaker_registry_remove(reg, infohash);
+
+    e = malloc(sizeof(registry_entry_t));
+    memcpy(e->infohash, infohash, INFO_HASH_LEN);
+    e->torrent = torrent;
+    hashmap_put(reg, e->infohash, e);
+}
+
+void* pwp_handshaker_registry_remove(void* reg, const char* infohash)
+{
+    registry_entry_t* e;
+    void* torrent;
+
+    if (!(e = hashmap_remove(reg, infohash)))
+        return NULL;
+    torrent = e->torrent;
+    free(e);
+    return torrent;
+}
+
+void* pwp_handshaker_registry_get(void* reg, const char* infohash)
+{
+    registry_entry_t* e = hashmap_get(reg, infohash);
+    return e ? e->torrent : NULL;
+}
+
+void* pwp_handshaker_new_from_registry(void* registry, char* mypeerid)
 {
     pwp_handshaker_t* me;
 
     me = calloc(1,sizeof(pwp_handshaker_t));
+    pwp_handshaker_init(me, NULL, registry, mypeerid);
+    return me;
+}
+
+void* pwp_handshaker_get_torrent(void* me_)
+{
+    pwp_handshaker_t* me = me_;
+    return me->torrent;
+}
+
+void pwp_handshaker_init(pwp_handshaker_t* me,
+        char* expected_info_hash,
+        void* registry,
+        char* mypeerid)
+{
+    memset(me, 0, sizeof(pwp_handshaker_t));
     me->expected_ih = expected_info_hash;
+    me->registry = registry;
     me->my_pi = mypeerid;
+}
+
+void* pwp_handshaker_new(char* expected_info_hash, char* mypeerid)
+{
+    pwp_handshaker_t* me;
+
+    me = calloc(1,sizeof(pwp_handshaker_t));
+    pwp_handshaker_init(me, expected_info_hash, NULL, mypeerid);
     return me;
 }
 
@@ -114,42 +324,28 @@ pwp_handshake_t* pwp_handshaker_get_handshake(void* me_)
     return &me->hs;
 }
 
-char __readbyte(unsigned int* bytes_read, const char **buf, unsigned int* len)
-{
-    char val;
-
-    val = **buf;
-    *buf += 1;
-    *bytes_read += 1;
-    *len -= 1;
-    return val;
-}
-
-int pwp_handshaker_dispatch_from_buffer(void* me_, const char** buf, unsigned int* len)
+/**
+ * Validate the fields that were completed by reading bytes [from, to)
+ * @return 1 if valid; otherwise 0 */
+static int __validate(pwp_handshaker_t* me, unsigned int from, unsigned int to)
 {
-    pwp_handshaker_t* me = me_;
     pwp_handshake_t* hs = &me->hs;
 
-    while (0 < *len)
-    {
-
     /* protcol name length
      * The unsigned value of the first byte indicates the length of a
      * character string containing the prot name. In BTP/1.0 this number
      * is 19. The local peer knows its own prot name and hence also the
      * length of it. If this length is different than the value of this
      * first byte, then the connection MUST be dropped. */
-        if (me->curr_value == NULL)
+    if (from < 1 && 1 <= to)
+    {
+        if (hs->pn_len != strlen(PROTOCOL_NAME))
         {
-            hs->pn_len = __readbyte(&me->bytes_read, buf, len);
-            if (0 == hs->pn_len)
-            {
-                printf("ERROR: invalid length\n");
-                return -1;
-            }
-
-            me->cur = me->curr_value = hs->pn = malloc(hs->pn_len);
+            printf("ERROR: invalid length\n");
+            return 0;
         }
+    }
+
     /* protocol name
     This is a character string which MUST contain the exact name of the 
     prot in ASCII and have the same length as given in the Name Length
@@ -157,27 +353,20 @@ int pwp_handshaker_dispatch_from_buffer(void* me_, const char** buf, unsigned in
     version of BTP the remote peer uses. If this string is different
     from the local peers own prot name, then the connection is to be
     dropped. */
-        else if (me->curr_value == hs->pn)
+    if (from < offsetof(pwp_handshake_t, reserved) &&
+        offsetof(pwp_handshake_t, reserved) <= to)
+    {
+        if (0 != memcmp(hs->pn, PROTOCOL_NAME, sizeof(hs->pn)))
         {
-            *me->cur = __readbyte(&me->bytes_read, buf, len);
-            me->cur++;
-
-            /* validate */
-            if (me->cur - me->curr_value == hs->pn_len)
-            {
-                if (0 != strncmp((char*)hs->pn, PROTOCOL_NAME,
-                    hs->pn_len < strlen(PROTOCOL_NAME) ?
-                        hs->pn_len : strlen(PROTOCOL_NAME)))
-                {
-                    printf("ERROR: incorrect protocol name\n");
-                    return -1;
-                }
-
-                me->cur = me->curr_value = hs->reserved = malloc(8);
-            }
+            printf("ERROR: incorrect protocol name\n");
+            return 0;
         }
+    }
+
     /* Reserved The next 8 bytes in the string are reserved for future
-     * extensions and should be read without interpretation. */
+     * extensions and should be read without interpretation.
+     * The bits we understand are picked out by
+     * pwp_handshaker_get_capabilities */
 
     /* bep_0005, DHT: TODO
      * Peers supporting the DHT set the last bit of the 8-byte reserved flags
@@ -190,22 +379,6 @@ int pwp_handshaker_dispatch_from_buffer(void* me_, const char** buf, unsigned in
      *  ping is recieved, the node should attempt to insert the new contact
      *  information into their routing table according to the usual rules.  */
 
-        else if (me->curr_value == hs->reserved)
-        {
-            *(me->cur++) = __readbyte(&me->bytes_read, buf, len);
-
-            /* don't know what to do with set reserved bytes */
-            if (*(me->cur-1) != 0)
-            {
-                //printf("ERROR: unreserved bytes used\n");
-//                return -1;
-            }
-
-            if (me->cur - me->curr_value == 8)
-            {
-                me->cur = me->curr_value = hs->infohash = malloc(20);
-            }
-        }
     /* Info Hash:
     The next 20 bytes in the string are to be interpreted as a 20-byte SHA1
     of the info key in the metainfo file. Presumably, since both the local
@@ -216,26 +389,30 @@ int pwp_handshaker_dispatch_from_buffer(void* me_, const char** buf, unsigned in
     decides to no longer serve the file in question for some reason. The info
     hash may be used to enable the client to serve multiple torrents on the
     same port. */
-        else if (me->curr_value == hs->infohash)
+    if (from < offsetof(pwp_handshake_t, peerid) &&
+        offsetof(pwp_handshake_t, peerid) <= to)
+    {
+        if (me->registry)
         {
-            *(me->cur++) = __readbyte(&me->bytes_read, buf, len);
-
-            /* validate */
-            if (me->cur - me->curr_value == 20)
+            /* find out which of our torrents the peer wants */
+            me->torrent = pwp_handshaker_registry_get(me->registry, hs->infohash);
+            if (!me->torrent)
             {
-                /* check info hash matches expected */
-                if (0 != strncmp(
-                            (char*)hs->infohash,
-                            (char*)me->expected_ih, 20))
-                {
-                    printf("ERROR invalid infohash: '%s' vs '%s'\n",
-                            hs->infohash, me->expected_ih);
-                    return -1;
-                }
-
-                me->cur = me->curr_value = hs->peerid = malloc(20);
+                printf("ERROR unknown infohash: '%.*s'\n",
+                        INFO_HASH_LEN, hs->infohash);
+                return 0;
             }
         }
+        /* check info hash matches expected */
+        else if (0 != memcmp(hs->infohash, me->expected_ih, INFO_HASH_LEN))
+        {
+            printf("ERROR invalid infohash: '%.*s' vs '%.*s'\n",
+                    INFO_HASH_LEN, hs->infohash,
+                    INFO_HASH_LEN, me->expected_ih);
+            return 0;
+        }
+    }
+
     /* Peer ID:
     The last 20 bytes of the handshake are to be interpreted as the
     self-designated name of the peer. The local peer must use this name to
@@ -243,32 +420,37 @@ int pwp_handshaker_dispatch_from_buffer(void* me_, const char** buf, unsigned in
     peers own ID name, the connection MUST be dropped. Also, if any other
     peer has already identified itself to the local peer using that same peer
     ID, the connection MUST be dropped. */
-        else if (me->curr_value == hs->peerid)
-        {
-            *(me->cur++) = __readbyte(&me->bytes_read, buf, len);
-
-            if (me->cur - me->curr_value == 20)
-            {
 #if 0
-                /* disconnect if peer's ID is the same as ours */
-                if (!strncmp(peer_id,me->my_pi,20))
-                {
-                    __disconnect(me, "handshake: peer_id same as ours (us: %s them: %.*s)",
-                            me->my_pi, 20, peer_id);
-                    return 0;
-                }
-#endif
-//                me->status = 1;
-                return 1;//me->bytes_read;
-            }
-        }
-        else
+    if (to == PWP_HANDSHAKE_LEN)
+    {
+        /* disconnect if peer's ID is the same as ours */
+        if (!strncmp(hs->peerid,me->my_pi,20))
         {
-            printf("ERROR: invalid handshake\n");
-            return -1;
+            __disconnect(me, "handshake: peer_id same as ours (us: %s them: %.*s)",
+                    me->my_pi, 20, hs->peerid);
+            return 0;
         }
     }
+#endif
 
-    return 0;//me->bytes_read;
+    return 1;
 }
 
+int pwp_handshaker_dispatch_from_buffer(void* me_, const char** buf, unsigned int* len)
+{
+    pwp_handshaker_t* me = me_;
+    unsigned int from = me->bytes_read, size;
+
+    /* The handshake has a fixed layout, so we copy whatever we have straight
+     * into place. When the whole handshake is present this is one memcpy */
+    size = min(*len, PWP_HANDSHAKE_LEN - me->bytes_read);
+    memcpy((char*)&me->hs + me->bytes_read, *buf, size);
+    me->bytes_read += size;
+    *buf += size;
+    *len -= size;
+
+    if (!__validate(me, from, me->bytes_read))
+        return -1;
+
+    return me->bytes_read == PWP_HANDSHAKE_LEN ? 1 : 0;
+}
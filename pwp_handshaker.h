@@ -1,13 +1,19 @@
 #ifndef PWP_HANDSHAKER_H
 #define PWP_HANDSHAKER_H
 
+/* size of the handshake on the wire */
+#define PWP_HANDSHAKE_LEN 68
+
+/**
+ * The handshake exactly as it appears on the wire.
+ * Every field is a char array so there is no padding. */
 typedef struct {
     /* protocol name */
-    int pn_len;
-    char* pn;
-    char* reserved;
-    char* infohash;
-    char* peerid;
+    unsigned char pn_len;
+    char pn[19];
+    char reserved[8];
+    char infohash[20];
+    char peerid[20];
 } pwp_handshake_t;
 
 /**
@@ -15,6 +21,42 @@ typedef struct {
  * @return newly initialised handshaker */
 void* pwp_handshaker_new(char* expected_info_hash, char* mypeerid);
 
+/**
+ * Create a handshaker that accepts a handshake for any torrent within the
+ * registry. The torrent is looked up using the received infohash.
+ * @param registry Registry created with pwp_handshaker_registry_new
+ * @return newly initialised handshaker */
+void* pwp_handshaker_new_from_registry(void* registry, char* mypeerid);
+
+/**
+ * @return torrent matched by the received infohash; NULL if none yet */
+void* pwp_handshaker_get_torrent(void* me_);
+
+/**
+ * Create a registry of the torrents we serve, keyed on infohash.
+ * Lookups don't depend on the number of torrents in the registry.
+ * @return new registry */
+void* pwp_handshaker_registry_new();
+
+/**
+ * Release memory used by registry */
+void pwp_handshaker_registry_free(void* reg);
+
+/**
+ * Serve this torrent. Replaces any torrent with the same infohash
+ * @param infohash 20 byte infohash; this is copied
+ * @param torrent Returned by pwp_handshaker_get_torrent on a match */
+void pwp_handshaker_registry_add(void* reg, const char* infohash, void* torrent);
+
+/**
+ * Stop serving this torrent
+ * @return the removed torrent; otherwise NULL */
+void* pwp_handshaker_registry_remove(void* reg, const char* infohash);
+
+/**
+ * @return torrent with this infohash; otherwise NULL */
+void* pwp_handshaker_registry_get(void* reg, const char* infohash);
+
 /**
  * Release memory used by handshaker */
 void pwp_handshaker_release(void* hs);
@@ -35,6 +77,71 @@ int pwp_send_handshake(
         char* expected_ih,
         char* my_pi);
 
+/**
+ * Precompute the handshake we send for a torrent.
+ * The same handshake can be sent to every peer of the torrent.
+ * @param infohash 20 byte infohash
+ * @param my_pi 20 byte peer id */
+void pwp_handshake_init(pwp_handshake_t* hs, const char* infohash, const char* my_pi);
+
+/**
+ * Advertise these capabilities within the handshake's reserved bytes
+ * @param caps Bitwise OR of PWP_CAP_* values */
+void pwp_handshake_set_capabilities(pwp_handshake_t* hs, unsigned int caps);
+
+/**
+ * @return PWP_CAP_* capabilities advertised within the reserved bytes */
+unsigned int pwp_handshake_get_capabilities(const pwp_handshake_t* hs);
+
+/**
+ * Set the capabilities we support
+ * @param caps Bitwise OR of PWP_CAP_* values */
+void pwp_handshaker_set_capabilities(void* me_, unsigned int caps);
+
+/**
+ * @return capabilities both we and the peer support, once the handshake
+ *  has been received */
+unsigned int pwp_handshaker_get_capabilities(void* me_);
+
+/**
+ * Send a precomputed handshake immediately followed by our bitfield.
+ * Both messages are sent with one call to send.
+ * @param hs Handshake initialised with pwp_handshake_init
+ * @param npieces Number of pieces
+ * @param pieces_completed Chunkybar containing pieces we've completed
+ * @return 0 on failure; 1 otherwise */
+int pwp_send_handshake_and_bitfield(
+        void* callee,
+        void* udata,
+        int (*send)(void *callee, const void *udata, const void *send_data, const int len),
+        const pwp_handshake_t* hs,
+        int npieces,
+        void* pieces_completed);
+
+/**
+ * Send a precomputed handshake immediately followed by HAVE_ALL or
+ * HAVE_NONE, with one call to send. Only for peers that support the fast
+ * extension; saves seeds and new peers from sending a bitfield
+ * @param msg_type PWP_MSGTYPE_HAVE_ALL or PWP_MSGTYPE_HAVE_NONE
+ * @return 0 on failure; 1 otherwise */
+int pwp_send_handshake_and_have_all_or_none(
+        void* callee,
+        void* udata,
+        int (*send)(void *callee, const void *udata, const void *send_data, const int len),
+        const pwp_handshake_t* hs,
+        const unsigned char msg_type);
+
+/**
+ * Send a precomputed handshake immediately followed by a cached bitfield
+ * @param bc Bitfield cache from pwp_bitfield_cache_new
+ * @return 0 on failure; 1 otherwise */
+int pwp_send_handshake_and_cached_bitfield(
+        void* callee,
+        void* udata,
+        int (*send)(void *callee, const void *udata, const void *send_data, const int len),
+        const pwp_handshake_t* hs,
+        void* bc);
+
 /**
  * @return null if handshake was successful */
 pwp_handshake_t* pwp_handshaker_get_handshake(void* me_);
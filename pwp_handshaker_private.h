@@ -0,0 +1,34 @@
+#ifndef PWP_HANDSHAKER_PRIVATE_H
+#define PWP_HANDSHAKER_PRIVATE_H
+
+typedef struct {
+    pwp_handshake_t hs;
+
+    /* number of handshake bytes we have read so far */
+    unsigned int bytes_read;
+
+    /* expected infohash */
+    char* expected_ih;
+
+    /* my peer id */
+    char* my_pi;
+
+    /* torrents we serve, when we aren't expecting a single infohash */
+    void* registry;
+
+    /* torrent matched via the registry */
+    void* torrent;
+
+    /* PWP_CAP_* capabilities we support */
+    unsigned int caps;
+} pwp_handshaker_t;
+
+/**
+ * Initialise a handshaker that lives within memory we don't own
+ * @param registry If non-null, accept any torrent within this registry */
+void pwp_handshaker_init(pwp_handshaker_t* me,
+        char* expected_info_hash,
+        void* registry,
+        char* mypeerid);
+
+#endif /* PWP_HANDSHAKER_PRIVATE_H */
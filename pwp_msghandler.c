@@ -20,25 +20,15 @@
 /* for uint32_t */
 #include <stdint.h>
 
+/* for struct iovec */
+#include <sys/uio.h>
+
 #include "bitfield.h"
 #include "pwp_connection.h"
 #include "pwp_msghandler.h"
 #include "pwp_msghandler_private.h"
+#include "pwp_wire.h"
 
-/**
- * Flip endianess **/
-static uint32_t fe(uint32_t i)
-{
-    uint32_t o;
-    char *c = (char *)&i;
-    char *p = (char *)&o;
-
-    p[0] = c[3];
-    p[1] = c[2];
-    p[2] = c[1];
-    p[3] = c[0];
-    return o;
-}
 
 int mh_uint32(
         uint32_t* in,
@@ -50,7 +40,7 @@ int mh_uint32(
     {
         if (msg->tok_bytes_read == 4)
         {
-            *in = fe(*in);
+            *in = pwp_wire_u32(*in);
             msg->tok_bytes_read = 0;
             return 1;
         }
@@ -88,6 +78,66 @@ int mh_byte(
     return 1;
 }
 
+/**
+ * Make sure the reassembly buffer can hold this many bytes
+ * @return 1 on success; 0 if the buffer would be too big */
+static int __rbuf_reserve(pwp_msghandler_private_t *me, unsigned int size)
+{
+    if (size <= me->rbuf_size)
+        return 1;
+    if (PWP_MAX_FRAME_LEN < size)
+        return 0;
+    if (!(me->rbuf = realloc(me->rbuf, size)))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+    me->rbuf_size = size;
+    return 1;
+}
+
+/**
+ * Gather the rest of the message into one contiguous frame.
+ * The frame is only copied if it spans reads.
+ * @param hdr Bytes after the length prefix which aren't part of the frame
+ * @param frame Set to the frame once it is complete
+ * @return 1 if complete; 0 if we need more data; -1 if frame is too big */
+static int __read_frame(pwp_msghandler_private_t *me, msg_t* m,
+        const char** buf, unsigned int *len, unsigned int hdr,
+        const char** frame)
+{
+    unsigned int size = m->len - hdr;
+    unsigned int have = m->bytes_read - 4 - hdr;
+    unsigned int n = min(*len, size - have);
+
+    /* frame is already contiguous so we don't need to copy it */
+    if (0 == have && size <= *len)
+    {
+        *frame = *buf;
+        m->bytes_read += size;
+        *buf += size;
+        *len -= size;
+        return 1;
+    }
+
+    if (!__rbuf_reserve(me, size))
+    {
+        printf("ERROR: msg too big to frame: %u\n", size);
+        return -1;
+    }
+
+    memcpy(me->rbuf + have, *buf, n);
+    m->bytes_read += n;
+    *buf += n;
+    *len -= n;
+
+    if (have + n < size)
+        return 0;
+
+    *frame = me->rbuf;
+    return 1;
+}
+
 int __pwp_piece_data(pwp_msghandler_private_t *me, msg_t* m, void* udata,
         const char** buf, unsigned int* len)
 {
@@ -115,85 +165,244 @@ int __pwp_piece_data(pwp_msghandler_private_t *me, msg_t* m, void* udata,
     return 1;
 }
 
-int __pwp_piece_offset(pwp_msghandler_private_t *me, msg_t* m, void* udata,
-        const char** buf, unsigned int *len)
+int __pwp_piece_block(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+        const char** buf, unsigned int* len)
 {
-    if (1 == mh_uint32(&m->pce.blk.offset, m, buf, len))
-        me->process_item = __pwp_piece_data;
-    return 1;
+    const char* data;
+    int ret;
+
+    switch (__read_frame(me, m, buf, len, 9, &data))
+    {
+    case 0: return 1;
+    case -1: mh_endmsg(me); return 0;
+    }
+
+    m->pce.data = data;
+    m->pce.blk.len = m->len - 9;
+    ret = pwp_conn_piece(me->pc, &m->pce);
+    mh_endmsg(me);
+    return ret;
 }
 
-int __pwp_piece_pieceidx(pwp_msghandler_private_t *me, msg_t* m, void* udata,
-        const char** buf, unsigned int *len)
+/**
+ * @return number of payload bytes still to be written into the destination */
+static unsigned int __direct_left(pwp_msghandler_private_t *me, msg_t* m)
 {
-    if (1 == mh_uint32(&m->pce.blk.piece_idx, m, buf, len))
-        me->process_item = __pwp_piece_offset;
-    return 1;
+    return m->len - 9 - (m->bytes_read - 4 - 9);
+}
+
+/**
+ * Hand over the block once the destination buffer is full */
+static int __direct_done(pwp_msghandler_private_t *me, msg_t* m)
+{
+    int ret;
+
+    m->pce.data = me->dest;
+    m->pce.blk.len = m->len - 9;
+    me->dest = NULL;
+    ret = pwp_conn_piece(me->pc, &m->pce);
+    mh_endmsg(me);
+    return ret;
 }
 
-int __pwp_request_len(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+int __pwp_piece_direct(pwp_msghandler_private_t *me, msg_t* m, void* udata,
         const char** buf, unsigned int* len)
 {
-    if (1 == mh_uint32(&m->blk.len, m, buf, len))
+    unsigned int n = min(*len, __direct_left(me, m));
+
+    /* the part of the payload that came in with the header */
+    memcpy(me->dest + m->bytes_read - 4 - 9, *buf, n);
+    m->bytes_read += n;
+    *buf += n;
+    *len -= n;
+
+    if (0 == __direct_left(me, m))
+        return __direct_done(me, m);
+    return 1;
+}
+
+/**
+ * Choose how the piece's payload will be read */
+static int __piece_header(pwp_msghandler_private_t *me, msg_t* m)
+{
+    if (me->piece_dest)
     {
-        pwp_conn_request(me->pc, &m->blk);
-        mh_endmsg(me);
+        bt_block_t blk = m->pce.blk;
+
+        blk.len = m->len - 9;
+        me->dest = me->piece_dest(me->piece_dest_udata, me->pc, &blk);
+        if (me->dest)
+        {
+            me->process_item = __pwp_piece_direct;
+            return 1;
+        }
     }
+
+    me->process_item = me->coalesce_pieces ?
+        __pwp_piece_block : __pwp_piece_data;
     return 1;
 }
 
-int __pwp_request_offset(pwp_msghandler_private_t *me, msg_t* m, void* udata,
-        const char** buf, unsigned int *len)
+static int __request(pwp_msghandler_private_t *me, msg_t* m)
 {
-    if (1 == mh_uint32(&m->blk.offset, m, buf, len))
-        me->process_item = __pwp_request_len;
+    pwp_conn_request(me->pc, &m->blk);
+    mh_endmsg(me);
     return 1;
 }
 
-int __pwp_request_pieceidx(pwp_msghandler_private_t *me, msg_t* m, void* udata,
-        const char** buf, unsigned int *len)
+static int __cancel(pwp_msghandler_private_t *me, msg_t* m)
 {
-    if (1 == mh_uint32(&m->blk.piece_idx, m, buf, len))
-        me->process_item = __pwp_request_offset;
+    pwp_conn_cancel(me->pc, &m->blk);
+    mh_endmsg(me);
     return 1;
 }
 
-int __pwp_cancel_len(pwp_msghandler_private_t *me, msg_t* m, void* udata,
-        const char** buf, unsigned int* len)
+static int __reject(pwp_msghandler_private_t *me, msg_t* m)
+{
+    pwp_conn_reject(me->pc, &m->blk);
+    mh_endmsg(me);
+    return 1;
+}
+
+static int __have(pwp_msghandler_private_t *me, msg_t* m)
 {
-    if (1 == mh_uint32(&m->blk.len, m, buf, len))
+    pwp_conn_have(me->pc, &m->hve);
+    mh_endmsg(me);
+    return 1;
+}
+
+static int __suggest(pwp_msghandler_private_t *me, msg_t* m)
+{
+    pwp_conn_suggest(me->pc, &m->hve);
+    mh_endmsg(me);
+    return 1;
+}
+
+static int __allowed_fast(pwp_msghandler_private_t *me, msg_t* m)
+{
+    pwp_conn_allowed_fast(me->pc, &m->hve);
+    mh_endmsg(me);
+    return 1;
+}
+
+typedef struct {
+    /* number of uint32 fields after the msg type */
+    unsigned int nfields;
+
+    /* called once all fields have been read into msg_t.fields */
+    int (*done)(pwp_msghandler_private_t *me, msg_t* m);
+} msg_desc_t;
+
+/* layouts of messages that start with uint32 fields */
+static const msg_desc_t __descs[PWP_MSGTYPE_ALLOWED_FAST + 1] = {
+    [PWP_MSGTYPE_HAVE] = { 1, __have },
+    [PWP_MSGTYPE_REQUEST] = { 3, __request },
+    [PWP_MSGTYPE_PIECE] = { 2, __piece_header },
+    [PWP_MSGTYPE_CANCEL] = { 3, __cancel },
+    [PWP_MSGTYPE_SUGGEST] = { 1, __suggest },
+    [PWP_MSGTYPE_REJECT] = { 3, __reject },
+    [PWP_MSGTYPE_ALLOWED_FAST] = { 1, __allowed_fast },
+};
+
+/**
+ * Read the uint32 fields described by the message's descriptor */
+int __pwp_fields(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+        const char** buf, unsigned int *len)
+{
+    const msg_desc_t* d = &__descs[m->id];
+    unsigned int i = (m->bytes_read - 5) / 4;
+
+    /* all remaining fields are here; no need to track partial fields */
+    if (0 == m->tok_bytes_read && (d->nfields - i) * 4 <= *len)
     {
-        pwp_conn_cancel(me->pc, &m->blk);
-        mh_endmsg(me);
+        unsigned int n = (d->nfields - i) * 4;
+
+        for (; i < d->nfields; i++, *buf += 4)
+        {
+            m->fields[i] = pwp_wire_get_u32(*buf);
+        }
+        m->bytes_read += n;
+        *len -= n;
     }
-    return 1;
+    else
+    {
+        for (; i < d->nfields; i++)
+            if (0 == mh_uint32(&m->fields[i], m, buf, len))
+                return 1;
+    }
+
+    return d->done(me, m);
 }
 
-int __pwp_cancel_offset(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+int __pwp_framed(pwp_msghandler_private_t *me, msg_t* m, void* udata,
         const char** buf, unsigned int *len)
 {
-    if (1 == mh_uint32(&m->blk.offset, m, buf, len))
-        me->process_item = __pwp_cancel_len;
-    return 1;
+    const char* frame;
+    int ret;
+
+    switch (__read_frame(me, m, buf, len, 1, &frame))
+    {
+    case 0: return 1;
+    case -1: mh_endmsg(me); return 0;
+    }
+
+    ret = me->handlers[m->id].framed(udata, me->pc, frame, m->len - 1);
+    mh_endmsg(me);
+    return ret;
 }
 
-int __pwp_cancel_pieceidx(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+int __pwp_streamed(pwp_msghandler_private_t *me, msg_t* m, void* udata,
         const char** buf, unsigned int *len)
 {
-    if (1 == mh_uint32(&m->blk.piece_idx, m, buf, len))
-        me->process_item = __pwp_cancel_offset;
-    return 1;
+    unsigned int size = m->len - 1;
+    unsigned int have = m->bytes_read - 4 - 1;
+    unsigned int n = min(*len, size - have);
+    int ret;
+
+    ret = me->handlers[m->id].streamed(udata, me->pc, have, *buf, n, size);
+    m->bytes_read += n;
+    *buf += n;
+    *len -= n;
+
+    if (0 == ret || have + n == size)
+        mh_endmsg(me);
+    return ret;
+}
+
+int __pwp_extended_payload(pwp_msghandler_private_t *me, msg_t* m,
+        void* udata, const char** buf, unsigned int *len)
+{
+    int ret;
+
+    /* payload excludes the msg type and extended msg id */
+    switch (__read_frame(me, m, buf, len, 2, &m->ext.data))
+    {
+    case 0: return 1;
+    case -1: mh_endmsg(me); return 0;
+    }
+
+    m->ext.len = m->len - 2;
+    ret = pwp_conn_extended(me->pc, &m->ext);
+    mh_endmsg(me);
+    return ret;
 }
 
-int __pwp_have(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+int __pwp_extended(pwp_msghandler_private_t *me, msg_t* m, void* udata,
         const char** buf, unsigned int *len)
 {
-    if (1 == mh_uint32(&m->hve.piece_idx, m, buf, len))
+    mh_byte((char*)&m->ext.id, &m->bytes_read, buf, len);
+
+    /* no payload */
+    if (2 == m->len)
     {
-        pwp_conn_have(me->pc, &m->hve);
+        m->ext.data = NULL;
+        m->ext.len = 0;
+        int ret = pwp_conn_extended(me->pc, &m->ext);
         mh_endmsg(me);
+        return ret;
     }
 
+    me->process_item = __pwp_extended_payload;
     return 1;
 }
 
@@ -239,6 +448,59 @@ int __pwp_bitfield_start(pwp_msghandler_private_t *me,
     return 1;
 }
 
+/**
+ * @return largest bitfield payload we will accept */
+static unsigned int __max_bitfield_len(pwp_msghandler_private_t *me)
+{
+    /* the connection may learn the number of pieces after we're created */
+    int num_pieces = pwp_conn_get_num_pieces(me->pc);
+
+    if (num_pieces <= 0)
+        return me->max_msg_len;
+    return (num_pieces + 7) / 8;
+}
+
+/**
+ * @return largest payload any message type is allowed to have */
+static unsigned int __max_payload_len(pwp_msghandler_private_t *me)
+{
+    /* the extended message id and piece header count as payload */
+    unsigned int l = max(__max_bitfield_len(me), me->max_msg_len + 1);
+    return max(l, me->max_block_len + 8);
+}
+
+/**
+ * @return 1 if the message's length is valid for its type */
+static int __len_is_valid(pwp_msghandler_private_t *me, msg_t* m)
+{
+    switch (m->id)
+    {
+    case PWP_MSGTYPE_CHOKE:
+    case PWP_MSGTYPE_UNCHOKE:
+    case PWP_MSGTYPE_INTERESTED:
+    case PWP_MSGTYPE_UNINTERESTED:
+    case PWP_MSGTYPE_HAVE_ALL:
+    case PWP_MSGTYPE_HAVE_NONE:
+        return 1 == m->len;
+    case PWP_MSGTYPE_HAVE:
+    case PWP_MSGTYPE_SUGGEST:
+    case PWP_MSGTYPE_ALLOWED_FAST:
+        return 5 == m->len;
+    case PWP_MSGTYPE_REQUEST:
+    case PWP_MSGTYPE_CANCEL:
+    case PWP_MSGTYPE_REJECT:
+        return 13 == m->len;
+    case PWP_MSGTYPE_BITFIELD:
+        return 1 < m->len && m->len - 1 <= __max_bitfield_len(me);
+    case PWP_MSGTYPE_PIECE:
+        return 9 < m->len && m->len - 9 <= me->max_block_len;
+    case PWP_MSGTYPE_EXTENDED:
+        return 2 <= m->len && m->len - 2 <= me->max_msg_len;
+    default:
+        return m->len - 1 <= me->max_msg_len;
+    }
+}
+
 int __pwp_type(pwp_msghandler_private_t *me,
         msg_t* m,
         void* udata __attribute__((unused)),
@@ -247,7 +509,15 @@ int __pwp_type(pwp_msghandler_private_t *me,
 {
     assert(4 == m->bytes_read);
 
-    mh_byte(&m->id, &m->bytes_read, buf, len);
+    mh_byte((char*)&m->id, &m->bytes_read, buf, len);
+
+    /* don't allocate or wait for anything bigger than the type allows */
+    if (!__len_is_valid(me, m))
+    {
+        printf("ERROR: bad length %u for pwp msg type '%d'\n", m->len, m->id);
+        mh_endmsg(me);
+        return 0;
+    }
 
     /* payloadless messages */
     if (m->len == 1)
@@ -266,22 +536,44 @@ int __pwp_type(pwp_msghandler_private_t *me,
         case PWP_MSGTYPE_UNINTERESTED:
             pwp_conn_uninterested(me->pc);
             break;
-        default: assert(0); break;
+        case PWP_MSGTYPE_HAVE_ALL:
+            pwp_conn_have_all(me->pc);
+            break;
+        case PWP_MSGTYPE_HAVE_NONE:
+            pwp_conn_have_none(me->pc);
+            break;
+        default:
+            /* custom handlers can receive empty messages */
+            if (m->id < me->nhandlers && me->handlers[m->id].framed)
+            {
+                int ret = me->handlers[m->id].framed(
+                        me->handlers[m->id].udata, me->pc, NULL, 0);
+                mh_endmsg(me);
+                return ret;
+            }
+            else if (m->id < me->nhandlers && me->handlers[m->id].streamed)
+            {
+                int ret = me->handlers[m->id].streamed(
+                        me->handlers[m->id].udata, me->pc, 0, *buf, 0, 0);
+                mh_endmsg(me);
+                return ret;
+            }
+
+            printf("ERROR: pwp msg type '%d' needs a payload\n", m->id);
+            mh_endmsg(me);
+            return 0;
         }
         mh_endmsg(me);
     }
     else
     {
-        if (me->nhandlers < m->id) 
+        if (me->nhandlers <= m->id || !me->handlers[m->id].func)
         {
             printf("ERROR: bad pwp msg type: '%d'\n", m->id);
             mh_endmsg(me);
             return 0;
         }
         /* the next handler can be selected according to the message type */
-        assert(0 < m->id);
-        assert(m->id < me->nhandlers);
-        assert(me->handlers[(int)m->id].func);
         me->process_item = me->handlers[(int)m->id].func;
         me->udata = me->handlers[(int)m->id].udata;
     }
@@ -289,6 +581,39 @@ int __pwp_type(pwp_msghandler_private_t *me,
     return 1;
 }
 
+/**
+ * Apply a run of complete HAVE messages at the start of buf as one batch
+ * @return 1 if a run was consumed */
+static int __have_run(pwp_msghandler_private_t *me,
+        const char** buf,
+        unsigned int *len)
+{
+    static const char hdr[] = { 0, 0, 0, 5, PWP_MSGTYPE_HAVE };
+    uint32_t pieces[PWP_HAVE_BATCH];
+    unsigned int n = 0, limit = PWP_HAVE_BATCH;
+    const char* p = *buf;
+
+    if (me->budgeted && me->max_workload_msgs)
+        limit = min(limit, me->max_workload_msgs - me->nmsgs_dispatched);
+
+    while (n < limit && 9 <= *len - (p - *buf) && 0 == memcmp(p, hdr, 5))
+    {
+        pieces[n] = pwp_wire_get_u32(p + 5);
+        n++;
+        p += 9;
+    }
+
+    /* a lone HAVE goes through the usual path */
+    if (n < 2)
+        return 0;
+
+    pwp_conn_have_batch(me->pc, pieces, n);
+    me->nmsgs_dispatched += n;
+    *len -= p - *buf;
+    *buf = p;
+    return 1;
+}
+
 int __pwp_length(pwp_msghandler_private_t *me,
         msg_t* m,
         void* udata __attribute__((unused)),
@@ -297,6 +622,9 @@ int __pwp_length(pwp_msghandler_private_t *me,
 {
     assert(m->bytes_read < 4);
 
+    if (0 == m->bytes_read && __have_run(me, buf, len))
+        return 1;
+
     if (1 == mh_uint32(&m->len, m, buf, len))
     {
         if (0 == m->len)
@@ -304,6 +632,12 @@ int __pwp_length(pwp_msghandler_private_t *me,
             pwp_conn_keepalive(me->pc);
             mh_endmsg(me);
         }
+        else if (__max_payload_len(me) < m->len - 1)
+        {
+            printf("ERROR: pwp msg too long: %u\n", m->len);
+            mh_endmsg(me);
+            return 0;
+        }
         else
         {
             me->process_item = __pwp_type;
@@ -313,68 +647,275 @@ int __pwp_length(pwp_msghandler_private_t *me,
     return 1;
 }
 
-int pwp_msghandler_dispatch_from_buffer(void *mh,
+/**
+ * @return 1 if we have dispatched as many messages as we are allowed */
+static int __msgs_spent(pwp_msghandler_private_t* me)
+{
+    return me->budgeted && me->max_workload_msgs &&
+        me->max_workload_msgs <= me->nmsgs_dispatched;
+}
+
+/**
+ * Read from buf without resetting the workload counters */
+static int __dispatch_more(pwp_msghandler_private_t* me,
         const char* buf,
-        unsigned int len)
+        unsigned int len,
+        unsigned int* consumed)
 {
-    pwp_msghandler_private_t* me = mh;
     msg_t* m = &me->msg;
+    unsigned int left = len;
 
     /* while we have a stream left to read... */
-    while (0 < len)
+    while (0 < left && !__msgs_spent(me))
     {
         assert(me->process_item);
-        switch(me->process_item(me,m,me->udata,&buf,&len))
+        if (0 == me->process_item(me,m,me->udata,&buf,&left))
+        {
+            *consumed = len - left;
+            return 0;
+        }
+    }
+
+    *consumed = len - left;
+    return 1;
+}
+
+/**
+ * @param budget Stop once the workload budget is spent
+ * @param consumed Set to the number of bytes read */
+static int __dispatch(pwp_msghandler_private_t* me,
+        const char* buf,
+        unsigned int len,
+        const int budget,
+        unsigned int* consumed)
+{
+    if (budget && me->max_workload_bytes)
+        len = min(len, me->max_workload_bytes);
+
+    me->nmsgs_dispatched = 0;
+    me->budgeted = budget;
+    return __dispatch_more(me, buf, len, consumed);
+}
+
+int pwp_msghandler_dispatch_from_buffer(void *mh,
+        const char* buf,
+        unsigned int len)
+{
+    unsigned int consumed;
+
+    return __dispatch(mh, buf, len, 0, &consumed);
+}
+
+int pwp_msghandler_dispatch_from_iovec(void *mh,
+        const struct iovec* iov,
+        int iovcnt,
+        unsigned int* consumed)
+{
+    pwp_msghandler_private_t* me = mh;
+    unsigned int len, n;
+    int i;
+
+    /* the budget covers all segments, not each one */
+    me->nmsgs_dispatched = 0;
+    me->budgeted = 1;
+    *consumed = 0;
+
+    /* the parser resumes across calls, so segments are read in place */
+    for (i=0; i<iovcnt; i++)
+    {
+        len = iov[i].iov_len;
+        if (me->max_workload_bytes)
+            len = min(len, me->max_workload_bytes - *consumed);
+
+        if (0 == __dispatch_more(me, iov[i].iov_base, len, &n))
         {
-            case 0:
-                return 0;
-            default:
-                break;
+            *consumed += n;
+            return 0;
         }
+        *consumed += n;
+
+        /* we ran out of budget */
+        if (n < iov[i].iov_len)
+            break;
     }
 
     return 1;
 }
 
+int pwp_msghandler_dispatch_budgeted(void *mh,
+        const char* buf,
+        unsigned int len,
+        unsigned int* consumed)
+{
+    return __dispatch(mh, buf, len, 1, consumed);
+}
+
+void pwp_msghandler_set_max_workload_msgs(void *mh, unsigned int max_msgs)
+{
+    pwp_msghandler_private_t* me = mh;
+    me->max_workload_msgs = max_msgs;
+}
+
+void pwp_msghandler_set_max_block_len(void *mh, unsigned int max_block_len)
+{
+    pwp_msghandler_private_t* me = mh;
+    me->max_block_len = max_block_len;
+}
+
+void pwp_msghandler_set_max_msg_len(void *mh, unsigned int max_msg_len)
+{
+    pwp_msghandler_private_t* me = mh;
+    me->max_msg_len = max_msg_len;
+}
+
+void pwp_msghandler_set_coalesce_pieces(void *mh, int on)
+{
+    pwp_msghandler_private_t* me = mh;
+    me->coalesce_pieces = on;
+}
+
+void pwp_msghandler_set_piece_dest(void *mh,
+        func_msghandler_piece_dest_f cb,
+        void* udata)
+{
+    pwp_msghandler_private_t* me = mh;
+    me->piece_dest = cb;
+    me->piece_dest_udata = udata;
+}
+
+unsigned int pwp_msghandler_get_piece_dest(void *mh, char** dest)
+{
+    pwp_msghandler_private_t* me = mh;
+    msg_t* m = &me->msg;
+
+    if (me->process_item != __pwp_piece_direct)
+        return 0;
+
+    *dest = me->dest + m->bytes_read - 4 - 9;
+    return __direct_left(me, m);
+}
+
+int pwp_msghandler_piece_dest_written(void *mh, unsigned int len)
+{
+    pwp_msghandler_private_t* me = mh;
+    msg_t* m = &me->msg;
+
+    assert(me->process_item == __pwp_piece_direct);
+    assert(len <= __direct_left(me, m));
+
+    m->bytes_read += len;
+    if (0 == __direct_left(me, m))
+        return __direct_done(me, m);
+    return 1;
+}
+
 void mh_endmsg(pwp_msghandler_private_t* me)
 {
+    me->nmsgs_dispatched++;
     me->process_item = __pwp_length;
     me->udata = NULL;
     memset(&me->msg,0,sizeof(msg_t));
 }
 
-void* pwp_msghandler_new2(
+/* handlers shared by every message handler without custom handlers */
+static msghandler_item_t __std_handlers[PWP_MSGTYPE_EXTENDED + 1] = {
+    [PWP_MSGTYPE_HAVE] = { __pwp_fields, NULL },
+    [PWP_MSGTYPE_BITFIELD] = { __pwp_bitfield_start, NULL },
+    [PWP_MSGTYPE_REQUEST] = { __pwp_fields, NULL },
+    [PWP_MSGTYPE_PIECE] = { __pwp_fields, NULL },
+    [PWP_MSGTYPE_CANCEL] = { __pwp_fields, NULL },
+    [PWP_MSGTYPE_SUGGEST] = { __pwp_fields, NULL },
+    [PWP_MSGTYPE_REJECT] = { __pwp_fields, NULL },
+    [PWP_MSGTYPE_ALLOWED_FAST] = { __pwp_fields, NULL },
+    [PWP_MSGTYPE_EXTENDED] = { __pwp_extended, NULL },
+};
+
+#define NSTD_HANDLERS (int)(sizeof(__std_handlers) / sizeof(__std_handlers[0]))
+
+/**
+ * Ids after PWP_MSGTYPE_CANCEL which are claimed by the fast extension and
+ * extension protocol. Custom handlers are not given these ids */
+static int __id_is_reserved(const int id)
+{
+    return (PWP_MSGTYPE_SUGGEST <= id && id <= PWP_MSGTYPE_ALLOWED_FAST) ||
+        id == PWP_MSGTYPE_EXTENDED;
+}
+
+void mh_init(pwp_msghandler_private_t* me,
         void *pc,
         pwp_msghandler_item_t* handlers,
         int nhandlers,
         unsigned int max_workload_bytes)
 {
-    pwp_msghandler_private_t* me;
-
-    me = calloc(1,sizeof(pwp_msghandler_private_t));
+    memset(me, 0, sizeof(pwp_msghandler_private_t));
     me->pc = pc;
     me->process_item = __pwp_length;
+    me->max_workload_bytes = max_workload_bytes;
+    me->max_block_len = PWP_DEFAULT_MAX_BLOCK_LEN;
+    me->max_msg_len = PWP_DEFAULT_MAX_MSG_LEN;
 
-    int size = PWP_MSGTYPE_CANCEL + 1;
-    if (handlers)
-        size += nhandlers;
+    /* without custom handlers we don't need our own table */
+    if (!handlers || 0 == nhandlers)
+    {
+        me->nhandlers = NSTD_HANDLERS;
+        me->handlers = __std_handlers;
+        return;
+    }
+
+    /* custom handlers take the free ids after PWP_MSGTYPE_CANCEL */
+    int i, s, size = PWP_MSGTYPE_CANCEL + 1 + nhandlers;
+    for (i=PWP_MSGTYPE_CANCEL + 1; i<size; i++)
+        if (__id_is_reserved(i))
+            size++;
+
+    size = max(size, NSTD_HANDLERS);
     me->nhandlers = size;
-    me->handlers = calloc(1, sizeof(pwp_msghandler_item_t) * size);
+    me->handlers = calloc(1, sizeof(msghandler_item_t) * size);
 
     /* add standard bittorrent handlers */
-    me->handlers[PWP_MSGTYPE_HAVE].func = __pwp_have;
-    me->handlers[PWP_MSGTYPE_BITFIELD].func = __pwp_bitfield_start;
-    me->handlers[PWP_MSGTYPE_REQUEST].func = __pwp_request_pieceidx;
-    me->handlers[PWP_MSGTYPE_PIECE].func = __pwp_piece_pieceidx;
-    me->handlers[PWP_MSGTYPE_CANCEL].func = __pwp_cancel_pieceidx;
+    memcpy(me->handlers, __std_handlers, sizeof(__std_handlers));
 
     /* add custom user provided handlers */
-    int i, s;
-    for (i=PWP_MSGTYPE_CANCEL + 1, s=0; handlers && i<size; i++, s++)
+    for (i=PWP_MSGTYPE_CANCEL + 1, s=0; s<nhandlers; i++)
     {
-        me->handlers[i].func = (void*)handlers[s].func;
+        if (__id_is_reserved(i))
+            continue;
         me->handlers[i].udata = handlers[s].udata;
+
+        /* framed and streamed handlers are fed by our own readers */
+        if (handlers[s].framed)
+        {
+            me->handlers[i].func = __pwp_framed;
+            me->handlers[i].framed = handlers[s].framed;
+        }
+        else if (handlers[s].streamed)
+        {
+            me->handlers[i].func = __pwp_streamed;
+            me->handlers[i].streamed = handlers[s].streamed;
+        }
+        else
+            me->handlers[i].func = (void*)handlers[s].func;
+        s++;
     }
+}
+
+void mh_deinit(pwp_msghandler_private_t* me)
+{
+    free(me->rbuf);
+    if (me->handlers != __std_handlers)
+        free(me->handlers);
+}
+
+void* pwp_msghandler_new2(
+        void *pc,
+        pwp_msghandler_item_t* handlers,
+        int nhandlers,
+        unsigned int max_workload_bytes)
+{
+    pwp_msghandler_private_t* me;
+
+    me = malloc(sizeof(pwp_msghandler_private_t));
+    mh_init(me, pc, handlers, nhandlers, max_workload_bytes);
     return me;
 }
 
@@ -383,8 +924,8 @@ void* pwp_msghandler_new(void *pc)
     return pwp_msghandler_new2(pc,NULL,0,0);
 }
 
-void pwp_msghandler_release(void *pc)
+void pwp_msghandler_release(void *mh)
 {
-    free(pc);
+    mh_deinit(mh);
+    free(mh);
 }
-
@@ -1,7 +1,43 @@
 #ifndef PWP_MSGHANDLER_H
 #define PWP_MSGHANDLER_H
 
+/**
+ * Receive a whole message
+ * @param payload The message after the msg type; contiguous
+ * @return 1 on success; 0 if the peer needs to be disconnected */
+typedef int (*func_msghandler_framed_f)(
+        void* udata,
+        void* pc,
+        const char* payload,
+        unsigned int len);
+
+/**
+ * Receive part of a message.
+ * An empty payload is received as a single call where len and total are 0
+ * @param offset Where data starts within the payload
+ * @param total Length of the whole payload
+ * @return 1 on success; 0 if the peer needs to be disconnected */
+typedef int (*func_msghandler_streamed_f)(
+        void* udata,
+        void* pc,
+        unsigned int offset,
+        const char* data,
+        unsigned int len,
+        unsigned int total);
+
+/**
+ * Ask for a buffer to write a piece's payload into, eg. an mmapped piece.
+ * pwp_conn_piece receives the block once the buffer has been filled.
+ * @param blk The block; len is the length of the whole payload
+ * @return buffer of at least blk->len bytes; NULL to receive the payload
+ *  the usual way */
+typedef void* (*func_msghandler_piece_dest_f)(
+        void* udata,
+        void* pc,
+        const bt_block_t* blk);
+
 typedef struct {
+    /* parse the raw stream; resumable across reads */
     int (*func)(
         void* mh,
         void *message,
@@ -9,9 +45,20 @@ typedef struct {
         const char** buf,
         unsigned int *len);
     void* udata;
+
+    /* if set, called once per message instead of func */
+    func_msghandler_framed_f framed;
+
+    /* if set, called as the payload arrives instead of func */
+    func_msghandler_streamed_f streamed;
 } pwp_msghandler_item_t; 
 
 /**
+ * Custom handlers are assigned message ids in order, starting after
+ * PWP_MSGTYPE_CANCEL and skipping ids used by the fast extension (13-17)
+ * and the extension protocol (20)
+ * @param max_workload_bytes Stop pwp_msghandler_dispatch_budgeted after this
+ *  many bytes; 0 is unlimited
  * @return new msg handler */
 void* pwp_msghandler_new2(
         void *pc,
@@ -23,6 +70,47 @@ void* pwp_msghandler_new2(
  * @return new msg handler */
 void* pwp_msghandler_new(void *pc);
 
+/**
+ * Stop pwp_msghandler_dispatch_budgeted after this many messages
+ * @param max_msgs Maximum number of messages; 0 is unlimited */
+void pwp_msghandler_set_max_workload_msgs(void *mh, unsigned int max_msgs);
+
+/**
+ * Disconnect peers who send piece messages with more data than this */
+void pwp_msghandler_set_max_block_len(void *mh, unsigned int max_block_len);
+
+/**
+ * Disconnect peers who send extended or custom messages, or bitfields when
+ * the number of pieces isn't known, which are longer than this */
+void pwp_msghandler_set_max_msg_len(void *mh, unsigned int max_msg_len);
+
+/**
+ * Call pwp_conn_piece once per piece message with the whole block, instead
+ * of once for every read that carries part of it. Blocks that arrive within
+ * one read are passed through without being copied.
+ * @param on 1 to coalesce; 0 to pass on fragments as they arrive */
+void pwp_msghandler_set_coalesce_pieces(void *mh, int on);
+
+/**
+ * Write piece payloads directly into buffers provided by cb.
+ * After each dispatch, pwp_msghandler_get_piece_dest says how much of the
+ * current payload can be read from the socket straight into its buffer */
+void pwp_msghandler_set_piece_dest(void *mh,
+        func_msghandler_piece_dest_f cb,
+        void* udata);
+
+/**
+ * @param dest Set to where the next payload bytes should be written
+ * @return number of bytes to read into dest; 0 if we aren't reading a
+ *  payload into a destination buffer */
+unsigned int pwp_msghandler_get_piece_dest(void *mh, char** dest);
+
+/**
+ * Tell us that len bytes were written to the buffer from
+ * pwp_msghandler_get_piece_dest
+ * @return 1 if successful, 0 if the peer needs to be disconnected */
+int pwp_msghandler_piece_dest_written(void *mh, unsigned int len);
+
 /**
  * Release memory used by message handler */
 void pwp_msghandler_release(void *mh);
@@ -38,4 +126,31 @@ int pwp_msghandler_dispatch_from_buffer(void *mh,
         const char* buf,
         unsigned int len);
 
+struct iovec;
+
+/**
+ * Receive data that is spread over several buffers, eg. a ring buffer that
+ * wraps. Messages may span buffers. Only messages that need to be delivered
+ * whole and span buffers are copied.
+ * Stops at the same budget as pwp_msghandler_dispatch_budgeted
+ * @param iov Buffers to read, in order
+ * @param iovcnt Number of buffers
+ * @param consumed Set to the number of bytes read across all buffers
+ * @return 1 if successful, 0 if the peer needs to be disconnected */
+int pwp_msghandler_dispatch_from_iovec(void *mh,
+        const struct iovec* iov,
+        int iovcnt,
+        unsigned int* consumed);
+
+/**
+ * Receive up to max_workload_bytes or max_workload_msgs; whichever is hit
+ * first. Lets an event loop share its time fairly between peers.
+ * The remaining data should be dispatched later
+ * @param consumed Set to the number of bytes read from buf
+ * @return 1 if successful, 0 if the peer needs to be disconnected */
+int pwp_msghandler_dispatch_budgeted(void *mh,
+        const char* buf,
+        unsigned int len,
+        unsigned int* consumed);
+
 #endif /* PWP_MSGHANDLER_H */
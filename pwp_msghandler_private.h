@@ -3,10 +3,22 @@
 
 #undef min
 #define min(a,b) ((a) < (b) ? (a) : (b))
+/* largest message we will reassemble into one frame */
+#define PWP_MAX_FRAME_LEN (1 << 20)
+
+/* default limits on what a peer may send us */
+#define PWP_DEFAULT_MAX_BLOCK_LEN (1 << 17)
+#define PWP_DEFAULT_MAX_MSG_LEN PWP_MAX_FRAME_LEN
+
+/* most HAVE messages applied in one batch */
+#define PWP_HAVE_BATCH 64
+
+#undef max
+#define max(a,b) ((a) < (b) ? (b) : (a))
 
 typedef struct {
     uint32_t len;
-    char id;
+    unsigned char id;
     unsigned int bytes_read;
     unsigned int tok_bytes_read;
     union {
@@ -14,6 +26,10 @@ typedef struct {
         msg_bitfield_t bf;
         bt_block_t blk;
         msg_piece_t pce;
+        msg_extended_t ext;
+
+        /* uint32 fields after the msg type; aliases the structs above */
+        uint32_t fields[3];
     };
 } msg_t;
 
@@ -39,6 +55,37 @@ struct pwp_msghandler_private_s {
     int nhandlers;
 
     msghandler_item_t* handlers;
+
+    /* stop dispatching after this many bytes/messages; 0 is unlimited */
+    unsigned int max_workload_bytes;
+    unsigned int max_workload_msgs;
+
+    /* largest piece message payload we accept */
+    unsigned int max_block_len;
+
+    /* largest bitfield (when the number of pieces is unknown), extended or
+     * custom message */
+    unsigned int max_msg_len;
+
+    /* deliver each piece message as one block rather than per read */
+    int coalesce_pieces;
+
+    /* asked where piece payloads should be written */
+    func_msghandler_piece_dest_f piece_dest;
+    void* piece_dest_udata;
+
+    /* destination of the piece payload we are reading */
+    char* dest;
+
+    /* if this dispatch is limited by the workload budget */
+    int budgeted;
+
+    /* messages completed during this dispatch */
+    unsigned int nmsgs_dispatched;
+
+    /* reassembles payloads that arrive over several reads */
+    char* rbuf;
+    unsigned int rbuf_size;
 };
 
 struct msghandler_item_s {
@@ -49,8 +96,22 @@ struct msghandler_item_s {
         const char** buf,
         unsigned int *len);
     void* udata;
+    func_msghandler_framed_f framed;
+    func_msghandler_streamed_f streamed;
 }; 
 
+/**
+ * Initialise a message handler that lives within memory we don't own */
+void mh_init(pwp_msghandler_private_t* me,
+        void *pc,
+        pwp_msghandler_item_t* handlers,
+        int nhandlers,
+        unsigned int max_workload_bytes);
+
+/**
+ * Release memory used by message handler, except for the handler itself */
+void mh_deinit(pwp_msghandler_private_t* me);
+
 void mh_endmsg(pwp_msghandler_private_t* me);
 
 int mh_uint32(
@@ -0,0 +1,248 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. 
+ *
+ * @file
+ * @brief Open addressing map of blocks to requests.
+ *        Robin Hood hashing keeps probe sequences short, and keys are stored
+ *        inline so a lookup rarely touches more than one or two cache lines
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include "bitfield.h"
+#include "pwp_connection.h"
+#include "pwp_reqmap.h"
+
+typedef struct {
+    bt_block_t key;
+    uint32_t hash;
+    /* NULL if the slot is empty */
+    void* val;
+} reqmap_entry_t;
+
+typedef struct {
+    reqmap_entry_t* entries;
+    /* always a power of two */
+    unsigned int size;
+    unsigned int count;
+} reqmap_t;
+
+static uint32_t __hash(const bt_block_t* b)
+{
+    uint64_t h;
+
+    h = ((uint64_t)b->piece_idx << 32 | b->offset) ^
+        ((uint64_t)b->len * 0x9E3779B97F4A7C15ULL);
+
+    /* 64-bit finaliser from MurmurHash3 */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+static int __key_eq(const bt_block_t* a, const bt_block_t* b)
+{
+    return a->piece_idx == b->piece_idx &&
+        a->offset == b->offset &&
+        a->len == b->len;
+}
+
+/**
+ * @return how far the entry in this slot is from where it hashed to */
+static unsigned int __dist(const reqmap_t* me, const reqmap_entry_t* e,
+        unsigned int slot)
+{
+    return (slot - e->hash) & (me->size - 1);
+}
+
+static void __init(reqmap_t* me, unsigned int size)
+{
+    me->size = 8;
+    while (me->size < size)
+        me->size <<= 1;
+    me->count = 0;
+    if (!(me->entries = calloc(me->size, sizeof(reqmap_entry_t))))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+}
+
+void* pwp_reqmap_new(unsigned int size)
+{
+    reqmap_t* me;
+
+    if (!(me = malloc(sizeof(reqmap_t))))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+
+    /* leave headroom so we don't need to grow straight away */
+    __init(me, size + size / 4);
+    return me;
+}
+
+void pwp_reqmap_free(void* rm)
+{
+    reqmap_t* me = rm;
+
+    free(me->entries);
+    free(me);
+}
+
+unsigned int pwp_reqmap_count(const void* rm)
+{
+    const reqmap_t* me = rm;
+    return me->count;
+}
+
+/**
+ * @return slot holding this key; -1 if it isn't in the map */
+static int __find(const reqmap_t* me, const bt_block_t* key)
+{
+    uint32_t hash = __hash(key);
+    unsigned int slot = hash & (me->size - 1), d;
+
+    for (d = 0; ; d++, slot = (slot + 1) & (me->size - 1))
+    {
+        const reqmap_entry_t* e = &me->entries[slot];
+
+        /* a Robin Hood table can stop once entries are closer to home
+         * than we would be */
+        if (!e->val || __dist(me, e, slot) < d)
+            return -1;
+
+        if (e->hash == hash && __key_eq(&e->key, key))
+            return slot;
+    }
+}
+
+/**
+ * Add an entry that isn't in the map */
+static void __insert(reqmap_t* me, reqmap_entry_t ins)
+{
+    unsigned int slot = ins.hash & (me->size - 1), d;
+
+    for (d = 0; ; d++, slot = (slot + 1) & (me->size - 1))
+    {
+        reqmap_entry_t* e = &me->entries[slot];
+
+        if (!e->val)
+        {
+            *e = ins;
+            me->count++;
+            return;
+        }
+
+        /* take from the rich; the displaced entry continues probing */
+        if (__dist(me, e, slot) < d)
+        {
+            reqmap_entry_t tmp = *e;
+
+            *e = ins;
+            ins = tmp;
+            d = __dist(me, &ins, slot);
+        }
+    }
+}
+
+static void __grow(reqmap_t* me)
+{
+    reqmap_entry_t* old = me->entries;
+    unsigned int i, size = me->size;
+
+    __init(me, size * 2);
+    for (i = 0; i < size; i++)
+        if (old[i].val)
+            __insert(me, old[i]);
+    free(old);
+}
+
+void* pwp_reqmap_put(void* rm, const bt_block_t* key, void* val)
+{
+    reqmap_t* me = rm;
+    reqmap_entry_t e;
+    int slot;
+
+    assert(val);
+
+    if (-1 != (slot = __find(me, key)))
+    {
+        void* old = me->entries[slot].val;
+        me->entries[slot].val = val;
+        return old;
+    }
+
+    /* keep the load factor under 7/8 */
+    if (me->size - me->size / 8 <= me->count + 1)
+        __grow(me);
+
+    e.key = *key;
+    e.hash = __hash(key);
+    e.val = val;
+    __insert(me, e);
+    return NULL;
+}
+
+void* pwp_reqmap_get(const void* rm, const bt_block_t* key)
+{
+    const reqmap_t* me = rm;
+    int slot;
+
+    if (-1 == (slot = __find(me, key)))
+        return NULL;
+    return me->entries[slot].val;
+}
+
+void* pwp_reqmap_remove(void* rm, const bt_block_t* key)
+{
+    reqmap_t* me = rm;
+    unsigned int next;
+    void* val;
+    int slot;
+
+    if (-1 == (slot = __find(me, key)))
+        return NULL;
+
+    val = me->entries[slot].val;
+
+    /* shift following entries back instead of leaving a tombstone */
+    for (next = (slot + 1) & (me->size - 1);
+         me->entries[next].val && 0 < __dist(me, &me->entries[next], next);
+         slot = next, next = (next + 1) & (me->size - 1))
+        me->entries[slot] = me->entries[next];
+
+    me->entries[slot].val = NULL;
+    me->count--;
+    return val;
+}
+
+void pwp_reqmap_iterator(const void* rm, pwp_reqmap_iterator_t* iter)
+{
+    iter->idx = 0;
+}
+
+void* pwp_reqmap_iterator_next_value(const void* rm,
+        pwp_reqmap_iterator_t* iter)
+{
+    const reqmap_t* me = rm;
+
+    for (; iter->idx < me->size; iter->idx++)
+        if (me->entries[iter->idx].val)
+            return me->entries[iter->idx++].val;
+    return NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef PWP_REQMAP_H
+#define PWP_REQMAP_H
+
+typedef struct {
+    unsigned int idx;
+} pwp_reqmap_iterator_t;
+
+/**
+ * Create a map of blocks to requests.
+ * Keys are copied into the map so they don't need to outlive an entry
+ * @param size Number of entries we expect to hold
+ * @return new map */
+void* pwp_reqmap_new(unsigned int size);
+
+/**
+ * Release memory used by map. Values are not freed */
+void pwp_reqmap_free(void* rm);
+
+/**
+ * @return number of entries */
+unsigned int pwp_reqmap_count(const void* rm);
+
+/**
+ * Add an entry, replacing the value of an existing entry
+ * @param val Value; must not be NULL
+ * @return the value that was replaced; NULL otherwise */
+void* pwp_reqmap_put(void* rm, const bt_block_t* key, void* val);
+
+/**
+ * @return value of the entry; NULL if there isn't one */
+void* pwp_reqmap_get(const void* rm, const bt_block_t* key);
+
+/**
+ * Remove an entry
+ * @return value of the removed entry; NULL if there wasn't one */
+void* pwp_reqmap_remove(void* rm, const bt_block_t* key);
+
+/**
+ * Iterate over entries. The map must not be changed while iterating */
+void pwp_reqmap_iterator(const void* rm, pwp_reqmap_iterator_t* iter);
+
+/**
+ * @return next value; NULL when there are no more */
+void* pwp_reqmap_iterator_next_value(const void* rm,
+        pwp_reqmap_iterator_t* iter);
+
+#endif /* PWP_REQMAP_H */
@@ -0,0 +1,139 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. 
+ *
+ * @file
+ * @brief Fuse the handshaker, message handler and connection of a socket
+ *        into one object that consumes a byte stream from connection start
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include "bitfield.h"
+#include "pwp_connection.h"
+#include "pwp_handshaker.h"
+#include "pwp_msghandler.h"
+#include "pwp_session.h"
+#include "chunkybar.h"
+#include "pwp_extensions.h"
+
+#include "pwp_connection_private.h"
+#include "pwp_handshaker_private.h"
+#include "pwp_msghandler_private.h"
+
+typedef struct {
+    pwp_handshaker_t hs;
+    pwp_msghandler_private_t mh;
+    pwp_conn_private_t pc;
+
+    func_session_handshake_f on_handshake;
+    void* udata;
+} pwp_session_t;
+
+static void* __new(char* expected_info_hash, void* registry, char* mypeerid)
+{
+    pwp_session_t* me;
+
+    if (!(me = calloc(1, sizeof(pwp_session_t))))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+
+    pwp_handshaker_init(&me->hs, expected_info_hash, registry, mypeerid);
+    pwp_conn_new(&me->pc);
+    mh_init(&me->mh, &me->pc, NULL, 0, 0);
+    return me;
+}
+
+void* pwp_session_new(char* expected_info_hash, char* mypeerid)
+{
+    return __new(expected_info_hash, NULL, mypeerid);
+}
+
+void* pwp_session_new_from_registry(void* registry, char* mypeerid)
+{
+    return __new(NULL, registry, mypeerid);
+}
+
+void pwp_session_release(void* s)
+{
+    pwp_session_t* me = s;
+
+    mh_deinit(&me->mh);
+    pwp_conn_release((pwp_conn_t*)&me->pc);
+    free(me);
+}
+
+void pwp_session_set_handshake_cb(void* s,
+        func_session_handshake_f cb,
+        void* udata)
+{
+    pwp_session_t* me = s;
+
+    me->on_handshake = cb;
+    me->udata = udata;
+}
+
+pwp_conn_t* pwp_session_get_conn(void* s)
+{
+    pwp_session_t* me = s;
+    return (pwp_conn_t*)&me->pc;
+}
+
+void* pwp_session_get_handshaker(void* s)
+{
+    pwp_session_t* me = s;
+    return &me->hs;
+}
+
+void* pwp_session_get_msghandler(void* s)
+{
+    pwp_session_t* me = s;
+    return &me->mh;
+}
+
+int pwp_session_dispatch_from_buffer(void* s,
+        const char* buf,
+        unsigned int len)
+{
+    pwp_session_t* me = s;
+    pwp_conn_t* pc = (pwp_conn_t*)&me->pc;
+
+    if (!pwp_conn_flag_is_set(pc, PC_HANDSHAKE_RECEIVED))
+    {
+        switch (pwp_handshaker_dispatch_from_buffer(&me->hs, &buf, &len))
+        {
+        case -1:
+            return 0;
+        case 0:
+            /* need more of the handshake */
+            return 1;
+        default:
+            break;
+        }
+
+        pwp_conn_set_state(pc, pwp_conn_get_state(pc) | PC_HANDSHAKE_RECEIVED);
+        pwp_conn_set_capabilities(pc, pwp_handshaker_get_capabilities(&me->hs));
+
+        if (me->on_handshake &&
+            0 == me->on_handshake(me->udata, me, pwp_handshaker_get_handshake(&me->hs)))
+            return 0;
+    }
+
+    /* whatever followed the handshake is parsed in place */
+    if (0 == len)
+        return 1;
+
+    return pwp_msghandler_dispatch_from_buffer(&me->mh, buf, len);
+}
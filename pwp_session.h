@@ -0,0 +1,56 @@
+#ifndef PWP_SESSION_H
+#define PWP_SESSION_H
+
+/**
+ * Called once the peer's handshake has been received, before any message
+ * that followed it is dispatched. This is where the connection's callbacks
+ * and piece info should be set up.
+ * @return 1 to continue; 0 if the peer needs to be disconnected */
+typedef int (*func_session_handshake_f)(
+        void *udata,
+        void *session,
+        pwp_handshake_t *hs);
+
+/**
+ * Create a session. A session owns the handshaker, message handler and
+ * connection for one socket within a single allocation.
+ * @return new session */
+void* pwp_session_new(char* expected_info_hash, char* mypeerid);
+
+/**
+ * Create a session which accepts any torrent within the registry
+ * @return new session */
+void* pwp_session_new_from_registry(void* registry, char* mypeerid);
+
+/**
+ * Release memory used by session */
+void pwp_session_release(void* s);
+
+/**
+ * Let us know when the handshake has been received */
+void pwp_session_set_handshake_cb(void* s,
+        func_session_handshake_f cb,
+        void* udata);
+
+/**
+ * @return the session's connection */
+pwp_conn_t* pwp_session_get_conn(void* s);
+
+/**
+ * @return the session's handshaker */
+void* pwp_session_get_handshaker(void* s);
+
+/**
+ * @return the session's message handler */
+void* pwp_session_get_msghandler(void* s);
+
+/**
+ * Receive data from the start of the connection.
+ * Handshake bytes are consumed by the handshaker, anything after the
+ * handshake is handed straight to the message handler.
+ * @return 1 if successful, 0 if the peer needs to be disconnected */
+int pwp_session_dispatch_from_buffer(void* s,
+        const char* buf,
+        unsigned int len);
+
+#endif /* PWP_SESSION_H */
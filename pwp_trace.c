@@ -0,0 +1,207 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Ring buffer of fixed size binary trace events.
+ *        Events are only turned into text when decoded
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include "bitfield.h"
+#include "pwp_connection.h"
+#include "pwp_trace.h"
+
+#undef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+
+typedef struct {
+    pwp_trace_rec_t* recs;
+    /* always a power of two */
+    unsigned int size;
+    /* number of events recorded; only written by the writer */
+    uint32_t head;
+    int level;
+    uint32_t msg_types;
+} trace_t;
+
+void* pwp_trace_new(unsigned int size)
+{
+    trace_t* me;
+
+    if (!(me = calloc(1, sizeof(trace_t))))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+
+    me->size = 8;
+    while (me->size < size)
+        me->size <<= 1;
+
+    if (!(me->recs = calloc(me->size, sizeof(pwp_trace_rec_t))))
+    {
+        perror("out of memory");
+        exit(0);
+    }
+
+    return me;
+}
+
+void pwp_trace_free(void* t)
+{
+    trace_t* me = t;
+    free(me->recs);
+    free(me);
+}
+
+void pwp_trace_set_filter(void* t, int level, uint32_t msg_types)
+{
+    trace_t* me = t;
+    me->level = level;
+    me->msg_types = msg_types;
+}
+
+int pwp_trace_level(unsigned char type)
+{
+    switch (type)
+    {
+    case PWP_MSGTYPE_HAVE:
+    case PWP_MSGTYPE_REQUEST:
+    case PWP_MSGTYPE_PIECE:
+    case PWP_MSGTYPE_CANCEL:
+    case PWP_MSGTYPE_SUGGEST:
+    case PWP_MSGTYPE_REJECT:
+    case PWP_MSGTYPE_ALLOWED_FAST:
+        return PWP_TRACE_LEVEL_BLOCK;
+    default:
+        return PWP_TRACE_LEVEL_STATE;
+    }
+}
+
+int pwp_trace_wants(const void* t, unsigned char type)
+{
+    const trace_t* me = t;
+
+    return type < 32 && (me->msg_types & ((uint32_t)1 << type)) &&
+        pwp_trace_level(type) <= me->level;
+}
+
+void pwp_trace_add(void* t, unsigned char dir, unsigned char type,
+        uint32_t piece_idx, uint32_t offset, uint32_t len, uint32_t tick)
+{
+    trace_t* me = t;
+    pwp_trace_rec_t* r;
+
+    if (!pwp_trace_wants(me, type))
+        return;
+
+    r = &me->recs[me->head & (me->size - 1)];
+    r->seq = me->head;
+    r->tick = tick;
+    r->dir = dir;
+    r->type = type;
+    r->level = pwp_trace_level(type);
+    r->pad = 0;
+    r->piece_idx = piece_idx;
+    r->offset = offset;
+    r->len = len;
+
+    /* publish the event to readers */
+    __atomic_store_n(&me->head, me->head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned int pwp_trace_read(const void* t, pwp_trace_rec_t* recs,
+        unsigned int max)
+{
+    const trace_t* me = t;
+    uint32_t head, start, oldest, i, n;
+
+    head = __atomic_load_n(&me->head, __ATOMIC_ACQUIRE);
+    n = min(min(head, me->size), max);
+    start = head - n;
+
+    for (i = 0; i < n; i++)
+        recs[i] = me->recs[(start + i) & (me->size - 1)];
+
+    /* the writer may have lapped us while copying; drop what it could have
+     * overwritten, including the slot it might be writing right now */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&me->head, __ATOMIC_ACQUIRE);
+    if (head < me->size)
+        return n;
+
+    oldest = head - me->size + 1;
+    if ((int32_t)(oldest - start) <= 0)
+        return n;
+    if (n <= oldest - start)
+        return 0;
+    memmove(recs, recs + (oldest - start),
+            (n - (oldest - start)) * sizeof(pwp_trace_rec_t));
+    return n - (oldest - start);
+}
+
+static const char* __type_to_string(unsigned char type)
+{
+    switch (type)
+    {
+    case PWP_MSGTYPE_CHOKE: return "choke";
+    case PWP_MSGTYPE_UNCHOKE: return "unchoke";
+    case PWP_MSGTYPE_INTERESTED: return "interested";
+    case PWP_MSGTYPE_UNINTERESTED: return "uninterested";
+    case PWP_MSGTYPE_HAVE: return "have";
+    case PWP_MSGTYPE_BITFIELD: return "bitfield";
+    case PWP_MSGTYPE_REQUEST: return "request";
+    case PWP_MSGTYPE_PIECE: return "piece";
+    case PWP_MSGTYPE_CANCEL: return "cancel";
+    case PWP_MSGTYPE_SUGGEST: return "suggest";
+    case PWP_MSGTYPE_HAVE_ALL: return "have_all";
+    case PWP_MSGTYPE_HAVE_NONE: return "have_none";
+    case PWP_MSGTYPE_REJECT: return "reject";
+    case PWP_MSGTYPE_ALLOWED_FAST: return "allowed_fast";
+    case PWP_MSGTYPE_EXTENDED: return "extended";
+    default: return "none";
+    }
+}
+
+int pwp_trace_format(const pwp_trace_rec_t* rec, char* buf, unsigned int len)
+{
+    const char* dir = rec->dir == PWP_TRACE_SEND ? "send" : "read";
+    const char* type = __type_to_string(rec->type);
+
+    switch (rec->type)
+    {
+    case PWP_MSGTYPE_HAVE:
+        if (1 < rec->len)
+            return snprintf(buf, len, "%s,have_batch,npieces=%u",
+                    dir, rec->len);
+        /* fall through */
+    case PWP_MSGTYPE_SUGGEST:
+    case PWP_MSGTYPE_ALLOWED_FAST:
+        return snprintf(buf, len, "%s,%s,piece_idx=%u",
+                dir, type, rec->piece_idx);
+    case PWP_MSGTYPE_REQUEST:
+    case PWP_MSGTYPE_PIECE:
+    case PWP_MSGTYPE_CANCEL:
+    case PWP_MSGTYPE_REJECT:
+        return snprintf(buf, len, "%s,%s,piece_idx=%u offset=%u len=%u",
+                dir, type, rec->piece_idx, rec->offset, rec->len);
+    case PWP_MSGTYPE_BITFIELD:
+        return snprintf(buf, len, "%s,bitfield,nbits=%u", dir, rec->len);
+    case PWP_MSGTYPE_EXTENDED:
+        return snprintf(buf, len, "%s,extended,id=%u len=%u",
+                dir, rec->piece_idx, rec->len);
+    default:
+        return snprintf(buf, len, "%s,%s", dir, type);
+    }
+}
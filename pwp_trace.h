@@ -0,0 +1,85 @@
+#ifndef PWP_TRACE_H
+#define PWP_TRACE_H
+
+enum {
+    PWP_TRACE_READ = 0,
+    PWP_TRACE_SEND = 1,
+};
+
+enum {
+    PWP_TRACE_LEVEL_NONE = 0,
+    /* choke/unchoke, interest, bitfield, have all/none, extended */
+    PWP_TRACE_LEVEL_STATE = 1,
+    /* per piece and per block messages as well */
+    PWP_TRACE_LEVEL_BLOCK = 2,
+};
+
+/* trace all message types */
+#define PWP_TRACE_ALL_MSGS 0xFFFFFFFF
+
+/**
+ * A trace event. Fixed size so that a ring can be dumped as is and decoded
+ * offline with pwp_trace_format */
+typedef struct {
+    /* incremented per event recorded; gaps mean events were overwritten */
+    uint32_t seq;
+    /* connection's tick when the event was recorded */
+    uint32_t tick;
+    /* PWP_TRACE_READ or PWP_TRACE_SEND */
+    uint8_t dir;
+    /* PWP_MSGTYPE_* */
+    uint8_t type;
+    /* PWP_TRACE_LEVEL_* */
+    uint8_t level;
+    uint8_t pad;
+    /* HAVE: first piece; EXTENDED: extended message id */
+    uint32_t piece_idx;
+    uint32_t offset;
+    /* HAVE: number of pieces; BITFIELD: number of bits */
+    uint32_t len;
+} pwp_trace_rec_t;
+
+/**
+ * Create a ring of trace events. Oldest events are overwritten when full.
+ * Recording doesn't lock or allocate. There must only be one writer, but
+ * pwp_trace_read can be called from another thread.
+ * By default nothing is recorded, see pwp_trace_set_filter
+ * @param size Number of events held; rounded up to a power of two
+ * @return new ring */
+void* pwp_trace_new(unsigned int size);
+
+void pwp_trace_free(void* t);
+
+/**
+ * Only record events at or below this level and of these message types
+ * @param level PWP_TRACE_LEVEL_*
+ * @param msg_types Bitmask of (1 << PWP_MSGTYPE_*) */
+void pwp_trace_set_filter(void* t, int level, uint32_t msg_types);
+
+/**
+ * @return 1 if an event of this type would be recorded; 0 otherwise */
+int pwp_trace_wants(const void* t, unsigned char type);
+
+/**
+ * @return level of this message type */
+int pwp_trace_level(unsigned char type);
+
+/**
+ * Record an event if it passes the filter */
+void pwp_trace_add(void* t, unsigned char dir, unsigned char type,
+        uint32_t piece_idx, uint32_t offset, uint32_t len, uint32_t tick);
+
+/**
+ * Copy out the most recent events, oldest first
+ * @param recs Array to write events to
+ * @param max Number of events recs can hold
+ * @return number of events copied */
+unsigned int pwp_trace_read(const void* t, pwp_trace_rec_t* recs,
+        unsigned int max);
+
+/**
+ * Decode an event into text, eg. "send,request,piece_idx=1 offset=0 len=16384"
+ * @return number of characters written, as per snprintf */
+int pwp_trace_format(const pwp_trace_rec_t* rec, char* buf, unsigned int len);
+
+#endif /* PWP_TRACE_H */
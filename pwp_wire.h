@@ -0,0 +1,118 @@
+#ifndef PWP_WIRE_H
+#define PWP_WIRE_H
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Encoders/decoders for PWP messages. Integers are big endian on the wire.
+ * Loads and stores go through memcpy so buffers don't need to be aligned */
+
+/* 4 byte length prefix + 1 byte message id */
+#define PWP_WIRE_HDR_LEN 5
+
+/* choke, unchoke, interested, not interested, have all, have none */
+#define PWP_WIRE_STATE_LEN 5
+
+/* have, suggest, allowed fast */
+#define PWP_WIRE_PIECE_IDX_LEN 9
+
+/* request, cancel, reject */
+#define PWP_WIRE_BLOCK_LEN 17
+
+/* piece message up to, but not including, the block's data */
+#define PWP_WIRE_PIECE_HDR_LEN 13
+
+typedef struct {
+    char b[PWP_WIRE_STATE_LEN];
+} pwp_wire_state_t;
+
+typedef struct {
+    char b[PWP_WIRE_PIECE_IDX_LEN];
+} pwp_wire_piece_idx_t;
+
+typedef struct {
+    char b[PWP_WIRE_BLOCK_LEN];
+} pwp_wire_block_t;
+
+typedef struct {
+    char b[PWP_WIRE_PIECE_HDR_LEN];
+} pwp_wire_piece_hdr_t;
+
+static inline uint32_t pwp_wire_bswap32(uint32_t i)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_bswap32(i);
+#else
+    return (i >> 24) | ((i >> 8) & 0xFF00) | ((i << 8) & 0xFF0000) | (i << 24);
+#endif
+}
+
+/**
+ * Convert between host and wire byte order */
+static inline uint32_t pwp_wire_u32(uint32_t i)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return i;
+#else
+    return pwp_wire_bswap32(i);
+#endif
+}
+
+static inline void pwp_wire_put_u32(char* p, uint32_t i)
+{
+    i = pwp_wire_u32(i);
+    memcpy(p, &i, 4);
+}
+
+static inline uint32_t pwp_wire_get_u32(const char* p)
+{
+    uint32_t i;
+    memcpy(&i, p, 4);
+    return pwp_wire_u32(i);
+}
+
+/**
+ * Write the length prefix and message id
+ * @param len Length of the message, including the id
+ * @return pointer to where the payload goes */
+static inline char* pwp_wire_put_hdr(char* p, uint32_t len, unsigned char id)
+{
+    pwp_wire_put_u32(p, len);
+    p[4] = id;
+    return p + PWP_WIRE_HDR_LEN;
+}
+
+static inline void pwp_wire_state(pwp_wire_state_t* m, unsigned char id)
+{
+    pwp_wire_put_hdr(m->b, 1, id);
+}
+
+static inline void pwp_wire_piece_idx(pwp_wire_piece_idx_t* m,
+        unsigned char id, uint32_t piece_idx)
+{
+    pwp_wire_put_u32(pwp_wire_put_hdr(m->b, 5, id), piece_idx);
+}
+
+static inline void pwp_wire_block(pwp_wire_block_t* m, unsigned char id,
+        uint32_t piece_idx, uint32_t offset, uint32_t len)
+{
+    char* p = pwp_wire_put_hdr(m->b, 13, id);
+
+    pwp_wire_put_u32(p, piece_idx);
+    pwp_wire_put_u32(p + 4, offset);
+    pwp_wire_put_u32(p + 8, len);
+}
+
+/**
+ * @param len Length of the block's data that will follow the header */
+static inline void pwp_wire_piece_hdr(pwp_wire_piece_hdr_t* m,
+        unsigned char id, uint32_t piece_idx, uint32_t offset, uint32_t len)
+{
+    char* p = pwp_wire_put_hdr(m->b, 9 + len, id);
+
+    pwp_wire_put_u32(p, piece_idx);
+    pwp_wire_put_u32(p + 4, offset);
+}
+
+#endif /* PWP_WIRE_H */
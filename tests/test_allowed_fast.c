@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "CuTest.h"
+
+#include "pwp_allowed_fast.h"
+
+/* test vectors from BEP 6 */
+static char __infohash[20] = {
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa };
+
+/* 80.4.4.200 */
+#define IP ((uint32_t)80 << 24 | 4 << 16 | 4 << 8 | 200)
+
+void TestPWP_allowed_fast_set_matches_bep6_with_7_pieces(
+    CuTest * tc
+)
+{
+    unsigned int p[7];
+    unsigned int expected[7] = { 1059, 431, 808, 1217, 287, 376, 1188 };
+
+    CuAssertTrue(tc, 7 == pwp_allowed_fast_generate(IP, __infohash, 1313, 7, p));
+    CuAssertTrue(tc, 0 == memcmp(p, expected, sizeof(expected)));
+}
+
+void TestPWP_allowed_fast_set_matches_bep6_with_9_pieces(
+    CuTest * tc
+)
+{
+    unsigned int p[9];
+    unsigned int expected[9] = {
+        1059, 431, 808, 1217, 287, 376, 1188, 353, 508 };
+
+    CuAssertTrue(tc, 9 == pwp_allowed_fast_generate(IP, __infohash, 1313, 9, p));
+    CuAssertTrue(tc, 0 == memcmp(p, expected, sizeof(expected)));
+}
+
+void TestPWP_allowed_fast_set_isnt_bigger_than_torrent(
+    CuTest * tc
+)
+{
+    unsigned int p[10];
+
+    CuAssertTrue(tc, 3 == pwp_allowed_fast_generate(IP, __infohash, 3, 10, p));
+}
+
+void TestPWP_allowed_fast_set_is_shared_within_subnet(
+    CuTest * tc
+)
+{
+    void *af;
+    const unsigned int *a, *b;
+    unsigned int na, nb;
+
+    af = pwp_allowed_fast_new(__infohash, 1313, 7);
+    a = pwp_allowed_fast_get(af, IP, &na);
+    b = pwp_allowed_fast_get(af, IP + 1, &nb);
+    CuAssertTrue(tc, 7 == na);
+    CuAssertTrue(tc, a == b);
+    CuAssertTrue(tc, 1059 == a[0]);
+    pwp_allowed_fast_release(af);
+}
+
+void TestPWP_allowed_fast_cache_is_emptied_when_full(
+    CuTest * tc
+)
+{
+    void *af;
+    const unsigned int *a;
+    unsigned int na, first, i;
+
+    af = pwp_allowed_fast_new(__infohash, 1313, 7);
+    first = pwp_allowed_fast_get(af, IP, &na)[0];
+
+    /* enough subnets to empty the cache more than once */
+    for (i = 1; i < 2500; i++)
+        pwp_allowed_fast_get(af, IP + (i << 8), &na);
+
+    a = pwp_allowed_fast_get(af, IP, &na);
+    CuAssertTrue(tc, 7 == na);
+    CuAssertTrue(tc, first == a[0]);
+    pwp_allowed_fast_release(af);
+}
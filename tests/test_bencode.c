@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include "pwp_bencode.h"
+
+void TestPWP_bencode_reads_ints_and_strings(
+    CuTest * tc
+)
+{
+    pwp_bencode_t b;
+    pwp_bencode_tok_t t;
+    const char* s = "i-42e4:spam";
+
+    pwp_bencode_init(&b, s, strlen(s));
+    CuAssertTrue(tc, 1 == pwp_bencode_next(&b, &t));
+    CuAssertTrue(tc, PWP_BENCODE_INT == t.type);
+    CuAssertTrue(tc, -42 == t.ival);
+    CuAssertTrue(tc, 1 == pwp_bencode_next(&b, &t));
+    CuAssertTrue(tc, PWP_BENCODE_STR == t.type);
+    CuAssertTrue(tc, 4 == t.len);
+
+    /* strings point into the buffer */
+    CuAssertTrue(tc, s + 7 == t.str);
+    CuAssertTrue(tc, pwp_bencode_str_is(&t, "spam"));
+    CuAssertTrue(tc, 0 == pwp_bencode_next(&b, &t));
+}
+
+void TestPWP_bencode_finds_key_within_dict(
+    CuTest * tc
+)
+{
+    pwp_bencode_t b;
+    pwp_bencode_tok_t t;
+    const char* s = "d1:ai1e1:bli2ei3ee1:cd1:xi4eee";
+
+    pwp_bencode_init(&b, s, strlen(s));
+    CuAssertTrue(tc, 1 == pwp_bencode_next(&b, &t));
+    CuAssertTrue(tc, PWP_BENCODE_DICT == t.type);
+
+    /* skips over the list */
+    CuAssertTrue(tc, 1 == pwp_bencode_dict_find(&b, "c", &t));
+    CuAssertTrue(tc, PWP_BENCODE_DICT == t.type);
+    CuAssertTrue(tc, 1 == pwp_bencode_dict_find(&b, "x", &t));
+    CuAssertTrue(tc, 4 == t.ival);
+}
+
+void TestPWP_bencode_doesnt_find_missing_key(
+    CuTest * tc
+)
+{
+    pwp_bencode_t b;
+    pwp_bencode_tok_t t;
+    const char* s = "d1:ai1ee";
+
+    pwp_bencode_init(&b, s, strlen(s));
+    pwp_bencode_next(&b, &t);
+    CuAssertTrue(tc, 0 == pwp_bencode_dict_find(&b, "z", &t));
+    CuAssertTrue(tc, 0 == pwp_bencode_next(&b, &t));
+}
+
+void TestPWP_bencode_rejects_malformed_input(
+    CuTest * tc
+)
+{
+    pwp_bencode_t b;
+    pwp_bencode_tok_t t;
+
+    /* string longer than buffer */
+    pwp_bencode_init(&b, "9:abc", 5);
+    CuAssertTrue(tc, -1 == pwp_bencode_next(&b, &t));
+
+    /* unterminated int */
+    pwp_bencode_init(&b, "i12", 3);
+    CuAssertTrue(tc, -1 == pwp_bencode_next(&b, &t));
+
+    /* unterminated dict */
+    pwp_bencode_init(&b, "d1:ai1e", 7);
+    pwp_bencode_next(&b, &t);
+    CuAssertTrue(tc, -1 == pwp_bencode_dict_find(&b, "z", &t));
+
+    /* unmatched end */
+    pwp_bencode_init(&b, "e", 1);
+    CuAssertTrue(tc, -1 == pwp_bencode_next(&b, &t));
+}
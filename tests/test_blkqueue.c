@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "CuTest.h"
+
+#include "bitfield.h"
+#include "pwp_connection.h"
+#include "pwp_blkqueue.h"
+
+static bt_block_t __blk(unsigned int piece_idx)
+{
+    bt_block_t b = { piece_idx, 0, 16384 };
+    return b;
+}
+
+void TestPWP_blkqueue_is_fifo_across_wraps_and_growth(
+    CuTest * tc
+)
+{
+    void* q = pwp_blkqueue_new(0);
+    bt_block_t b;
+    unsigned int i, next = 0;
+
+    /* wrap the ring a few times before growing it */
+    for (i = 0; i < 100; i++)
+    {
+        b = __blk(i);
+        pwp_blkqueue_offer(q, &b);
+        if (i % 3 == 2)
+        {
+            CuAssertTrue(tc, 1 == pwp_blkqueue_poll(q, &b));
+            CuAssertTrue(tc, next++ == b.piece_idx);
+        }
+    }
+
+    CuAssertTrue(tc, 100 - next == pwp_blkqueue_count(q));
+    while (pwp_blkqueue_poll(q, &b))
+        CuAssertTrue(tc, next++ == b.piece_idx);
+    CuAssertTrue(tc, 100 == next);
+    CuAssertTrue(tc, 0 == pwp_blkqueue_count(q));
+    pwp_blkqueue_free(q);
+}
+
+void TestPWP_blkqueue_remove_keeps_order(
+    CuTest * tc
+)
+{
+    void* q = pwp_blkqueue_new(0);
+    unsigned int i, expected[] = { 0, 2, 3, 4, 6, 7 };
+    bt_block_t b;
+
+    for (i = 0; i < 8; i++)
+    {
+        b = __blk(i);
+        pwp_blkqueue_offer(q, &b);
+    }
+
+    b = __blk(5);
+    CuAssertTrue(tc, 5 == pwp_blkqueue_find(q, &b));
+    pwp_blkqueue_remove(q, 5, &b);
+    CuAssertTrue(tc, 5 == b.piece_idx);
+    CuAssertTrue(tc, -1 == pwp_blkqueue_find(q, &b));
+    pwp_blkqueue_remove(q, 1, NULL);
+
+    for (i = 0; i < 6; i++)
+        CuAssertTrue(tc, expected[i] == pwp_blkqueue_get(q, i)->piece_idx);
+    pwp_blkqueue_free(q);
+}
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "CuTest.h"
+
+#include "chunkybar.h"
+
+/* chunkybar is forked from willemt/chunkybar; these guard our array version */
+
+#define NBITS 256
+
+static unsigned int __rand(unsigned int* seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+static int __bitmap_have(const char* bits, unsigned int offset,
+        unsigned int len)
+{
+    unsigned int i;
+
+    for (i = offset; i < offset + len; i++)
+        if (!bits[i])
+            return 0;
+    return 1;
+}
+
+/**
+ * Check chunks are sorted, merged, and cover exactly the marked bits */
+static void __assert_matches_bitmap(CuTest * tc, chunkybar_t* cb,
+        const char* bits)
+{
+    chunky_iterator_t iter;
+    unsigned int offset, len, i, nchunks = 0, nbytes = 0, prev_end = 0;
+    char seen[NBITS];
+
+    memset(seen, 0, sizeof(seen));
+    chunky_iterator(cb, &iter);
+    while (chunky_iterator_next(&iter, &offset, &len))
+    {
+        CuAssertTrue(tc, 0 < len);
+        /* touching chunks should have been merged */
+        CuAssertTrue(tc, 0 == nchunks || prev_end < offset);
+        memset(seen + offset, 1, len);
+        prev_end = offset + len;
+        nbytes += len;
+        nchunks++;
+    }
+
+    CuAssertTrue(tc, 0 == memcmp(seen, bits, NBITS));
+    CuAssertTrue(tc, (int)nchunks == chunky_get_num_chunks(cb));
+    CuAssertTrue(tc, nbytes == chunky_get_nbytes_completed(cb));
+
+    for (i = 0; i < NBITS; i++)
+        CuAssertTrue(tc, bits[i] == chunky_have(cb, i, 1));
+}
+
+void TestChunkybar_mark_merges_and_splits_chunks(
+    CuTest * tc
+)
+{
+    chunkybar_t* cb = chunky_new(NBITS);
+    char bits[NBITS];
+
+    memset(bits, 0, sizeof(bits));
+
+    /* adjacent chunks on either side merge */
+    chunky_mark_complete(cb, 10, 5);
+    chunky_mark_complete(cb, 20, 5);
+    CuAssertTrue(tc, 2 == chunky_get_num_chunks(cb));
+    chunky_mark_complete(cb, 15, 5);
+    memset(bits + 10, 1, 15);
+    CuAssertTrue(tc, 1 == chunky_get_num_chunks(cb));
+    __assert_matches_bitmap(tc, cb, bits);
+
+    /* edges of a chunk */
+    CuAssertTrue(tc, 1 == chunky_have(cb, 10, 15));
+    CuAssertTrue(tc, 0 == chunky_have(cb, 9, 2));
+    CuAssertTrue(tc, 0 == chunky_have(cb, 24, 2));
+
+    /* unmarking the middle splits the chunk */
+    chunky_mark_incomplete(cb, 16, 3);
+    memset(bits + 16, 0, 3);
+    CuAssertTrue(tc, 2 == chunky_get_num_chunks(cb));
+    __assert_matches_bitmap(tc, cb, bits);
+
+    /* marking over several chunks swallows them */
+    chunky_mark_complete(cb, 40, 1);
+    chunky_mark_complete(cb, 5, 40);
+    memset(bits + 5, 1, 40);
+    CuAssertTrue(tc, 1 == chunky_get_num_chunks(cb));
+    __assert_matches_bitmap(tc, cb, bits);
+
+    /* unmarking the ends trims */
+    chunky_mark_incomplete(cb, 0, 6);
+    chunky_mark_incomplete(cb, 44, 100);
+    memset(bits, 0, 6);
+    memset(bits + 44, 0, 100);
+    __assert_matches_bitmap(tc, cb, bits);
+
+    chunky_free(cb);
+}
+
+void TestChunkybar_random_marks_match_bitmap(
+    CuTest * tc
+)
+{
+    chunkybar_t* cb = chunky_new(NBITS);
+    char bits[NBITS];
+    unsigned int seed = 1, i, offset, len;
+
+    memset(bits, 0, sizeof(bits));
+
+    for (i = 0; i < 5000; i++)
+    {
+        offset = __rand(&seed) % NBITS;
+        len = 1 + __rand(&seed) % 16;
+        if (NBITS < offset + len)
+            len = NBITS - offset;
+
+        if (__rand(&seed) % 2)
+        {
+            chunky_mark_complete(cb, offset, len);
+            memset(bits + offset, 1, len);
+        }
+        else
+        {
+            chunky_mark_incomplete(cb, offset, len);
+            memset(bits + offset, 0, len);
+        }
+
+        __assert_matches_bitmap(tc, cb, bits);
+
+        offset = __rand(&seed) % NBITS;
+        len = 1 + __rand(&seed) % 16;
+        if (NBITS < offset + len)
+            len = NBITS - offset;
+        CuAssertTrue(tc, __bitmap_have(bits, offset, len) ==
+                chunky_have(cb, offset, len));
+    }
+
+    chunky_free(cb);
+}
@@ -25,6 +25,15 @@ typedef struct
 
     void* sc;
 
+    /* number of peer_have_pieces callbacks */
+    int nhave_batches;
+
+    /* number of peer_giveback_blocks callbacks */
+    int ngiveback_batches;
+
+    /* number of peer_have_all callbacks */
+    int nhave_alls;
+
 } test_sender_t;
 
 int __FUNC_connect(
@@ -13,6 +13,7 @@
 #include "mock_piece.h"
 #include "test_connection.h"
 #include "chunkybar.h"
+#include "pwp_extensions.h"
 
 #define STATE_READY_TO_SENDRECV PC_CONNECTED | PC_HANDSHAKE_SENT | PC_HANDSHAKE_RECEIVED
 
@@ -42,6 +43,15 @@ static int __disconnect_msg(
     return 1;
 }
 
+static void __giveback_block(
+        void* s,
+        void* peer __attribute__((__unused__)),
+        bt_block_t* blk)
+{
+    test_sender_t* sender = s;
+    memcpy(&sender->read_last_block, blk, sizeof(bt_block_t));
+}
+
 /**
  * A request message spawns an appropriate response
  * Note: request message needs to check if we completed the requested piece
@@ -201,6 +211,74 @@ void TestPWP_send_bitField_is_wellformed(
     CuAssertTrue(tc, 0XF0 == (unsigned char)bitstream_read_byte(&ptr));
 }
 
+void TestPWP_send_bitfield_for_large_torrent_sets_ranges(
+    CuTest * tc
+)
+{
+    test_sender_t sender;
+    char *msg, *ptr;
+    chunkybar_t* sc;
+    int npieces = 200001, i;
+
+    msg = malloc(pwp_bitfield_msg_size(npieces));
+    ptr = msg;
+    __sender_set(&sender,NULL,msg);
+    sc = chunky_new(0);
+    chunky_mark_complete(sc,3,20);
+    chunky_mark_complete(sc,199990,100);
+
+    pwp_send_bitfield(npieces, sc, __FUNC_send, &sender, NULL);
+    CuAssertTrue(tc, 1 + 25001 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, PWP_MSGTYPE_BITFIELD == bitstream_read_byte(&ptr));
+
+    /* 00011111 11111111 11111110 */
+    CuAssertTrue(tc, 0x1F == (unsigned char)ptr[0]);
+    CuAssertTrue(tc, 0xFF == (unsigned char)ptr[1]);
+    CuAssertTrue(tc, 0xFE == (unsigned char)ptr[2]);
+    CuAssertTrue(tc, 0x00 == (unsigned char)ptr[3]);
+    for (i=3; i<24998; i++)
+        CuAssertTrue(tc, 0 == ptr[i]);
+    /* piece 199990 onwards; spare bits after the last piece are clear */
+    CuAssertTrue(tc, 0x03 == (unsigned char)ptr[24998]);
+    CuAssertTrue(tc, 0xFF == (unsigned char)ptr[24999]);
+    CuAssertTrue(tc, 0x80 == (unsigned char)ptr[25000]);
+    chunky_free(sc);
+    free(msg);
+}
+
+void TestPWP_bitfield_cache_is_updated_when_pieces_complete(
+    CuTest * tc
+)
+{
+    test_sender_t sender;
+    char msg[1000], *ptr;
+    const char* bf;
+    unsigned int len;
+    chunkybar_t* sc;
+    void* bc;
+
+    ptr = msg;
+    __sender_set(&sender,NULL,msg);
+    sc = chunky_new(0);
+    chunky_mark_complete(sc,0,8);
+    bc = pwp_bitfield_cache_new(20, sc);
+
+    bf = pwp_bitfield_cache_get(bc, &len);
+    CuAssertTrue(tc, 4 + 1 + 3 == len);
+    CuAssertTrue(tc, 0x00 == (unsigned char)bf[6]);
+
+    pwp_bitfield_cache_mark(bc, 9);
+    pwp_bitfield_cache_mark(bc, 19);
+    pwp_send_bitfield_cached(bc, __FUNC_send, &sender, NULL);
+    CuAssertTrue(tc, 4 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, PWP_MSGTYPE_BITFIELD == bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 0xFF == (unsigned char)bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 0x40 == (unsigned char)bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 0x10 == (unsigned char)bitstream_read_byte(&ptr));
+    pwp_bitfield_cache_release(bc);
+    chunky_free(sc);
+}
+
 /*
  * Request message has payload of 6
  */
@@ -359,6 +437,41 @@ void TestPWP_send_cancel_is_wellformed(
     CuAssertTrue(tc, 20 == fe(bitstream_read_uint32(&ptr)));
 }
 
+void TestPWP_send_reject_is_wellformed(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_send,
+    };
+    void *pc;
+    test_sender_t sender;
+    bt_block_t blk;
+    char msg[1000], *ptr;
+
+    /* msg */
+    blk.piece_idx = 1;
+    blk.offset = 0;
+    blk.len = 20;
+
+    /* setup */
+    ptr = msg;
+    __sender_set(&sender,NULL,msg);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+
+    /* send msg */
+    pwp_conn_send_reject(pc, &blk);
+
+    /* read sent msg */
+    CuAssertTrue(tc, 13 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, PWP_MSGTYPE_REJECT == bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 1 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, 0 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, 20 == fe(bitstream_read_uint32(&ptr)));
+}
+
 /*----------------------------------------------------------------------------*/
 /*  Receive data                                                              */
 /*----------------------------------------------------------------------------*/
@@ -598,7 +711,7 @@ void TestPWP_read_request_msg_disconnects_if_peer_is_choked(
     char msg[50], *ptr = msg;
 
     /*  request piece */
-    bitstream_write_uint32(&ptr, fe(12));      /*  payload length */
+    bitstream_write_uint32(&ptr, fe(13));      /*  payload length */
     bitstream_write_byte(&ptr, 6);        /*  message type */
     bitstream_write_uint32(&ptr, fe(1));      /*  piece idx */
     bitstream_write_uint32(&ptr, fe(0));       /*  block offset */
@@ -857,7 +970,7 @@ void TestPWP_read_request_of_piece_not_completed_disconnects_peer(
     __sender_set(&sender, msg, NULL);
 
     /*  piece */
-    bitstream_write_uint32(&ptr, fe(12));      /*  payload length */
+    bitstream_write_uint32(&ptr, fe(13));      /*  payload length */
     bitstream_write_byte(&ptr, 6);        /*  message type: request */
     /*  invalid piece idx of zero */
     bitstream_write_uint32(&ptr, fe(1));       /*  piece idx */
@@ -903,7 +1016,7 @@ void TestPWP_read_request_with_invalid_piece_idx_disconnects_peer(
     __sender_set(&sender,msg,NULL);
 
     /*  piece */
-    bitstream_write_uint32(&ptr, fe(12));      /*  payload length */
+    bitstream_write_uint32(&ptr, fe(13));      /*  payload length */
     bitstream_write_byte(&ptr, 6);        /*  message type */
     /*  invalid piece idx of 62 */
     bitstream_write_uint32(&ptr, fe(62));      /*  piece idx */
@@ -947,7 +1060,7 @@ void TestPWP_read_request_with_invalid_block_length_disconnects_peer(
     __sender_set(&sender,msg,NULL);
 
     /*  request piece */
-    bitstream_write_uint32(&ptr, fe(12));      /*  payload length */
+    bitstream_write_uint32(&ptr, fe(13));      /*  payload length */
     bitstream_write_byte(&ptr, 6);        /*  message type */
     bitstream_write_uint32(&ptr, fe(0));      /*  piece idx */
     bitstream_write_uint32(&ptr, fe(0));       /*  block offset */
@@ -1009,7 +1122,7 @@ void TestPWP_read_request_of_piece_which_client_has_results_in_disconnect(
 
     /*  request piece */
     ptr = msg;
-    bitstream_write_uint32(&ptr, fe(12));      /*  payload length */
+    bitstream_write_uint32(&ptr, fe(13));      /*  payload length */
     bitstream_write_byte(&ptr, 6);        /*  message type */
     bitstream_write_uint32(&ptr, fe(1));      /*  piece idx */
     bitstream_write_uint32(&ptr, fe(0));       /*  block offset */
@@ -1528,3 +1641,768 @@ void TestPWP_request_queue_dropped_when_peer_is_choked(
     /* check that request has been expunged */
     CuAssertTrue(tc, 0 == pwp_conn_get_npending_peer_requests(pc));
 }
+
+void TestPWP_read_have_all_marks_peer_as_having_every_piece(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_send,
+        .disconnect = __FUNC_disconnect,
+    };
+    char msg[1000];
+    void *pc;
+    test_sender_t sender;
+    chunkybar_t* sc;
+
+    /* setup */
+    __sender_set(&sender,NULL,msg);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_capabilities(pc, PWP_CAP_FAST);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    sc = chunky_new(0);
+    pwp_conn_set_progress(pc,sc);
+
+    pwp_conn_have_all(pc);
+    CuAssertTrue(tc, 0 == sender.has_disconnected);
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(pc, 0));
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(pc, 19));
+    CuAssertTrue(tc, 1 == pwp_conn_im_interested(pc));
+    pwp_conn_release(pc);
+    chunky_free(sc);
+}
+
+void TestPWP_read_have_all_disconnects_without_fast_extension(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .disconnect = __FUNC_disconnect,
+    };
+    void *pc;
+    test_sender_t sender;
+
+    __sender_set(&sender,NULL,NULL);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+
+    pwp_conn_have_all(pc);
+    CuAssertTrue(tc, 1 == sender.has_disconnected);
+    CuAssertTrue(tc, 0 == pwp_conn_peer_has_piece(pc, 0));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_read_reject_gives_block_back(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_MOCK_send,
+        .disconnect = __FUNC_disconnect,
+        .peer_giveback_block = __giveback_block,
+    };
+    void *pc;
+    test_sender_t sender;
+    bt_block_t blk;
+
+    memset(&blk, 0, sizeof(bt_block_t));
+    blk.piece_idx = 2;
+    blk.len = 5;
+
+    __sender_set(&sender,NULL,NULL);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_capabilities(pc, PWP_CAP_FAST);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    pwp_conn_request_block_from_peer(pc, &blk);
+    CuAssertTrue(tc, 1 == pwp_conn_get_npending_requests(pc));
+
+    CuAssertTrue(tc, 1 == pwp_conn_reject(pc, &blk));
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_requests(pc));
+    CuAssertTrue(tc, 2 == sender.read_last_block.piece_idx);
+    CuAssertTrue(tc, 5 == sender.read_last_block.len);
+
+    /* rejecting a request we never made is an error */
+    CuAssertTrue(tc, 0 == pwp_conn_reject(pc, &blk));
+    CuAssertTrue(tc, 1 == sender.has_disconnected);
+    pwp_conn_release(pc);
+}
+
+void TestPWP_read_chokemsg_keeps_pending_requests_with_fast_extension(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_MOCK_send,
+    };
+    void *pc;
+    test_sender_t sender;
+    bt_block_t blk;
+
+    memset(&blk, 0, sizeof(bt_block_t));
+    blk.len = 1;
+
+    __sender_set(&sender,NULL,NULL);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_capabilities(pc, PWP_CAP_FAST);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    pwp_conn_request_block_from_peer(pc, &blk);
+
+    pwp_conn_choke(pc);
+    CuAssertTrue(tc, 1 == pwp_conn_im_choked(pc));
+    CuAssertTrue(tc, 1 == pwp_conn_get_npending_requests(pc));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_choking_peer_rejects_their_requests_with_fast_extension(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_send,
+        .disconnect = __FUNC_disconnect,
+    };
+    char msg[1000], *ptr = msg;
+    void *pc;
+    test_sender_t sender;
+    bt_block_t request;
+    chunkybar_t* sc;
+
+    /* setup */
+    __sender_set(&sender,NULL,msg);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV | PC_BITFIELD_RECEIVED);
+    pwp_conn_set_capabilities(pc, PWP_CAP_FAST);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    sc = chunky_new(0);
+    pwp_conn_set_progress(pc,sc);
+    chunky_mark_complete(sc,0,20);
+
+    request.piece_idx = 3;
+    request.offset = 0;
+    request.len = 2;
+    pwp_conn_request(pc, &request);
+    pwp_conn_choke_peer(pc);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_peer_requests(pc));
+
+    /* choke followed by reject */
+    CuAssertTrue(tc, 1 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, PWP_MSGTYPE_CHOKE == bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 13 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, PWP_MSGTYPE_REJECT == bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 3 == fe(bitstream_read_uint32(&ptr)));
+
+    /* requests while choked are rejected rather than disconnected */
+    pwp_conn_request(pc, &request);
+    CuAssertTrue(tc, 0 == sender.has_disconnected);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_peer_requests(pc));
+    pwp_conn_release(pc);
+    chunky_free(sc);
+}
+
+void TestPWP_read_request_for_allowed_fast_piece_is_queued_while_choked(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_send,
+        .disconnect = __FUNC_disconnect,
+    };
+    char msg[1000], *ptr = msg;
+    void *pc;
+    test_sender_t sender;
+    bt_block_t request;
+    chunkybar_t* sc;
+    unsigned int allowed[2] = { 3, 5 };
+
+    /* setup */
+    __sender_set(&sender,NULL,msg);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV | PC_BITFIELD_RECEIVED |
+            PC_IM_CHOKING);
+    pwp_conn_set_capabilities(pc, PWP_CAP_FAST);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    sc = chunky_new(0);
+    pwp_conn_set_progress(pc,sc);
+    chunky_mark_complete(sc,0,20);
+
+    pwp_conn_grant_allowed_fast(pc, allowed, 2);
+    CuAssertTrue(tc, 5 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, PWP_MSGTYPE_ALLOWED_FAST == bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 3 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, 2 == sender.nsent_messages);
+
+    request.piece_idx = 5;
+    request.offset = 0;
+    request.len = 2;
+    CuAssertTrue(tc, 1 == pwp_conn_request(pc, &request));
+    CuAssertTrue(tc, 1 == pwp_conn_get_npending_peer_requests(pc));
+
+    /* choking again doesn't reject allowed fast requests */
+    pwp_conn_choke_peer(pc);
+    CuAssertTrue(tc, 1 == pwp_conn_get_npending_peer_requests(pc));
+    CuAssertTrue(tc, 0 == sender.has_disconnected);
+    pwp_conn_release(pc);
+    chunky_free(sc);
+}
+
+void TestPWP_read_allowed_fast_lets_us_request_piece_while_choked(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .disconnect = __FUNC_disconnect,
+    };
+    void *pc;
+    test_sender_t sender;
+    msg_have_t allowed;
+
+    __sender_set(&sender,NULL,NULL);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_capabilities(pc, PWP_CAP_FAST);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+
+    allowed.piece_idx = 7;
+    pwp_conn_allowed_fast(pc, &allowed);
+    CuAssertTrue(tc, 1 == pwp_conn_peer_allowed_fast(pc, 7));
+    CuAssertTrue(tc, 0 == pwp_conn_peer_allowed_fast(pc, 6));
+
+    /* pieces outside of the torrent are ignored */
+    allowed.piece_idx = 20;
+    pwp_conn_allowed_fast(pc, &allowed);
+    CuAssertTrue(tc, 0 == pwp_conn_peer_allowed_fast(pc, 20));
+    CuAssertTrue(tc, 0 == sender.has_disconnected);
+    pwp_conn_release(pc);
+}
+
+void TestPWP_suggest_piece_is_rate_limited_per_period(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_send,
+        .disconnect = __FUNC_disconnect,
+    };
+    char msg[1000], *ptr = msg;
+    void *pc;
+    test_sender_t sender;
+    int i, sent = 0;
+
+    __sender_set(&sender,NULL,msg);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV | PC_PEER_CHOKING);
+    pwp_conn_set_capabilities(pc, PWP_CAP_FAST);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+
+    /* the peer already has this piece */
+    pwp_conn_mark_peer_has_piece(pc, 0);
+    CuAssertTrue(tc, 0 == pwp_conn_suggest_piece(pc, 0));
+
+    for (i = 1; i < 20; i++)
+        sent += pwp_conn_suggest_piece(pc, i);
+    CuAssertTrue(tc, 0 < sent && sent < 19);
+    CuAssertTrue(tc, 5 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, PWP_MSGTYPE_SUGGEST == bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 1 == fe(bitstream_read_uint32(&ptr)));
+
+    /* the limit resets each period */
+    pwp_conn_periodic(pc);
+    CuAssertTrue(tc, 1 == pwp_conn_suggest_piece(pc, 19));
+    pwp_conn_release(pc);
+}
+
+static void __suggest(void *udata, void *peer __attribute__((__unused__)),
+        int piece)
+{
+    test_sender_t* sender = udata;
+    sender->read_last_block.piece_idx = piece;
+}
+
+void TestPWP_read_suggest_is_passed_to_picker(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .disconnect = __FUNC_disconnect,
+        .peer_suggest_piece = __suggest,
+    };
+    void *pc;
+    test_sender_t sender;
+    msg_have_t suggest;
+    chunkybar_t* sc;
+
+    __sender_set(&sender,NULL,NULL);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_capabilities(pc, PWP_CAP_FAST);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    sc = chunky_new(0);
+    pwp_conn_set_progress(pc,sc);
+    chunky_mark_complete(sc,3,1);
+
+    suggest.piece_idx = 7;
+    pwp_conn_suggest(pc, &suggest);
+    CuAssertTrue(tc, 7 == sender.read_last_block.piece_idx);
+
+    /* we already have this piece */
+    suggest.piece_idx = 3;
+    pwp_conn_suggest(pc, &suggest);
+    CuAssertTrue(tc, 7 == sender.read_last_block.piece_idx);
+    CuAssertTrue(tc, 0 == sender.has_disconnected);
+    pwp_conn_release(pc);
+    chunky_free(sc);
+}
+
+static int __ext_received(void *udata, void *pc __attribute__((__unused__)),
+        const char *payload, unsigned int len)
+{
+    test_sender_t* sender = udata;
+    sender->read_last_block.len = len;
+    return 1;
+}
+
+void TestPWP_extended_handshake_maps_peer_extension_ids(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_send,
+        .disconnect = __FUNC_disconnect,
+    };
+    char msg[1000], *ptr = msg;
+    void *pc, *reg;
+    test_sender_t sender;
+    msg_extended_t ext;
+    int pex, meta;
+    char* hs = "d1:md6:ut_pexi0e11:ut_metadatai9ee1:pi6881ee";
+
+    __sender_set(&sender,NULL,msg);
+    reg = pwp_extensions_new();
+    meta = pwp_extensions_add(reg, "ut_metadata", __ext_received, &sender);
+    pex = pwp_extensions_add(reg, "ut_pex", __ext_received, &sender);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_capabilities(pc, PWP_CAP_EXTENSION);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    pwp_conn_set_extensions(pc, reg);
+
+    ext.id = 0;
+    ext.data = hs;
+    ext.len = strlen(hs);
+    CuAssertTrue(tc, 1 == pwp_conn_extended(pc, &ext));
+    CuAssertTrue(tc, 1 == pwp_conn_peer_supports_extension(pc, meta));
+    /* a zero id means the peer disabled it */
+    CuAssertTrue(tc, 0 == pwp_conn_peer_supports_extension(pc, pex));
+    CuAssertTrue(tc, 0 == pwp_conn_send_extended(pc, pex, "x", 1));
+
+    /* we send using the peer's id */
+    CuAssertTrue(tc, 1 == pwp_conn_send_extended(pc, meta, "abc", 3));
+    CuAssertTrue(tc, 5 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, PWP_MSGTYPE_EXTENDED == bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 9 == bitstream_read_byte(&ptr));
+
+    /* we receive using our id */
+    ext.id = meta;
+    ext.data = "abcd";
+    ext.len = 4;
+    CuAssertTrue(tc, 1 == pwp_conn_extended(pc, &ext));
+    CuAssertTrue(tc, 4 == sender.read_last_block.len);
+    CuAssertTrue(tc, 0 == sender.has_disconnected);
+
+    pwp_conn_release(pc);
+    pwp_extensions_release(reg);
+}
+
+void TestPWP_extended_disconnects_without_extension_protocol(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .disconnect = __FUNC_disconnect,
+    };
+    void *pc;
+    test_sender_t sender;
+    msg_extended_t ext;
+
+    __sender_set(&sender,NULL,NULL);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    ext.id = 0;
+    ext.data = "de";
+    ext.len = 2;
+    CuAssertTrue(tc, 0 == pwp_conn_extended(pc, &ext));
+    CuAssertTrue(tc, 1 == sender.has_disconnected);
+    pwp_conn_release(pc);
+}
+
+void TestPWP_send_extended_handshake_is_wellformed(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_send,
+    };
+    char msg[1000], *ptr = msg;
+    void *pc, *reg;
+    test_sender_t sender;
+
+    __sender_set(&sender,NULL,msg);
+    reg = pwp_extensions_new();
+    pwp_extensions_add(reg, "ut_metadata", NULL, NULL);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_capabilities(pc, PWP_CAP_EXTENSION);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    pwp_conn_set_extensions(pc, reg);
+
+    pwp_conn_send_extended_handshake(pc);
+    CuAssertTrue(tc, 2 + 24 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, PWP_MSGTYPE_EXTENDED == bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 0 == bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 0 == memcmp(ptr, "d1:md11:ut_metadatai1eee", 24));
+
+    pwp_conn_release(pc);
+    pwp_extensions_release(reg);
+}
+
+void TestPWP_upload_only_doesnt_become_interested(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_send,
+        .disconnect = __FUNC_disconnect,
+    };
+    char msg[1000], *ptr = msg;
+    void *pc;
+    test_sender_t sender;
+    chunkybar_t* sc;
+    msg_have_t have;
+
+    __sender_set(&sender,NULL,msg);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV | PC_IM_INTERESTED);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    sc = chunky_new(0);
+    pwp_conn_set_progress(pc,sc);
+    pwp_conn_set_upload_only(pc, 1);
+
+    /* we drop our interest */
+    pwp_conn_periodic(pc);
+    CuAssertTrue(tc, 0 == pwp_conn_im_interested(pc));
+    CuAssertTrue(tc, 1 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, PWP_MSGTYPE_UNINTERESTED == bitstream_read_byte(&ptr));
+
+    /* and don't regain it */
+    have.piece_idx = 1;
+    pwp_conn_have(pc, &have);
+    pwp_conn_periodic(pc);
+    CuAssertTrue(tc, 0 == pwp_conn_im_interested(pc));
+    CuAssertTrue(tc, 1 == sender.nsent_messages);
+    pwp_conn_release(pc);
+    chunky_free(sc);
+}
+
+void TestPWP_seed_to_seed_connection_is_redundant(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .disconnect = __FUNC_disconnect,
+    };
+    void *pc;
+    test_sender_t sender;
+    msg_extended_t ext;
+
+    __sender_set(&sender,NULL,NULL);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_capabilities(pc, PWP_CAP_EXTENSION | PWP_CAP_FAST);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+
+    /* peer is upload only */
+    ext.id = 0;
+    ext.data = "d1:md6:ut_pexi2ee11:upload_onlyi1ee";
+    ext.len = strlen(ext.data);
+    CuAssertTrue(tc, 1 == pwp_conn_extended(pc, &ext));
+    CuAssertTrue(tc, pwp_conn_flag_is_set(pc, PC_PEER_UPLOAD_ONLY));
+    CuAssertTrue(tc, 0 == pwp_conn_is_redundant(pc));
+    pwp_conn_set_upload_only(pc, 1);
+    CuAssertTrue(tc, 1 == pwp_conn_is_redundant(pc));
+    pwp_conn_release(pc);
+
+    /* peer has every piece */
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_capabilities(pc, PWP_CAP_FAST);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    pwp_conn_set_upload_only(pc, 1);
+    CuAssertTrue(tc, 0 == pwp_conn_is_redundant(pc));
+    pwp_conn_have_all(pc);
+    CuAssertTrue(tc, 1 == pwp_conn_is_redundant(pc));
+    CuAssertTrue(tc, 0 == sender.has_disconnected);
+    pwp_conn_release(pc);
+}
+
+static void __FUNC_peer_pieces_have(
+    void *udata,
+    void *peer __attribute__((__unused__)),
+    const uint32_t* pieces,
+    unsigned int npieces
+)
+{
+    test_sender_t * sender = udata;
+    unsigned int i;
+
+    sender->nhave_batches++;
+    for (i=0; i<npieces; i++)
+        chunky_mark_complete(sender->sc, pieces[i], 1);
+}
+
+void TestPWP_have_batch_is_one_update(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_send,
+        .disconnect = __FUNC_disconnect,
+        .peer_have_pieces = __FUNC_peer_pieces_have,
+    };
+    char msg[1000];
+    uint32_t pieces[] = { 3, 4, 5, 9 };
+    void *pc;
+    test_sender_t sender;
+    chunkybar_t* sc;
+
+    __sender_set(&sender,NULL,msg);
+    sender.sc = chunky_new(20);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    sc = chunky_new(0);
+    pwp_conn_set_progress(pc,sc);
+
+    pwp_conn_have_batch(pc, pieces, 4);
+    CuAssertTrue(tc, 1 == sender.nhave_batches);
+    CuAssertTrue(tc, 1 == chunky_have(sender.sc, 3, 3));
+    CuAssertTrue(tc, 1 == chunky_have(sender.sc, 9, 1));
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(pc, 4));
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(pc, 9));
+    CuAssertTrue(tc, 0 == pwp_conn_peer_has_piece(pc, 6));
+    CuAssertTrue(tc, 1 == pwp_conn_im_interested(pc));
+    pwp_conn_release(pc);
+    chunky_free(sc);
+    chunky_free(sender.sc);
+}
+
+void TestPWP_have_batch_with_bad_piece_disconnects(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .disconnect = __FUNC_disconnect,
+        .peer_have_pieces = __FUNC_peer_pieces_have,
+    };
+    uint32_t pieces[] = { 3, 20 };
+    void *pc;
+    test_sender_t sender;
+
+    __sender_set(&sender,NULL,NULL);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+
+    pwp_conn_have_batch(pc, pieces, 2);
+    CuAssertTrue(tc, 1 == sender.has_disconnected);
+    CuAssertTrue(tc, 0 == sender.nhave_batches);
+    pwp_conn_release(pc);
+}
+
+static void __giveback_blocks(
+        void* s,
+        void* peer __attribute__((__unused__)),
+        bt_block_t* blks,
+        unsigned int nblks)
+{
+    test_sender_t* sender = s;
+    sender->ngiveback_batches++;
+    sender->read_pos += nblks;
+}
+
+void TestPWP_read_chokemsg_gives_blocks_back_in_one_batch(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_MOCK_send,
+        .peer_giveback_block = __giveback_block,
+        .peer_giveback_blocks = __giveback_blocks,
+    };
+    void *pc;
+    test_sender_t sender;
+    bt_block_t blk;
+    int i;
+
+    __sender_set(&sender,NULL,NULL);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+
+    memset(&blk, 0, sizeof(bt_block_t));
+    blk.len = 5;
+    for (i=0; i<3; i++)
+    {
+        blk.piece_idx = i;
+        pwp_conn_request_block_from_peer(pc, &blk);
+    }
+    CuAssertTrue(tc, 3 == pwp_conn_get_npending_requests(pc));
+
+    pwp_conn_choke(pc);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_requests(pc));
+    CuAssertTrue(tc, 1 == sender.ngiveback_batches);
+    CuAssertTrue(tc, 3 == sender.read_pos);
+    pwp_conn_release(pc);
+}
+
+void TestPWP_read_bitfield_announces_pieces_in_one_batch(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_MOCK_send,
+        .peer_have_piece = __FUNC_peer_piece_have,
+        .peer_have_pieces = __FUNC_peer_pieces_have,
+    };
+    void *pc;
+    test_sender_t sender;
+    msg_bitfield_t bf;
+
+    __sender_set(&sender,NULL,NULL);
+    sender.sc = chunky_new(20);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+
+    bf.bf = bitfield_new(24);
+    bitfield_mark(bf.bf, 1);
+    bitfield_mark(bf.bf, 2);
+    bitfield_mark(bf.bf, 19);
+    pwp_conn_bitfield(pc, &bf);
+    CuAssertTrue(tc, 1 == sender.nhave_batches);
+    CuAssertTrue(tc, 1 == chunky_have(sender.sc, 1, 2));
+    CuAssertTrue(tc, 1 == chunky_have(sender.sc, 19, 1));
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(pc, 19));
+    CuAssertTrue(tc, 0 == pwp_conn_peer_has_piece(pc, 3));
+    bitfield_free(bf.bf);
+    pwp_conn_release(pc);
+    chunky_free(sender.sc);
+}
+
+void TestPWP_batched_callbacks_alone_receive_single_events(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_MOCK_send,
+        .disconnect = __FUNC_disconnect,
+        .peer_have_pieces = __FUNC_peer_pieces_have,
+        .peer_giveback_blocks = __giveback_blocks,
+    };
+    void *pc;
+    test_sender_t sender;
+    msg_have_t have;
+    bt_block_t blk;
+    chunkybar_t* sc;
+
+    memset(&blk, 0, sizeof(bt_block_t));
+    blk.piece_idx = 2;
+    blk.len = 5;
+
+    __sender_set(&sender,NULL,NULL);
+    sender.sc = chunky_new(20);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_capabilities(pc, PWP_CAP_FAST);
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    sc = chunky_new(0);
+    pwp_conn_set_progress(pc,sc);
+
+    have.piece_idx = 7;
+    pwp_conn_have(pc, &have);
+    CuAssertTrue(tc, 1 == sender.nhave_batches);
+    CuAssertTrue(tc, 1 == chunky_have(sender.sc, 7, 1));
+
+    /* a rejected block is still given back */
+    pwp_conn_request_block_from_peer(pc, &blk);
+    CuAssertTrue(tc, 1 == pwp_conn_reject(pc, &blk));
+    CuAssertTrue(tc, 1 == sender.ngiveback_batches);
+    CuAssertTrue(tc, 1 == sender.read_pos);
+    pwp_conn_release(pc);
+    chunky_free(sc);
+    chunky_free(sender.sc);
+}
+
+static void __FUNC_peer_have_all(
+    void *udata,
+    void *peer __attribute__((__unused__))
+)
+{
+    test_sender_t * sender = udata;
+    sender->nhave_alls++;
+}
+
+void TestPWP_read_have_all_is_one_callback(
+    CuTest * tc
+)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_MOCK_send,
+        .disconnect = __FUNC_disconnect,
+        .peer_have_piece = __FUNC_peer_piece_have,
+        .peer_have_pieces = __FUNC_peer_pieces_have,
+        .peer_have_all = __FUNC_peer_have_all,
+    };
+    void *pc;
+    test_sender_t sender;
+    chunkybar_t* sc;
+
+    __sender_set(&sender,NULL,NULL);
+    sender.sc = chunky_new(200000);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_state(pc, STATE_READY_TO_SENDRECV);
+    pwp_conn_set_capabilities(pc, PWP_CAP_FAST);
+    pwp_conn_set_piece_info(pc,200000,20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    sc = chunky_new(0);
+    pwp_conn_set_progress(pc,sc);
+
+    pwp_conn_have_all(pc);
+    CuAssertTrue(tc, 1 == sender.nhave_alls);
+    CuAssertTrue(tc, 0 == sender.nhave_batches);
+    CuAssertTrue(tc, 0 == chunky_get_num_chunks(sender.sc));
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(pc, 199999));
+    pwp_conn_release(pc);
+    chunky_free(sc);
+    chunky_free(sender.sc);
+}
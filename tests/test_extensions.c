@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include "pwp_extensions.h"
+
+static int __ext(void *udata, void *pc, const char *payload, unsigned int len)
+{
+    *(unsigned int*)udata = len;
+    return 1;
+}
+
+void TestPWP_extensions_handshake_is_sorted(
+    CuTest * tc
+)
+{
+    void *reg;
+    const char *hs;
+    unsigned int len;
+
+    reg = pwp_extensions_new();
+    CuAssertTrue(tc, 1 == pwp_extensions_add(reg, "ut_pex", NULL, NULL));
+    CuAssertTrue(tc, 2 == pwp_extensions_add(reg, "lt_donthave", NULL, NULL));
+    pwp_extensions_set_int(reg, "upload_only", 1);
+    pwp_extensions_set_int(reg, "reqq", 250);
+
+    hs = pwp_extensions_get_handshake(reg, &len);
+    CuAssertTrue(tc, len == strlen(
+        "d1:md11:lt_donthavei2e6:ut_pexi1ee4:reqqi250e11:upload_onlyi1ee"));
+    CuAssertTrue(tc, 0 == memcmp(hs,
+        "d1:md11:lt_donthavei2e6:ut_pexi1ee4:reqqi250e11:upload_onlyi1ee", len));
+
+    /* cached until changed */
+    CuAssertTrue(tc, hs == pwp_extensions_get_handshake(reg, &len));
+    pwp_extensions_release(reg);
+}
+
+void TestPWP_extensions_dispatch_by_id(
+    CuTest * tc
+)
+{
+    void *reg;
+    unsigned int got = 0;
+    int id;
+
+    reg = pwp_extensions_new();
+    id = pwp_extensions_add(reg, "ut_metadata", __ext, &got);
+    CuAssertTrue(tc, 0 == pwp_extensions_add(reg, "ut_metadata", __ext, &got));
+    CuAssertTrue(tc, id == pwp_extensions_get_id(reg, "ut_metadata", 11));
+    CuAssertTrue(tc, 1 == pwp_extensions_dispatch(reg, NULL, id, "abc", 3));
+    CuAssertTrue(tc, 3 == got);
+
+    /* unknown ids are ignored */
+    CuAssertTrue(tc, 1 == pwp_extensions_dispatch(reg, NULL, id + 1, "abcd", 4));
+    CuAssertTrue(tc, 3 == got);
+    pwp_extensions_release(reg);
+}
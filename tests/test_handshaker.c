@@ -9,6 +9,7 @@
 #include "pwp_connection.h"
 #include "pwp_handshaker.h"
 #include "bitstream.h"
+#include "chunkybar.h"
 
 static char* __mock_infohash = "abcdef12345678900000";
 static char* __mock_their_peer_id = "00000000000000000000";
@@ -16,6 +17,39 @@ static char* __mock_my_peer_id = "00000000000000000001";
 
 #define PROTOCOL_NAME "BitTorrent protocol"
 
+/**
+ * Flip endianess
+ **/
+static uint32_t fe(uint32_t i)
+{
+    uint32_t o;
+    char *c = (char *)&i;
+    char *p = (char *)&o;
+
+    p[0] = c[3];
+    p[1] = c[2];
+    p[2] = c[1];
+    p[3] = c[0];
+
+    return o;
+}
+
+typedef struct {
+    int nsends;
+    int len;
+    char data[1000];
+} fake_sender_t;
+
+static int __send(void *callee, const void *udata __attribute__((__unused__)),
+        const void *send_data, const int len)
+{
+    fake_sender_t* s = callee;
+    memcpy(s->data + s->len, send_data, len);
+    s->len += len;
+    s->nsends += 1;
+    return 1;
+}
+
 /**
  * Note this is not true as of 20130430. Bitfields are optional
  *
@@ -260,3 +294,253 @@ void TestPWP_handshake_success_from_good_handshake(
     CuAssertTrue(tc, 1 == ret);
 }
 
+
+void TestPWP_handshake_success_when_read_in_small_chunks(
+    CuTest * tc
+)
+{
+    void *hs;
+    char msg[1000], *ptr = msg, *m = msg;
+    unsigned int ii, len;
+    int ret = 0;
+    pwp_handshake_t* h;
+
+    /* handshake */
+    bitstream_write_byte(&ptr, strlen(PROTOCOL_NAME)); /* pn len */
+    bitstream_write_string(&ptr, PROTOCOL_NAME, strlen(PROTOCOL_NAME)); /* pn */
+    for (ii=0;ii<8;ii++)
+        bitstream_write_byte(&ptr, 0);        /*  reserved */
+    bitstream_write_string(&ptr, __mock_infohash, 20); /* ih */
+    bitstream_write_string(&ptr, (char*)__mock_their_peer_id, 20); /* pi */
+
+    /* setup */
+    hs = pwp_handshaker_new((char*)__mock_infohash,
+            (char*)__mock_my_peer_id);
+
+    /* receive 3 bytes at a time */
+    for (ii = 0; ii < 1 + strlen(PROTOCOL_NAME) + 8 + 20 + 20; ii += len)
+    {
+        len = 3;
+        ret = pwp_handshaker_dispatch_from_buffer(hs, (const char**)&m, &len);
+        len = 3 - len;
+        if (ret != 0)
+            break;
+    }
+    CuAssertTrue(tc, 1 == ret);
+
+    h = pwp_handshaker_get_handshake(hs);
+    CuAssertTrue(tc, 0 == memcmp(h->infohash, __mock_infohash, 20));
+    CuAssertTrue(tc, 0 == memcmp(h->peerid, __mock_their_peer_id, 20));
+    pwp_handshaker_release(hs);
+}
+
+void TestPWP_handshake_doesnt_consume_bytes_past_handshake(
+    CuTest * tc
+)
+{
+    void *hs;
+    char msg[1000], *ptr = msg, *m = msg;
+    unsigned int ii, len;
+    int ret;
+
+    /* handshake */
+    bitstream_write_byte(&ptr, strlen(PROTOCOL_NAME)); /* pn len */
+    bitstream_write_string(&ptr, PROTOCOL_NAME, strlen(PROTOCOL_NAME)); /* pn */
+    for (ii=0;ii<8;ii++)
+        bitstream_write_byte(&ptr, 0);        /*  reserved */
+    bitstream_write_string(&ptr, __mock_infohash, 20); /* ih */
+    bitstream_write_string(&ptr, (char*)__mock_their_peer_id, 20); /* pi */
+    /* first bytes of the next message */
+    bitstream_write_byte(&ptr, 0);
+    bitstream_write_byte(&ptr, 0);
+
+    /* setup */
+    hs = pwp_handshaker_new((char*)__mock_infohash,
+            (char*)__mock_my_peer_id);
+
+    /* receive */
+    len = 1 + strlen(PROTOCOL_NAME) + 8 + 20 + 20 + 2;
+    ret = pwp_handshaker_dispatch_from_buffer(hs, (const char**)&m, &len);
+    CuAssertTrue(tc, 1 == ret);
+    CuAssertTrue(tc, 2 == len);
+    CuAssertTrue(tc, m == msg + 68);
+    pwp_handshaker_release(hs);
+}
+
+void TestPWP_handshake_registry_matches_torrent_by_infohash(
+    CuTest * tc
+)
+{
+    void *hs, *reg;
+    char msg[1000], *ptr = msg, *m = msg;
+    unsigned int ii, len;
+    int ret, t1, t2, t3;
+
+    /* handshake */
+    bitstream_write_byte(&ptr, strlen(PROTOCOL_NAME)); /* pn len */
+    bitstream_write_string(&ptr, PROTOCOL_NAME, strlen(PROTOCOL_NAME)); /* pn */
+    for (ii=0;ii<8;ii++)
+        bitstream_write_byte(&ptr, 0);        /*  reserved */
+    bitstream_write_string(&ptr, "abcdef12345678900002", 20); /* ih */
+    bitstream_write_string(&ptr, (char*)__mock_their_peer_id, 20); /* pi */
+
+    /* setup */
+    reg = pwp_handshaker_registry_new();
+    pwp_handshaker_registry_add(reg, "abcdef12345678900001", &t1);
+    pwp_handshaker_registry_add(reg, "abcdef12345678900002", &t2);
+    pwp_handshaker_registry_add(reg, "abcdef12345678900003", &t3);
+    hs = pwp_handshaker_new_from_registry(reg, (char*)__mock_my_peer_id);
+    CuAssertTrue(tc, NULL == pwp_handshaker_get_torrent(hs));
+
+    /* receive */
+    len = 1 + strlen(PROTOCOL_NAME) + 8 + 20 + 20;
+    ret = pwp_handshaker_dispatch_from_buffer(hs, (const char**)&m, &len);
+    CuAssertTrue(tc, 1 == ret);
+    CuAssertTrue(tc, &t2 == pwp_handshaker_get_torrent(hs));
+    pwp_handshaker_release(hs);
+    pwp_handshaker_registry_free(reg);
+}
+
+void TestPWP_handshake_registry_disconnects_if_infohash_is_unknown(
+    CuTest * tc
+)
+{
+    void *hs, *reg;
+    char msg[1000], *ptr = msg, *m = msg;
+    unsigned int ii, len;
+    int ret, t1;
+
+    /* handshake */
+    bitstream_write_byte(&ptr, strlen(PROTOCOL_NAME)); /* pn len */
+    bitstream_write_string(&ptr, PROTOCOL_NAME, strlen(PROTOCOL_NAME)); /* pn */
+    for (ii=0;ii<8;ii++)
+        bitstream_write_byte(&ptr, 0);        /*  reserved */
+    bitstream_write_string(&ptr, "abcdef12345678900002", 20); /* ih */
+    bitstream_write_string(&ptr, (char*)__mock_their_peer_id, 20); /* pi */
+
+    /* setup */
+    reg = pwp_handshaker_registry_new();
+    pwp_handshaker_registry_add(reg, "abcdef12345678900001", &t1);
+    hs = pwp_handshaker_new_from_registry(reg, (char*)__mock_my_peer_id);
+
+    /* receive */
+    len = 1 + strlen(PROTOCOL_NAME) + 8 + 20 + 20;
+    ret = pwp_handshaker_dispatch_from_buffer(hs, (const char**)&m, &len);
+    CuAssertTrue(tc, -1 == ret);
+    pwp_handshaker_release(hs);
+    pwp_handshaker_registry_free(reg);
+}
+
+void TestPWP_handshake_template_is_same_as_sent_handshake(
+    CuTest * tc
+)
+{
+    fake_sender_t sender;
+    pwp_handshake_t hs;
+
+    memset(&sender, 0, sizeof(sender));
+    pwp_handshake_init(&hs, __mock_infohash, __mock_my_peer_id);
+    pwp_send_handshake(&sender, NULL, __send,
+            (char*)__mock_infohash, (char*)__mock_my_peer_id);
+    CuAssertTrue(tc, 68 == sender.len);
+    CuAssertTrue(tc, 0 == memcmp(&hs, sender.data, 68));
+}
+
+void TestPWP_handshake_and_bitfield_are_sent_together(
+    CuTest * tc
+)
+{
+    fake_sender_t sender;
+    pwp_handshake_t hs;
+    chunkybar_t* sc;
+    char* ptr;
+
+    memset(&sender, 0, sizeof(sender));
+    sc = chunky_new(20);
+    chunky_mark_complete(sc, 0, 20);
+    pwp_handshake_init(&hs, __mock_infohash, __mock_my_peer_id);
+    pwp_send_handshake_and_bitfield(&sender, NULL, __send, &hs, 20, sc);
+
+    CuAssertTrue(tc, 1 == sender.nsends);
+    CuAssertTrue(tc, 68 + 4 + 1 + 3 == sender.len);
+    CuAssertTrue(tc, 0 == memcmp(&hs, sender.data, 68));
+    ptr = sender.data + 68;
+    CuAssertTrue(tc, 4 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, 5 == bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 0xFF == (unsigned char)bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 0xFF == (unsigned char)bitstream_read_byte(&ptr));
+    CuAssertTrue(tc, 0xF0 == (unsigned char)bitstream_read_byte(&ptr));
+    chunky_free(sc);
+}
+
+void TestPWP_handshake_and_have_all_are_sent_together(
+    CuTest * tc
+)
+{
+    fake_sender_t sender;
+    pwp_handshake_t hs;
+    char* ptr;
+
+    memset(&sender, 0, sizeof(sender));
+    pwp_handshake_init(&hs, __mock_infohash, __mock_my_peer_id);
+    pwp_handshake_set_capabilities(&hs, PWP_CAP_FAST);
+    pwp_send_handshake_and_have_all_or_none(&sender, NULL, __send, &hs,
+            PWP_MSGTYPE_HAVE_ALL);
+
+    CuAssertTrue(tc, 1 == sender.nsends);
+    CuAssertTrue(tc, 68 + 5 == sender.len);
+    CuAssertTrue(tc, 0 == memcmp(&hs, sender.data, 68));
+    ptr = sender.data + 68;
+    CuAssertTrue(tc, 1 == fe(bitstream_read_uint32(&ptr)));
+    CuAssertTrue(tc, PWP_MSGTYPE_HAVE_ALL == bitstream_read_byte(&ptr));
+
+    memset(&sender, 0, sizeof(sender));
+    pwp_send_handshake_and_have_all_or_none(&sender, NULL, __send, &hs,
+            PWP_MSGTYPE_HAVE_NONE);
+    CuAssertTrue(tc, 1 == sender.nsends);
+    CuAssertTrue(tc, 68 + 5 == sender.len);
+    CuAssertTrue(tc, PWP_MSGTYPE_HAVE_NONE == sender.data[68 + 4]);
+}
+
+void TestPWP_handshake_capabilities_are_set_in_reserved_bytes(
+    CuTest * tc
+)
+{
+    pwp_handshake_t hs;
+
+    pwp_handshake_init(&hs, __mock_infohash, __mock_my_peer_id);
+    pwp_handshake_set_capabilities(&hs,
+            PWP_CAP_DHT | PWP_CAP_FAST | PWP_CAP_EXTENSION);
+    CuAssertTrue(tc, 0x10 == hs.reserved[5]);
+    CuAssertTrue(tc, 0x05 == hs.reserved[7]);
+    CuAssertTrue(tc, (PWP_CAP_DHT | PWP_CAP_FAST | PWP_CAP_EXTENSION) ==
+            pwp_handshake_get_capabilities(&hs));
+
+    pwp_handshake_set_capabilities(&hs, PWP_CAP_FAST);
+    CuAssertTrue(tc, 0 == hs.reserved[5]);
+    CuAssertTrue(tc, 0x04 == hs.reserved[7]);
+}
+
+void TestPWP_handshake_negotiates_capabilities_both_sides_support(
+    CuTest * tc
+)
+{
+    void *hs;
+    pwp_handshake_t msg;
+    const char *m = (const char*)&msg;
+    unsigned int len = sizeof(msg);
+
+    /* peer supports the fast extension and extension protocol */
+    pwp_handshake_init(&msg, __mock_infohash, __mock_their_peer_id);
+    pwp_handshake_set_capabilities(&msg, PWP_CAP_FAST | PWP_CAP_EXTENSION);
+
+    /* we support DHT and the fast extension */
+    hs = pwp_handshaker_new((char*)__mock_infohash,
+            (char*)__mock_my_peer_id);
+    pwp_handshaker_set_capabilities(hs, PWP_CAP_DHT | PWP_CAP_FAST);
+    CuAssertTrue(tc, 0 == pwp_handshaker_get_capabilities(hs));
+
+    CuAssertTrue(tc, 1 == pwp_handshaker_dispatch_from_buffer(hs, &m, &len));
+    CuAssertTrue(tc, PWP_CAP_FAST == pwp_handshaker_get_capabilities(hs));
+    pwp_handshaker_release(hs);
+}
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/uio.h>
 #include "CuTest.h"
 
 #include "bitfield.h"
@@ -21,12 +22,23 @@ typedef struct {
         msg_bitfield_t bitfield;
         bt_block_t request;
         bt_block_t cancel;
+        bt_block_t reject;
         msg_piece_t piece;
+        msg_extended_t ext;
     };
 
+    /* copy of last extended payload */
+    char ext_data[64];
+
+    /* number of pieces received through pwp_conn_have_batch */
+    int nhaves_batched;
+
     /* flag if custom handler was used */
     int custom_handler;
 
+    /* returned by pwp_conn_get_num_pieces */
+    int num_pieces;
+
 } fake_pc_t;
 
 /**
@@ -83,6 +95,22 @@ void pwp_conn_have(pwp_conn_t* pco, msg_have_t* have)
     memcpy(&pc->have,have,sizeof(msg_have_t));
 }
 
+void pwp_conn_have_batch(pwp_conn_t* pco,
+        const uint32_t* pieces,
+        unsigned int npieces)
+{
+    fake_pc_t* pc = (void*)pco;
+    pc->mtype = PWP_MSGTYPE_HAVE;
+    pc->have.piece_idx = pieces[npieces - 1];
+    pc->nhaves_batched += npieces;
+}
+
+int pwp_conn_get_num_pieces(pwp_conn_t* pco)
+{
+    fake_pc_t* pc = (void*)pco;
+    return pc->num_pieces;
+}
+
 void pwp_conn_bitfield(pwp_conn_t* pco, msg_bitfield_t* bitfield)
 {
     fake_pc_t* pc = (void*)pco;
@@ -114,11 +142,54 @@ int pwp_conn_piece(pwp_conn_t* pco, msg_piece_t *piece)
     return 1;
 }
 
+void pwp_conn_have_all(pwp_conn_t* pco)
+{
+    fake_pc_t* pc = (void*)pco;
+    pc->mtype = PWP_MSGTYPE_HAVE_ALL;
+}
+
+void pwp_conn_have_none(pwp_conn_t* pco)
+{
+    fake_pc_t* pc = (void*)pco;
+    pc->mtype = PWP_MSGTYPE_HAVE_NONE;
+}
+
+void pwp_conn_suggest(pwp_conn_t* pco, msg_have_t* suggest)
+{
+    fake_pc_t* pc = (void*)pco;
+    pc->mtype = PWP_MSGTYPE_SUGGEST;
+    memcpy(&pc->have,suggest,sizeof(msg_have_t));
+}
+
+void pwp_conn_allowed_fast(pwp_conn_t* pco, msg_have_t* allowed)
+{
+    fake_pc_t* pc = (void*)pco;
+    pc->mtype = PWP_MSGTYPE_ALLOWED_FAST;
+    memcpy(&pc->have,allowed,sizeof(msg_have_t));
+}
+
+int pwp_conn_extended(pwp_conn_t* pco, msg_extended_t* ext)
+{
+    fake_pc_t* pc = (void*)pco;
+    pc->mtype = PWP_MSGTYPE_EXTENDED;
+    memcpy(&pc->ext,ext,sizeof(msg_extended_t));
+    memcpy(pc->ext_data,ext->data,ext->len);
+    return 1;
+}
+
+int pwp_conn_reject(pwp_conn_t* pco, bt_block_t *reject)
+{
+    fake_pc_t* pc = (void*)pco;
+    pc->mtype = PWP_MSGTYPE_REJECT;
+    memcpy(&pc->reject,reject,sizeof(bt_block_t));
+    return 1;
+}
+
 void TestPWP_keepalive(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
     char* ptr;
     void* mh;
@@ -136,7 +207,7 @@ void TestPWP_choke(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
     char* ptr;
     void* mh;
@@ -155,7 +226,7 @@ void TestPWP_unchoke(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
     char* ptr;
     void* mh;
@@ -174,7 +245,7 @@ void TestPWP_interested(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
     char* ptr;
     void* mh;
@@ -193,7 +264,7 @@ void TestPWP_uninterested(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
     char* ptr;
     void* mh;
@@ -212,7 +283,7 @@ void TestPWP_have(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
     char* ptr;
     void* mh;
@@ -229,11 +300,42 @@ void TestPWP_have(
     pwp_msghandler_release(mh);
 }
 
+void TestPWP_run_of_haves_is_batched(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+    int i;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    for (i=0; i<4; i++)
+    {
+        bitstream_write_uint32(&ptr, fe(5));
+        bitstream_write_byte(&ptr,PWP_MSGTYPE_HAVE);
+        bitstream_write_uint32(&ptr, fe(10 + i));
+    }
+
+    /* the last have is incomplete so it isn't part of the batch */
+    pwp_msghandler_dispatch_from_buffer(mh, data, 9 * 3 + 2);
+    CuAssertTrue(tc, 3 == pc.nhaves_batched);
+    CuAssertTrue(tc, 12 == pc.have.piece_idx);
+
+    pwp_msghandler_dispatch_from_buffer(mh, data + 9 * 3 + 2, 7);
+    CuAssertTrue(tc, 3 == pc.nhaves_batched);
+    CuAssertTrue(tc, 13 == pc.have.piece_idx);
+    pwp_msghandler_release(mh);
+}
+
 void TestPWP_request(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
     char* ptr;
     void* mh;
@@ -254,11 +356,38 @@ void TestPWP_request(
     pwp_msghandler_release(mh);
 }
 
+void TestPWP_request_read_one_byte_at_a_time(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+    int i;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    bitstream_write_uint32(&ptr, fe(13));
+    bitstream_write_byte(&ptr, PWP_MSGTYPE_REQUEST);
+    bitstream_write_uint32(&ptr, fe(0x01020304));
+    bitstream_write_uint32(&ptr, fe(2));
+    bitstream_write_uint32(&ptr, fe(3));
+    for (i=0; i<4 + 13; i++)
+        pwp_msghandler_dispatch_from_buffer(mh, data + i, 1);
+    CuAssertTrue(tc, PWP_MSGTYPE_REQUEST == pc.mtype);
+    CuAssertTrue(tc, 0x01020304 == pc.request.piece_idx);
+    CuAssertTrue(tc, 2 == pc.request.offset);
+    CuAssertTrue(tc, 3 == pc.request.len);
+    pwp_msghandler_release(mh);
+}
+
 void TestPWP_cancel(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
     char* ptr;
     void* mh;
@@ -279,11 +408,279 @@ void TestPWP_cancel(
     pwp_msghandler_release(mh);
 }
 
+void TestPWP_have_all(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    mh = pwp_msghandler_new(&pc);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_HAVE_ALL);
+    pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1);
+    CuAssertTrue(tc, PWP_MSGTYPE_HAVE_ALL == pc.mtype);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_have_none(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    mh = pwp_msghandler_new(&pc);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_HAVE_NONE);
+    pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1);
+    CuAssertTrue(tc, PWP_MSGTYPE_HAVE_NONE == pc.mtype);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_reject(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    mh = pwp_msghandler_new(&pc);
+    bitstream_write_uint32(&ptr, fe(13));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_REJECT);
+    bitstream_write_uint32(&ptr, fe(123));
+    bitstream_write_uint32(&ptr, fe(456));
+    bitstream_write_uint32(&ptr, fe(789));
+    pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1 + 4 + 4 + 4);
+    CuAssertTrue(tc, PWP_MSGTYPE_REJECT == pc.mtype);
+    CuAssertTrue(tc, 123 == pc.reject.piece_idx);
+    CuAssertTrue(tc, 456 == pc.reject.offset);
+    CuAssertTrue(tc, 789 == pc.reject.len);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_suggest(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    mh = pwp_msghandler_new(&pc);
+    bitstream_write_uint32(&ptr, fe(5));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_SUGGEST);
+    bitstream_write_uint32(&ptr, fe(666));
+    pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1 + 4);
+    CuAssertTrue(tc, PWP_MSGTYPE_SUGGEST == pc.mtype);
+    CuAssertTrue(tc, 666 == pc.have.piece_idx);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_allowed_fast(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    mh = pwp_msghandler_new(&pc);
+    bitstream_write_uint32(&ptr, fe(5));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_ALLOWED_FAST);
+    bitstream_write_uint32(&ptr, fe(666));
+    pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1 + 4);
+    CuAssertTrue(tc, PWP_MSGTYPE_ALLOWED_FAST == pc.mtype);
+    CuAssertTrue(tc, 666 == pc.have.piece_idx);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_extended_doesnt_copy_contiguous_payload(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    mh = pwp_msghandler_new(&pc);
+    bitstream_write_uint32(&ptr, fe(2 + 5));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_EXTENDED);
+    bitstream_write_byte(&ptr,3);
+    memcpy(ptr, "hello", 5);
+    pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 2 + 5);
+    CuAssertTrue(tc, PWP_MSGTYPE_EXTENDED == pc.mtype);
+    CuAssertTrue(tc, 3 == pc.ext.id);
+    CuAssertTrue(tc, 5 == pc.ext.len);
+    CuAssertTrue(tc, data + 6 == pc.ext.data);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_extended_reassembles_split_payload(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    bitstream_write_uint32(&ptr, fe(2 + 5));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_EXTENDED);
+    bitstream_write_byte(&ptr,3);
+    memcpy(ptr, "hello", 5);
+    pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 2 + 2);
+    CuAssertTrue(tc, 0 == pc.mtype);
+    pwp_msghandler_dispatch_from_buffer(mh, data + 8, 3);
+    CuAssertTrue(tc, PWP_MSGTYPE_EXTENDED == pc.mtype);
+    CuAssertTrue(tc, 5 == pc.ext.len);
+    CuAssertTrue(tc, 0 == memcmp(pc.ext_data, "hello", 5));
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_unknown_msg_type_disconnects(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    bitstream_write_uint32(&ptr, fe(5));
+    bitstream_write_byte(&ptr, 200);
+    bitstream_write_uint32(&ptr, fe(1));
+    CuAssertTrue(tc, 0 == pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1 + 4));
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_huge_length_disconnects_before_type_is_read(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    bitstream_write_uint32(&ptr, fe(0xFFFFFFFF));
+    CuAssertTrue(tc, 0 == pwp_msghandler_dispatch_from_buffer(mh, data, 4));
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_fixed_size_msg_with_wrong_length_disconnects(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    bitstream_write_uint32(&ptr, fe(14));
+    bitstream_write_byte(&ptr, PWP_MSGTYPE_REQUEST);
+    CuAssertTrue(tc, 0 == pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1));
+    CuAssertTrue(tc, 0 == pc.mtype);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_bitfield_bigger_than_num_pieces_disconnects(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    pc.num_pieces = 8;
+    bitstream_write_uint32(&ptr, fe(3));
+    bitstream_write_byte(&ptr, PWP_MSGTYPE_BITFIELD);
+    bitstream_write_byte(&ptr, 0xff);
+    bitstream_write_byte(&ptr, 0xff);
+    CuAssertTrue(tc, 0 == pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1 + 2));
+    CuAssertTrue(tc, 0 == pc.mtype);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_piece_bigger_than_max_block_len_disconnects(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    pwp_msghandler_set_max_block_len(mh, 4);
+    bitstream_write_uint32(&ptr, fe(9 + 5));
+    bitstream_write_byte(&ptr, PWP_MSGTYPE_PIECE);
+    CuAssertTrue(tc, 0 == pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1));
+    CuAssertTrue(tc, 0 == pc.mtype);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_length_prefix_bigger_than_limits_disconnects(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    pc.num_pieces = 8;
+    pwp_msghandler_set_max_block_len(mh, 16);
+    pwp_msghandler_set_max_msg_len(mh, 16);
+
+    /* rejected before the message type arrives */
+    bitstream_write_uint32(&ptr, fe(100));
+    CuAssertTrue(tc, 0 == pwp_msghandler_dispatch_from_buffer(mh, data, 4));
+    CuAssertTrue(tc, 0 == pc.mtype);
+    pwp_msghandler_release(mh);
+}
+
 void TestPWP_bitfield(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
 
     /* bitfield */
@@ -304,7 +701,7 @@ void TestPWP_piece(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
     char* ptr;
     void* mh;
@@ -339,7 +736,7 @@ void TestPWP_piece_halfread(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
     char* ptr;
     void* mh;
@@ -380,11 +777,138 @@ void TestPWP_piece_halfread(
     pwp_msghandler_release(mh);
 }
 
+void TestPWP_coalesced_piece_is_delivered_once_whole(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    pwp_msghandler_set_coalesce_pieces(mh, 1);
+    bitstream_write_uint32(&ptr, fe(9 + 10));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_PIECE);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_uint32(&ptr, fe(2));
+    memcpy(ptr, "test msg3", 10);
+
+    /* header and half of the block */
+    pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1 + 4 + 4 + 5);
+    CuAssertTrue(tc, 0 == pc.mtype);
+
+    /* rest of the block */
+    pwp_msghandler_dispatch_from_buffer(mh, data + 4 + 1 + 4 + 4 + 5, 5);
+    CuAssertTrue(tc, PWP_MSGTYPE_PIECE == pc.mtype);
+    CuAssertTrue(tc, 1 == pc.piece.blk.piece_idx);
+    CuAssertTrue(tc, 2 == pc.piece.blk.offset);
+    CuAssertTrue(tc, 10 == pc.piece.blk.len);
+    CuAssertTrue(tc, 0 == strcmp("test msg3", pc.piece.data));
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_coalesced_piece_doesnt_copy_contiguous_block(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    pwp_msghandler_set_coalesce_pieces(mh, 1);
+    bitstream_write_uint32(&ptr, fe(9 + 10));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_PIECE);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_uint32(&ptr, fe(2));
+    memcpy(ptr, "test msg4", 10);
+
+    /* the split header doesn't stop the block being passed through */
+    pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1 + 2);
+    pwp_msghandler_dispatch_from_buffer(mh, data + 4 + 1 + 2, 6 + 10);
+    CuAssertTrue(tc, PWP_MSGTYPE_PIECE == pc.mtype);
+    CuAssertTrue(tc, 10 == pc.piece.blk.len);
+    CuAssertTrue(tc, ptr == pc.piece.data);
+    pwp_msghandler_release(mh);
+}
+
+static void* __piece_dest(void* udata, void* pc, const bt_block_t* blk)
+{
+    return 10 == blk->len ? udata : NULL;
+}
+
+void TestPWP_piece_payload_is_written_to_piece_dest(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100], dest[10], *ptr, *d;
+    void* mh;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    pwp_msghandler_set_piece_dest(mh, __piece_dest, dest);
+    bitstream_write_uint32(&ptr, fe(9 + 10));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_PIECE);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_uint32(&ptr, fe(2));
+    memcpy(ptr, "test", 4);
+
+    /* header and the start of the payload */
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1 + 4 + 4 + 4));
+    CuAssertTrue(tc, 0 == pc.mtype);
+    CuAssertTrue(tc, 6 == pwp_msghandler_get_piece_dest(mh, &d));
+    CuAssertTrue(tc, d == dest + 4);
+
+    /* the rest is read straight into the destination */
+    memcpy(d, " msg5", 6);
+    CuAssertTrue(tc, 1 == pwp_msghandler_piece_dest_written(mh, 6));
+    CuAssertTrue(tc, PWP_MSGTYPE_PIECE == pc.mtype);
+    CuAssertTrue(tc, 1 == pc.piece.blk.piece_idx);
+    CuAssertTrue(tc, 2 == pc.piece.blk.offset);
+    CuAssertTrue(tc, 10 == pc.piece.blk.len);
+    CuAssertTrue(tc, dest == pc.piece.data);
+    CuAssertTrue(tc, 0 == strcmp("test msg5", dest));
+    CuAssertTrue(tc, 0 == pwp_msghandler_get_piece_dest(mh, &d));
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_piece_without_dest_is_received_as_usual(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100], dest[10], *ptr, *d;
+    void* mh;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    pwp_msghandler_set_piece_dest(mh, __piece_dest, dest);
+    bitstream_write_uint32(&ptr, fe(9 + 4));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_PIECE);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_uint32(&ptr, fe(2));
+    memcpy(ptr, "abcd", 4);
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1 + 4 + 4 + 4));
+    CuAssertTrue(tc, PWP_MSGTYPE_PIECE == pc.mtype);
+    CuAssertTrue(tc, ptr == pc.piece.data);
+    CuAssertTrue(tc, 0 == pwp_msghandler_get_piece_dest(mh, &d));
+    pwp_msghandler_release(mh);
+}
+
 void TestPWP_two_pieces(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
     char* ptr;
     void* mh;
@@ -448,7 +972,7 @@ void TestPWP_custom_handler(
     CuTest * tc
 )
 {
-    fake_pc_t pc;
+    fake_pc_t pc = { 0 };
     char data[100];
     char* ptr;
     void* mh;
@@ -470,3 +994,295 @@ void TestPWP_custom_handler(
 }
 
 
+
+void TestPWP_custom_handlers_skip_fast_extension_ids(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+    pwp_msghandler_item_t handlers[5] = {
+        { NULL, NULL }, { NULL, NULL }, { NULL, NULL }, { NULL, NULL },
+        { __faux_handler, &pc }
+    };
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new2(&pc, handlers, 5, 100);
+
+    /* the fifth custom handler comes after the fast extension's ids */
+    bitstream_write_uint32(&ptr, fe(5));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_ALLOWED_FAST+1);
+    bitstream_write_uint32(&ptr, fe(123));
+    pwp_msghandler_dispatch_from_buffer(mh, data, 4 + 1 + 4);
+    CuAssertTrue(tc, 1 == pc.custom_handler);
+    pwp_msghandler_release(mh);
+}
+
+typedef struct {
+    int ncalls;
+    unsigned int offset;
+    unsigned int len;
+    unsigned int total;
+    char data[64];
+} fake_frame_t;
+
+static int __framed(void* udata, void* pc, const char* payload,
+        unsigned int len)
+{
+    fake_frame_t* f = udata;
+    f->ncalls++;
+    f->len = len;
+    memcpy(f->data, payload, len);
+    return 1;
+}
+
+static int __streamed(void* udata, void* pc, unsigned int offset,
+        const char* data, unsigned int len, unsigned int total)
+{
+    fake_frame_t* f = udata;
+    f->ncalls++;
+    f->offset = offset;
+    f->len = len;
+    f->total = total;
+    memcpy(f->data + offset, data, len);
+    return 1;
+}
+
+void TestPWP_framed_handler_receives_whole_message_once(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    fake_frame_t f;
+    char data[100];
+    char* ptr;
+    void* mh;
+    pwp_msghandler_item_t handlers = {
+        .framed = __framed, .udata = &f
+    };
+
+    ptr = data;
+    memset(&f, 0, sizeof(f));
+    mh = pwp_msghandler_new2(&pc, &handlers, 1, 100);
+    bitstream_write_uint32(&ptr, fe(1 + 6));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_CANCEL+1);
+    memcpy(ptr, "framed", 6);
+
+    /* split across three reads */
+    pwp_msghandler_dispatch_from_buffer(mh, data, 3);
+    pwp_msghandler_dispatch_from_buffer(mh, data + 3, 4);
+    CuAssertTrue(tc, 0 == f.ncalls);
+    pwp_msghandler_dispatch_from_buffer(mh, data + 7, 4);
+    CuAssertTrue(tc, 1 == f.ncalls);
+    CuAssertTrue(tc, 6 == f.len);
+    CuAssertTrue(tc, 0 == memcmp(f.data, "framed", 6));
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_streamed_handler_receives_offsets(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    fake_frame_t f;
+    char data[100];
+    char* ptr;
+    void* mh;
+    pwp_msghandler_item_t handlers = {
+        .streamed = __streamed, .udata = &f
+    };
+
+    ptr = data;
+    memset(&f, 0, sizeof(f));
+    mh = pwp_msghandler_new2(&pc, &handlers, 1, 100);
+    bitstream_write_uint32(&ptr, fe(1 + 6));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_CANCEL+1);
+    memcpy(ptr, "stream", 6);
+    ptr += 6;
+    bitstream_write_uint32(&ptr, fe(0));
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_CHOKE);
+
+    pwp_msghandler_dispatch_from_buffer(mh, data, 7);
+    CuAssertTrue(tc, 1 == f.ncalls);
+    CuAssertTrue(tc, 0 == f.offset);
+    CuAssertTrue(tc, 2 == f.len);
+    CuAssertTrue(tc, 6 == f.total);
+
+    /* the rest of the message; followed by another message */
+    pwp_msghandler_dispatch_from_buffer(mh, data + 7, 4 + 4 + 5);
+    CuAssertTrue(tc, 2 == f.ncalls);
+    CuAssertTrue(tc, 2 == f.offset);
+    CuAssertTrue(tc, 4 == f.len);
+    CuAssertTrue(tc, 0 == memcmp(f.data, "stream", 6));
+    CuAssertTrue(tc, PWP_MSGTYPE_CHOKE == pc.mtype);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_dispatch_from_iovec_reads_across_segments(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100], *ptr;
+    struct iovec iov[3];
+    void* mh;
+    unsigned int consumed;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    bitstream_write_uint32(&ptr, fe(5));
+    bitstream_write_byte(&ptr, PWP_MSGTYPE_HAVE);
+    bitstream_write_uint32(&ptr, fe(7));
+    bitstream_write_uint32(&ptr, fe(13));
+    bitstream_write_byte(&ptr, PWP_MSGTYPE_REQUEST);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_uint32(&ptr, fe(2));
+    bitstream_write_uint32(&ptr, fe(3));
+
+    /* segments split both messages */
+    iov[0].iov_base = data;
+    iov[0].iov_len = 7;
+    iov[1].iov_base = data + 7;
+    iov[1].iov_len = 10;
+    iov[2].iov_base = data + 17;
+    iov[2].iov_len = (ptr - data) - 17;
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_iovec(mh, iov, 3,
+                &consumed));
+    CuAssertTrue(tc, (unsigned int)(ptr - data) == consumed);
+    CuAssertTrue(tc, PWP_MSGTYPE_REQUEST == pc.mtype);
+    CuAssertTrue(tc, 1 == pc.request.piece_idx);
+    CuAssertTrue(tc, 2 == pc.request.offset);
+    CuAssertTrue(tc, 3 == pc.request.len);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_dispatch_from_iovec_stops_at_budget(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100], *ptr;
+    struct iovec iov[2];
+    void* mh;
+    unsigned int consumed;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new2(&pc, NULL, 0, 0);
+    pwp_msghandler_set_max_workload_msgs(mh, 2);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_INTERESTED);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_UNCHOKE);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_CHOKE);
+
+    /* the budget is shared by both segments */
+    iov[0].iov_base = data;
+    iov[0].iov_len = 7;
+    iov[1].iov_base = data + 7;
+    iov[1].iov_len = 8;
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_iovec(mh, iov, 2,
+                &consumed));
+    CuAssertTrue(tc, 10 == consumed);
+    CuAssertTrue(tc, PWP_MSGTYPE_UNCHOKE == pc.mtype);
+
+    /* the rest is dispatched later */
+    iov[0].iov_base = data + consumed;
+    iov[0].iov_len = 15 - consumed;
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_iovec(mh, iov, 1,
+                &consumed));
+    CuAssertTrue(tc, 5 == consumed);
+    CuAssertTrue(tc, PWP_MSGTYPE_CHOKE == pc.mtype);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_budgeted_dispatch_stops_after_max_bytes(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+    unsigned int consumed;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new2(&pc, NULL, 0, 5);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_INTERESTED);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_UNCHOKE);
+
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_budgeted(mh, data, 10, &consumed));
+    CuAssertTrue(tc, 5 == consumed);
+    CuAssertTrue(tc, PWP_MSGTYPE_INTERESTED == pc.mtype);
+
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_budgeted(mh, data + 5, 5, &consumed));
+    CuAssertTrue(tc, 5 == consumed);
+    CuAssertTrue(tc, PWP_MSGTYPE_UNCHOKE == pc.mtype);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_budgeted_dispatch_stops_after_max_msgs(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    char data[100];
+    char* ptr;
+    void* mh;
+    unsigned int consumed;
+
+    ptr = data;
+    memset(&pc, 0, sizeof(fake_pc_t));
+    mh = pwp_msghandler_new(&pc);
+    pwp_msghandler_set_max_workload_msgs(mh, 2);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_INTERESTED);
+    bitstream_write_uint32(&ptr, fe(0));
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_UNCHOKE);
+
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_budgeted(mh, data, 14, &consumed));
+    CuAssertTrue(tc, 9 == consumed);
+    CuAssertTrue(tc, -1 == pc.mtype);
+
+    /* unbudgeted dispatch reads everything */
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_buffer(mh, data + 9, 5));
+    CuAssertTrue(tc, PWP_MSGTYPE_UNCHOKE == pc.mtype);
+    pwp_msghandler_release(mh);
+}
+
+void TestPWP_streamed_handler_receives_empty_message(
+    CuTest * tc
+)
+{
+    fake_pc_t pc = { 0 };
+    fake_frame_t f;
+    char data[100];
+    char* ptr;
+    void* mh;
+    pwp_msghandler_item_t handlers = {
+        .streamed = __streamed, .udata = &f
+    };
+
+    ptr = data;
+    memset(&f, 0, sizeof(f));
+    f.total = 99;
+    mh = pwp_msghandler_new2(&pc, &handlers, 1, 100);
+    bitstream_write_uint32(&ptr, fe(1));
+    bitstream_write_byte(&ptr,PWP_MSGTYPE_CANCEL+1);
+
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_buffer(mh, data, 5));
+    CuAssertTrue(tc, 1 == f.ncalls);
+    CuAssertTrue(tc, 0 == f.len);
+    CuAssertTrue(tc, 0 == f.total);
+    pwp_msghandler_release(mh);
+}
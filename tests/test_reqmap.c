@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "CuTest.h"
+
+#include "bitfield.h"
+#include "pwp_connection.h"
+#include "pwp_reqmap.h"
+
+static bt_block_t __blk(unsigned int piece_idx, unsigned int offset,
+        unsigned int len)
+{
+    bt_block_t b = { piece_idx, offset, len };
+    return b;
+}
+
+void TestPWP_reqmap_put_and_get(
+    CuTest * tc
+)
+{
+    void* rm = pwp_reqmap_new(4);
+    bt_block_t a = __blk(1, 0, 16384), b = __blk(0, 16384, 16384);
+    int va, vb;
+
+    CuAssertTrue(tc, NULL == pwp_reqmap_put(rm, &a, &va));
+    CuAssertTrue(tc, NULL == pwp_reqmap_put(rm, &b, &vb));
+    CuAssertTrue(tc, 2 == pwp_reqmap_count(rm));
+    CuAssertTrue(tc, &va == pwp_reqmap_get(rm, &a));
+    CuAssertTrue(tc, &vb == pwp_reqmap_get(rm, &b));
+
+    /* replacing returns the old value */
+    CuAssertTrue(tc, &va == pwp_reqmap_put(rm, &a, &vb));
+    CuAssertTrue(tc, 2 == pwp_reqmap_count(rm));
+    pwp_reqmap_free(rm);
+}
+
+void TestPWP_reqmap_remove_keeps_other_entries_reachable(
+    CuTest * tc
+)
+{
+    void* rm = pwp_reqmap_new(4);
+    int vals[1000];
+    unsigned int i;
+
+    /* enough entries to grow several times */
+    for (i = 0; i < 1000; i++)
+    {
+        bt_block_t b = __blk(i / 16, (i % 16) * 16384, 16384);
+        pwp_reqmap_put(rm, &b, &vals[i]);
+    }
+    CuAssertTrue(tc, 1000 == pwp_reqmap_count(rm));
+
+    for (i = 0; i < 1000; i += 2)
+    {
+        bt_block_t b = __blk(i / 16, (i % 16) * 16384, 16384);
+        CuAssertTrue(tc, &vals[i] == pwp_reqmap_remove(rm, &b));
+        CuAssertTrue(tc, NULL == pwp_reqmap_remove(rm, &b));
+    }
+    CuAssertTrue(tc, 500 == pwp_reqmap_count(rm));
+
+    for (i = 0; i < 1000; i++)
+    {
+        bt_block_t b = __blk(i / 16, (i % 16) * 16384, 16384);
+        CuAssertTrue(tc, (i % 2 ? &vals[i] : NULL) == pwp_reqmap_get(rm, &b));
+    }
+    pwp_reqmap_free(rm);
+}
+
+void TestPWP_reqmap_iterates_over_every_value(
+    CuTest * tc
+)
+{
+    void* rm = pwp_reqmap_new(0);
+    pwp_reqmap_iterator_t iter;
+    int vals[20], seen = 0;
+    unsigned int i;
+    int* v;
+
+    for (i = 0; i < 20; i++)
+    {
+        bt_block_t b = __blk(i, 0, 1);
+        pwp_reqmap_put(rm, &b, &vals[i]);
+    }
+
+    for (pwp_reqmap_iterator(rm, &iter);
+         (v = pwp_reqmap_iterator_next_value(rm, &iter));)
+        seen |= 1 << (v - vals);
+    CuAssertTrue(tc, (1 << 20) - 1 == seen);
+    pwp_reqmap_free(rm);
+}
@@ -0,0 +1,153 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "CuTest.h"
+
+#include "bitfield.h"
+#include "pwp_connection.h"
+#include "pwp_handshaker.h"
+#include "pwp_session.h"
+#include "bitstream.h"
+#include "chunkybar.h"
+
+static char* __mock_infohash = "abcdef12345678900000";
+static char* __mock_their_peer_id = "00000000000000000000";
+static char* __mock_my_peer_id = "00000000000000000001";
+
+/**
+ * Flip endianess
+ **/
+static uint32_t fe(uint32_t i)
+{
+    uint32_t o;
+    char *c = (char *)&i;
+    char *p = (char *)&o;
+
+    p[0] = c[3];
+    p[1] = c[2];
+    p[2] = c[1];
+    p[3] = c[0];
+
+    return o;
+}
+
+static int __MOCK_send(
+    void* s __attribute__((__unused__)),
+    const void *peer __attribute__((__unused__)),
+    const void *send_data __attribute__((__unused__)),
+    const int len __attribute__((__unused__)))
+{
+    return 1;
+}
+
+static int __handshake_received(void *udata, void *session, pwp_handshake_t *hs)
+{
+    pwp_conn_cbs_t funcs = {
+        .send = __MOCK_send,
+    };
+    pwp_conn_t* pc = pwp_session_get_conn(session);
+
+    *(int*)udata = 1;
+    pwp_conn_set_piece_info(pc,20,20);
+    pwp_conn_set_cbs(pc, &funcs, NULL);
+    pwp_conn_set_progress(pc, chunky_new(20));
+    return 1;
+}
+
+static char* __write_handshake_and_have(char* ptr)
+{
+    pwp_handshake_t hs;
+
+    pwp_handshake_init(&hs, __mock_infohash, __mock_their_peer_id);
+    memcpy(ptr, &hs, sizeof(hs));
+    ptr += sizeof(hs);
+    bitstream_write_uint32(&ptr, fe(5));       /*  length */
+    bitstream_write_byte(&ptr, 4);        /*  HAVE */
+    bitstream_write_uint32(&ptr, fe(1));       /*  piece 1 */
+    return ptr;
+}
+
+void TestPWP_session_dispatches_messages_that_follow_handshake(
+    CuTest * tc
+)
+{
+    char msg[1000], *ptr = msg;
+    void *s;
+    int handshaked = 0;
+
+    ptr = __write_handshake_and_have(ptr);
+
+    s = pwp_session_new(__mock_infohash, __mock_my_peer_id);
+    pwp_session_set_handshake_cb(s, __handshake_received, &handshaked);
+
+    /* handshake and HAVE arrive within the same read */
+    CuAssertTrue(tc, 1 == pwp_session_dispatch_from_buffer(s, msg, ptr - msg));
+    CuAssertTrue(tc, 1 == handshaked);
+    CuAssertTrue(tc, pwp_conn_flag_is_set(pwp_session_get_conn(s),
+                PC_HANDSHAKE_RECEIVED));
+    CuAssertTrue(tc, pwp_conn_peer_has_piece(pwp_session_get_conn(s), 1));
+    pwp_session_release(s);
+}
+
+void TestPWP_session_dispatches_messages_split_across_handshake(
+    CuTest * tc
+)
+{
+    char msg[1000], *ptr = msg;
+    void *s;
+    int handshaked = 0;
+
+    ptr = __write_handshake_and_have(ptr);
+
+    s = pwp_session_new(__mock_infohash, __mock_my_peer_id);
+    pwp_session_set_handshake_cb(s, __handshake_received, &handshaked);
+
+    /* first read ends within the handshake */
+    CuAssertTrue(tc, 1 == pwp_session_dispatch_from_buffer(s, msg, 60));
+    CuAssertTrue(tc, 0 == handshaked);
+    CuAssertTrue(tc, 1 == pwp_session_dispatch_from_buffer(s, msg + 60, ptr - msg - 60));
+    CuAssertTrue(tc, 1 == handshaked);
+    CuAssertTrue(tc, pwp_conn_peer_has_piece(pwp_session_get_conn(s), 1));
+    pwp_session_release(s);
+}
+
+void TestPWP_session_disconnects_on_bad_handshake(
+    CuTest * tc
+)
+{
+    char msg[1000], *ptr = msg;
+    void *s;
+
+    ptr = __write_handshake_and_have(ptr);
+
+    s = pwp_session_new("abcdef12345678900001", __mock_my_peer_id);
+    CuAssertTrue(tc, 0 == pwp_session_dispatch_from_buffer(s, msg, ptr - msg));
+    pwp_session_release(s);
+}
+
+void TestPWP_session_rejects_oversized_bitfield_from_its_header(
+    CuTest * tc
+)
+{
+    char msg[1000], *ptr = msg;
+    pwp_handshake_t hs;
+    void *s;
+    int handshaked = 0;
+
+    pwp_handshake_init(&hs, __mock_infohash, __mock_their_peer_id);
+    memcpy(ptr, &hs, sizeof(hs));
+    ptr += sizeof(hs);
+
+    /* 20 pieces need 3 bytes; rejected before any of the payload arrives */
+    bitstream_write_uint32(&ptr, fe(1 + 4));
+    bitstream_write_byte(&ptr, PWP_MSGTYPE_BITFIELD);
+
+    s = pwp_session_new(__mock_infohash, __mock_my_peer_id);
+    pwp_session_set_handshake_cb(s, __handshake_received, &handshaked);
+    CuAssertTrue(tc, 0 == pwp_session_dispatch_from_buffer(s, msg, ptr - msg));
+    CuAssertTrue(tc, 1 == handshaked);
+    pwp_session_release(s);
+}
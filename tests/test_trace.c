@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "CuTest.h"
+
+#include "bitfield.h"
+#include "pwp_connection.h"
+#include "pwp_trace.h"
+#include "test_connection.h"
+
+void TestPWP_trace_keeps_most_recent_events_oldest_first(
+    CuTest * tc
+)
+{
+    void* t = pwp_trace_new(8);
+    pwp_trace_rec_t recs[16];
+    unsigned int i;
+
+    pwp_trace_set_filter(t, PWP_TRACE_LEVEL_BLOCK, PWP_TRACE_ALL_MSGS);
+    for (i = 0; i < 20; i++)
+        pwp_trace_add(t, PWP_TRACE_SEND, PWP_MSGTYPE_REQUEST, i, 0, 16384, 7);
+
+    /* the slot after the newest event may be mid-write, so it's dropped */
+    CuAssertTrue(tc, 7 == pwp_trace_read(t, recs, 16));
+    for (i = 0; i < 7; i++)
+    {
+        CuAssertTrue(tc, 13 + i == recs[i].seq);
+        CuAssertTrue(tc, 13 + i == recs[i].piece_idx);
+        CuAssertTrue(tc, 7 == recs[i].tick);
+    }
+
+    CuAssertTrue(tc, 2 == pwp_trace_read(t, recs, 2));
+    CuAssertTrue(tc, 18 == recs[0].piece_idx);
+    CuAssertTrue(tc, 19 == recs[1].piece_idx);
+    pwp_trace_free(t);
+}
+
+void TestPWP_trace_filters_by_level_and_msg_type(
+    CuTest * tc
+)
+{
+    void* t = pwp_trace_new(8);
+    pwp_trace_rec_t recs[8];
+
+    /* nothing is recorded by default */
+    pwp_trace_add(t, PWP_TRACE_READ, PWP_MSGTYPE_CHOKE, 0, 0, 0, 0);
+    CuAssertTrue(tc, 0 == pwp_trace_read(t, recs, 8));
+
+    pwp_trace_set_filter(t, PWP_TRACE_LEVEL_STATE, PWP_TRACE_ALL_MSGS);
+    pwp_trace_add(t, PWP_TRACE_READ, PWP_MSGTYPE_PIECE, 1, 0, 16384, 0);
+    pwp_trace_add(t, PWP_TRACE_READ, PWP_MSGTYPE_CHOKE, 0, 0, 0, 0);
+
+    pwp_trace_set_filter(t, PWP_TRACE_LEVEL_BLOCK, 1 << PWP_MSGTYPE_REQUEST);
+    pwp_trace_add(t, PWP_TRACE_READ, PWP_MSGTYPE_PIECE, 1, 0, 16384, 0);
+    pwp_trace_add(t, PWP_TRACE_READ, PWP_MSGTYPE_REQUEST, 2, 0, 16384, 0);
+
+    CuAssertTrue(tc, 2 == pwp_trace_read(t, recs, 8));
+    CuAssertTrue(tc, PWP_MSGTYPE_CHOKE == recs[0].type);
+    CuAssertTrue(tc, PWP_TRACE_LEVEL_STATE == recs[0].level);
+    CuAssertTrue(tc, PWP_MSGTYPE_REQUEST == recs[1].type);
+    CuAssertTrue(tc, PWP_TRACE_LEVEL_BLOCK == recs[1].level);
+    pwp_trace_free(t);
+}
+
+void TestPWP_trace_records_are_decoded_into_text(
+    CuTest * tc
+)
+{
+    void *pc, *t = pwp_trace_new(8);
+    pwp_trace_rec_t recs[8];
+    test_sender_t sender;
+    char msg[1000], buf[128];
+    bt_block_t blk = { 1, 0, 16384 };
+    pwp_conn_cbs_t funcs = {
+        .send = __FUNC_send,
+    };
+
+    __sender_set(&sender, NULL, msg);
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_piece_info(pc, 20, 20);
+    pwp_conn_set_cbs(pc, &funcs, &sender);
+    pwp_conn_set_trace(pc, t);
+    pwp_trace_set_filter(t, PWP_TRACE_LEVEL_BLOCK, PWP_TRACE_ALL_MSGS);
+
+    pwp_conn_send_statechange(pc, PWP_MSGTYPE_INTERESTED);
+    pwp_conn_send_request(pc, &blk);
+
+    CuAssertTrue(tc, 2 == pwp_trace_read(t, recs, 8));
+    pwp_trace_format(&recs[0], buf, sizeof(buf));
+    CuAssertTrue(tc, 0 == strcmp(buf, "send,interested"));
+    pwp_trace_format(&recs[1], buf, sizeof(buf));
+    CuAssertTrue(tc, 0 == strcmp(buf,
+                "send,request,piece_idx=1 offset=0 len=16384"));
+    pwp_conn_release(pc);
+    pwp_trace_free(t);
+}